@@ -0,0 +1,163 @@
+// Time the core Sequence operations on several value distributions and
+// block sizes, and write the results as JSON (in the layout of Google
+// Benchmark's --benchmark_format=json), so that runs can be diffed to
+// catch regressions. A human-readable summary goes to stderr.
+//
+//   make && ./bench_ops [n_elem] [min_time_secs] > results.json
+//
+// Every benchmark reports ns_per_elem, the time per input element (or per
+// query, for get and contains), and bytes_per_elem, the encoded size of
+// its output Sequence per output element (0 if it doesn't build one).
+// Set operations are run on pairs whose sizes differ by 1x to 1000x.
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include "pef.h"
+#include "distributions.h"
+
+using namespace pef;
+using namespace bench;
+
+static std::mt19937_64 gen(12345);
+
+// Minimum wall time spent on each benchmark (seconds).
+static double min_time = 0.1;
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    double ns_per_iter;
+    double ns_per_elem;
+    double bytes_per_elem;
+};
+
+static std::vector<Result> results;
+
+// Run *op* until *min_time* has passed (and at least once), then record
+// the mean time per call over *n_elem* elements. *op* returns its output
+// Sequence (empty if it doesn't build one), which is measured afterwards.
+template <class Op>
+void measure(const std::string& name, size_t n_elem, Op op) {
+    typedef std::chrono::steady_clock clock;
+    uint64_t iterations = 0;
+    std::unique_ptr<Sequence> out;
+    const clock::time_point start = clock::now();
+    double secs = 0;
+    do {
+        out.reset(new Sequence(op()));
+        ++iterations;
+        secs = std::chrono::duration<double>(clock::now() - start).count();
+    } while (secs < min_time);
+    Result r;
+    r.name = name;
+    r.iterations = iterations;
+    r.ns_per_iter = secs * 1e9 / iterations;
+    r.ns_per_elem = r.ns_per_iter / std::max<size_t>(n_elem, 1);
+    r.bytes_per_elem = out->n_elem() ? (double)out->serialize().size() / out->n_elem() : 0.0;
+    results.push_back(r);
+    std::cerr << "  " << std::left << std::setw(44) << name << std::right
+              << std::fixed << std::setprecision(3)
+              << std::setw(12) << r.ns_per_elem << " ns/elem"
+              << std::setw(10) << r.bytes_per_elem << " bytes/elem\n";
+}
+
+// Keeps the optimizer from dropping results we don't otherwise use.
+static volatile uint64_t sink = 0;
+
+void run(const std::string& dist, const std::vector<uint64_t>& values, uint32_t block_size) {
+    const std::string prefix = dist + "/" + std::to_string(block_size) + "/";
+    const size_t n = values.size();
+
+    measure(prefix + "encode", n, [&]() { return Sequence(values, block_size); });
+    const Sequence seq(values, block_size);
+    measure(prefix + "decode", n, [&]() {
+        sink += seq.decode().back();
+        return Sequence();
+    });
+
+    // Random point queries: indices for get, and values (half present)
+    // for contains.
+    const size_t n_queries = 1 << 16;
+    std::vector<uint64_t> indices(n_queries), queries(n_queries);
+    for (size_t k = 0; k < n_queries; ++k) {
+        indices[k] = gen() % n;
+        queries[k] = (k % 2) ? values[gen() % n] : gen() % (values.back() + 1);
+    }
+    measure(prefix + "get", n_queries, [&]() {
+        uint64_t s = 0;
+        for (const uint64_t i: indices) s += seq.get(i);
+        sink += s;
+        return Sequence();
+    });
+    measure(prefix + "contains", n_queries, [&]() {
+        uint64_t s = 0;
+        for (const uint64_t q: queries) s += seq.contains(q);
+        sink += s;
+        return Sequence();
+    });
+
+    // Multisets (each value repeated 1-3 times) for unique and filter_by_count.
+    std::vector<uint64_t> multi;
+    for (const uint64_t v: values) multi.insert(multi.end(), 1 + gen() % 3, v);
+    const Sequence multi_seq(multi, block_size);
+    measure(prefix + "unique", multi.size(), [&]() { return multi_seq.unique(); });
+    measure(prefix + "filter_by_count", multi.size(), [&]() {
+        return multi_seq.filter_by_count(2, 3, false);
+    });
+
+    // Set operations against a second list from the same distribution,
+    // subsampled to 1/ratio of the size.
+    const std::vector<uint64_t> other_values = dist == "uniform" ? uniform_integers(n, gen)
+        : dist == "clustered" ? clustered_integers(n, gen)
+        : dist == "dense" ? dense_integers(n, gen)
+        : zipf_integers(n, gen);
+    const unsigned ratios[] = {1, 10, 100, 1000};
+    for (const unsigned ratio: ratios) {
+        const Sequence other(subsample(other_values, 1.0 / ratio, gen), block_size);
+        const std::string pair = "/1:" + std::to_string(ratio);
+        const size_t n_in = n + other.n_elem();
+        measure(prefix + "intersect" + pair, n_in, [&]() { return seq.intersect(other); });
+        measure(prefix + "union" + pair, n_in, [&]() { return seq | other; });
+        measure(prefix + "difference" + pair, n_in, [&]() { return seq - other; });
+    }
+}
+
+void write_json(std::ostream& out, size_t n) {
+    out << "{\n  \"context\": {\n"
+        << "    \"n_elem\": " << n << ",\n"
+        << "    \"min_time\": " << min_time << "\n"
+        << "  },\n  \"benchmarks\": [\n";
+    for (size_t k = 0; k < results.size(); ++k) {
+        const Result& r = results[k];
+        out << "    {\"name\": \"" << r.name << "\""
+            << ", \"iterations\": " << r.iterations
+            << ", \"real_time\": " << std::setprecision(9) << r.ns_per_iter
+            << ", \"time_unit\": \"ns\""
+            << ", \"ns_per_elem\": " << r.ns_per_elem
+            << ", \"bytes_per_elem\": " << r.bytes_per_elem << "}"
+            << (k + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    const size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1 << 20;
+    if (argc > 2) min_time = std::strtod(argv[2], nullptr);
+    const std::pair<std::string, std::vector<uint64_t> > dists[] = {
+        {"uniform", uniform_integers(n, gen)},
+        {"clustered", clustered_integers(n, gen)},
+        {"dense", dense_integers(n, gen)},
+        {"zipf", zipf_integers(n, gen)}
+    };
+    const uint32_t block_sizes[] = {64, 128, 256, 512};
+    for (const auto& dist: dists) {
+        for (const uint32_t block_size: block_sizes) {
+            std::cerr << dist.first << ", block_size " << block_size << "\n";
+            run(dist.first, dist.second, block_size);
+        }
+    }
+    write_json(std::cout, n);
+    return 0;
+}
@@ -0,0 +1,53 @@
+// Compare the size of Sequences with fixed-size blocks against optimally
+// partitioned ones (Sequence::optimal), on uniform, clustered and dense
+// values.
+//
+//   make && ./bench_partition [n_elem]
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include "pef.h"
+#include "distributions.h"
+
+using namespace pef;
+using namespace bench;
+
+static std::mt19937_64 gen(12345);
+
+template <class Build>
+void report(const std::string& name, size_t n, Build build) {
+    const auto start = std::chrono::steady_clock::now();
+    const Sequence seq = build();
+    const double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start
+    ).count();
+    const size_t bytes = seq.serialize().size();
+    std::cout << "  " << std::left << std::setw(16) << name << std::right
+              << std::fixed << std::setprecision(3)
+              << std::setw(10) << 8.0 * bytes / n << " bits/elem"
+              << std::setw(10) << seq.n_blocks() << " blocks"
+              << std::setw(10) << n / secs / 1e6 << " M elem/s\n";
+}
+
+void run(const std::string& name, const std::vector<uint64_t>& values) {
+    std::cout << name << " (" << values.size() << " elements)\n";
+    const uint32_t block_sizes[] = {64, 128, 256, 512};
+    for (const uint32_t block_size: block_sizes) {
+        report("fixed " + std::to_string(block_size), values.size(), [&]() {
+            return Sequence(values, block_size);
+        });
+    }
+    report("optimal", values.size(), [&]() {
+        return Sequence::optimal(values);
+    });
+}
+
+int main(int argc, char** argv) {
+    const size_t n = (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : 1 << 22;
+    run("uniform", uniform_integers(n, gen));
+    run("clustered", clustered_integers(n, gen));
+    run("dense", dense_integers(n, gen));
+    return 0;
+}
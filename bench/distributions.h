@@ -0,0 +1,77 @@
+// Sorted test inputs for the benchmarks, shaped like the posting lists
+// we see in practice.
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+namespace bench {
+
+// *n* uniformly distributed integers in [0, 64n).
+inline std::vector<uint64_t> uniform_integers(size_t n, std::mt19937_64& gen) {
+    std::uniform_int_distribution<uint64_t> dist(0, 64 * n - 1);
+    std::vector<uint64_t> o(n);
+    for (auto& v: o) v = dist(gen);
+    std::sort(o.begin(), o.end());
+    return o;
+}
+
+// Posting-list-like values: runs of dense clusters of random lengths,
+// separated by large gaps.
+inline std::vector<uint64_t> clustered_integers(size_t n, std::mt19937_64& gen) {
+    std::geometric_distribution<uint64_t> cluster_size(1.0 / 2000),
+                                          dense_gap(0.5),
+                                          sparse_gap(1.0 / 100000);
+    std::vector<uint64_t> o;
+    uint64_t v = 0;
+    while (o.size() < n) {
+        v += sparse_gap(gen);
+        for (uint64_t k = cluster_size(gen); k > 0 && o.size() < n; --k) {
+            v += dense_gap(gen);
+            o.push_back(v);
+        }
+    }
+    return o;
+}
+
+// Distinct values covering most of their range, like date or category
+// postings: long runs of consecutive integers with occasional holes.
+inline std::vector<uint64_t> dense_integers(size_t n, std::mt19937_64& gen) {
+    std::bernoulli_distribution hole(0.02), long_hole(0.001);
+    std::vector<uint64_t> o;
+    for (uint64_t v = 0; o.size() < n; ++v) {
+        if (long_hole(gen)) v += 1000;
+        if (!hole(gen)) o.push_back(v);
+    }
+    return o;
+}
+
+// Gaps with a Zipf-like (power law) distribution, P(gap >= g) ~ g^-0.5:
+// mostly small gaps, with a heavy tail of very large ones.
+inline std::vector<uint64_t> zipf_integers(size_t n, std::mt19937_64& gen) {
+    std::uniform_real_distribution<double> u(1e-9, 1.0);
+    std::vector<uint64_t> o(n);
+    uint64_t v = 0;
+    for (auto& x: o) {
+        v += (uint64_t)std::min(1e9, std::floor(std::pow(u(gen), -2.0)));
+        x = v;
+    }
+    return o;
+}
+
+// Each element of *values* with probability *p*, in order.
+inline std::vector<uint64_t> subsample(
+    const std::vector<uint64_t>& values,
+    double p,
+    std::mt19937_64& gen
+) {
+    std::bernoulli_distribution keep(p);
+    std::vector<uint64_t> o;
+    for (const uint64_t v: values) {
+        if (keep(gen)) o.push_back(v);
+    }
+    return o;
+}
+
+} // end namespace bench
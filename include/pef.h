@@ -2,14 +2,23 @@
 /* pef - Partitioned Elias-Fano encoding of a sequence of integers. */
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 #include <cassert>
 #include <cstdint>
@@ -31,6 +40,29 @@ inline uint64_t ceil_div_u64(uint64_t a, uint64_t b);
 // of least significant zero bits before the first 1.
 inline uint32_t ctz64(uint64_t x);
 
+// number of set ('1') bits in an ULL.
+inline uint32_t popcount64(uint64_t x);
+
+// bit position of the *k*th set bit (counting from 0) in the word *x*.
+// Requires popcount64(x) > k.
+inline uint32_t select_in_word(uint64_t x, uint32_t k);
+
+// bit position of the *k*th set bit (counting from 0) in a bitarray
+// *H*, or UINT64_MAX if *H* has *k* or fewer set bits.
+inline uint64_t select1(
+    const uint64_t *H, // size n_words
+    size_t n_words,
+    uint64_t k
+);
+
+// bit position of the *k*th unset bit (counting from 0) in a bitarray
+// *H*, or UINT64_MAX if *H* has *k* or fewer unset bits.
+inline uint64_t select0(
+    const uint64_t *H, // size n_words
+    size_t n_words,
+    uint64_t k
+);
+
 // bit position of the next set ('1') bit from the position *pos*
 // onwards in a bitarray *H*.
 inline uint64_t next_one_at_or_after(
@@ -43,6 +75,9 @@ inline uint64_t next_one_at_or_after(
 // to the smallest element greater than or equal to *q*
 size_t supremum_index(const std::vector<uint64_t>& v, const uint64_t q);
 
+// same as above, for a sorted array *v* of *n* elements.
+size_t supremum_index(const uint64_t* v, size_t n, const uint64_t q);
+
 /*
  * Class: BitReader
  * ----------------
@@ -95,6 +130,20 @@ struct BitWriter {
     void flush();
 };
 
+// How the elements of a block are stored (EFBlockMetadata::encoding).
+enum BlockEncoding : uint8_t {
+    // Elias-Fano: *l* low bits per element packed densely in *low*, and
+    // the remaining high bits unary-coded in *high*.
+    BLOCK_EF = 0,
+    // Plain bitmap of the block's range (distinct elements only): bit
+    // (x - floor) of *high* is set for each element x, and *low* is empty.
+    // Smaller than Elias-Fano for dense blocks, and faster to search.
+    BLOCK_BITMAP = 1,
+    // A single run of consecutive integers floor, floor + 1, ...,
+    // floor + n_elem - 1. Only the header is stored.
+    BLOCK_RUN = 2
+};
+
 /*
  * Struct: EFBlockMetadata
  * -----------------------
@@ -104,7 +153,8 @@ struct BitWriter {
 struct EFBlockMetadata {
     uint32_t n_elem;         // total number of integers ("elements") in this block.
     uint8_t  l;              // number of least significant bits in the "low" bits.
-    uint8_t  pad[3];         // so that the whole block remains divisible by 8 bytes.
+    uint8_t  encoding;       // a BlockEncoding (BLOCK_EF in older files).
+    uint8_t  pad[2];         // so that the whole block remains divisible by 8 bytes.
     uint64_t floor;          // the least element.
     uint64_t low_words;      // total 8-byte blocks in the low bit representation.
     uint64_t high_words;     // total 8-byte blocks in the high bit representation.
@@ -121,7 +171,9 @@ static_assert(
 /*
  * Struct: EFBlock
  * ---------------
- * Elias-Fano encoding of a non-decreasing sequence of integers.
+ * Elias-Fano encoding of a non-decreasing sequence of integers. Blocks that
+ * are dense enough use one of the other BlockEncodings instead, whichever
+ * is smallest.
 */
 struct EFBlock {
     EFBlockMetadata meta {};
@@ -138,12 +190,29 @@ struct EFBlock {
     // integers uniformly distributed between 0 and *range*.
     static inline uint32_t choose_l(uint64_t range, uint32_t n);
 
+    // Choose the smallest encoding for *n* integers spanning *range*
+    // (last - first + 1). *distinct* is true if none of them repeat.
+    static BlockEncoding choose_encoding(uint64_t range, uint32_t n, bool distinct);
+
     // Print out everything in this block to stdout.
     void show() const;
 
     // Construct from a raw sequence of integers.
     EFBlock(const uint64_t* values, uint32_t n_elem);
 
+    // Number of bytes that EFBlock(values, n_elem) occupies when
+    // serialized as [header, low, high], computed without encoding it.
+    static size_t encoded_size(const uint64_t* values, uint32_t n_elem);
+    // Same, given the range of the values and whether they're distinct.
+    static size_t encoded_size(uint64_t range, uint32_t n_elem, bool distinct);
+
+    // Encode *n_elem* nondecreasing *values* straight into *dst* as
+    // [header, low, high], the layout of a Sequence's payload, without
+    // building an EFBlock. *dst* must be 8-byte aligned with room for
+    // encoded_size(values, n_elem) bytes. Returns the number of bytes
+    // written.
+    static size_t encode_into(const uint64_t* values, uint32_t n_elem, uint8_t* dst);
+
     // Decode to the original sequence of integers.
     std::vector<uint64_t> decode() const;
 
@@ -163,6 +232,42 @@ struct EFBlock {
     size_t init_from_stream(std::istream& in);
 };
 
+/*
+ * Struct: EFBlockView
+ * -------------------
+ * Read-only view of an EFBlock serialized as [header, low, high] (the
+ * layout used in a Sequence's payload). Reads individual elements
+ * without decoding the rest of the block.
+*/
+struct EFBlockView {
+    EFBlockMetadata meta {};
+    // Packed low bits (size meta.low_words)
+    const uint64_t* low = nullptr;
+    // Unary-encoded high bits (size meta.high_words)
+    const uint64_t* high = nullptr;
+
+    // Empty view.
+    EFBlockView() {}
+
+    // View the serialized EFBlock that starts at *base*.
+    explicit EFBlockView(const uint8_t* base);
+
+    // Value of the i^th element in this block. Finds the i^th set bit
+    // in the high bits with select1 and reads only the i^th low bits.
+    uint64_t get(uint32_t i) const;
+
+    // Index of the first element greater than or equal to *q*, or
+    // meta.n_elem if there is none. Jumps straight to the high-bit bucket
+    // (q - floor) >> l with select0 and only scans the elements in that
+    // bucket. If found, the element itself is written to *value*.
+    uint32_t lower_bound(uint64_t q, uint64_t& value) const;
+    uint32_t lower_bound(uint64_t q) const;
+
+    // Decode every element into *out*, which must have room for
+    // meta.n_elem integers.
+    void decode(uint64_t* out) const;
+};
+
 /*
  * Struct: SequenceMetadata
  * -------------------
@@ -172,32 +277,270 @@ struct EFBlock {
 #pragma pack(push, 1)
 struct SequenceMetadata {
     char     magic[4];       // file magic ("PPEF")
-    uint32_t version;        // 1
+    uint32_t version;        // 1, or 2 for the cache-line aligned layout
     uint64_t n_elem;         // total number of compressed elements
     uint32_t block_size;     // compression block size (in # elements)
-    uint32_t reserved;       // always 0
-    uint64_t n_blocks;       // ceil(n_elem / block_size)
+    uint32_t reserved;       // flags (see below); 0 for fixed-size blocks
+    uint64_t n_blocks;       // ceil(n_elem / block_size) for fixed-size blocks
     uint64_t payload_offset; // byte offset of actual data part of file
 };
 #pragma pack(pop)
 // Desirable for byte-level alignment.
 static_assert(sizeof(SequenceMetadata) == 40, "SequenceMetadata must be 40 bytes");
 
+// Version 2 files lay out the block index as one table of BlockEntry,
+// starting 64 bytes into the file, in place of version 1's separate
+// arrays. A lookup then reads a block's highest element, offset and floor
+// from a single cache line, rather than one line from each array. The
+// table and every block in the payload start on a V2_ALIGN-byte boundary,
+// so a block's header and first words share a cache line:
+//
+//   header | pad | BlockEntry[n_blocks] | pad | block0 | pad | block1 | ...
+struct BlockEntry {
+    uint64_t last;   // highest element in the block
+    uint64_t offset; // byte offset of the block from the start of the payload
+    uint64_t begin;  // index of the block's first element
+    uint64_t floor;  // lowest element in the block
+};
+static_assert(sizeof(BlockEntry) == 32, "BlockEntry must be 32 bytes");
+
+// Alignment of the block table and of each block in version 2 files (bytes).
+const uint64_t V2_ALIGN = 64;
+
+// Flag in SequenceMetadata::reserved: blocks have variable lengths (up to
+// block_size), and the block index has a third array with the index of the
+// first element of each block. See Sequence::optimal.
+const uint32_t SEQUENCE_VARIABLE_BLOCKS = 1;
+
+// Choose block boundaries for *n* nondecreasing *values* that approximately
+// minimize their encoded size as a Sequence with variable-length blocks,
+// including the cost of the block index. This is the approximate dynamic
+// program of Ottaviano & Venturini ("Partitioned Elias-Fano Indexes", 2014),
+// which finds a partition within a factor (1 + eps1)(1 + eps2) of the
+// optimal one in O(n log(1/eps1) / log(1 + eps2)) time. Blocks hold at most
+// *max_block_size* elements. Returns the index of the first element of
+// each block.
+std::vector<uint64_t> optimal_partition(
+    const uint64_t* values,
+    size_t n,
+    uint32_t max_block_size,
+    double eps1 = 0.03,
+    double eps2 = 0.3
+);
+
+// Counters for a BlockCache.
+struct BlockCacheStats {
+    uint64_t hits = 0;           // lookups that found their block
+    uint64_t misses = 0;         // lookups that had to decode it
+    uint64_t bytes = 0;          // decoded elements currently cached (bytes)
+    uint64_t capacity_bytes = 0; // budget for *bytes*
+};
+
+/*
+ * Class: BlockCache
+ * -----------------
+ * Bounded, thread-safe cache of decoded blocks of one Sequence, keyed by
+ * block index. Blocks are spread over *n_shards* independently locked
+ * shards (by block index, so neighbouring blocks land in different ones),
+ * each evicting its least recently used blocks once it holds more than
+ * its share of the byte budget.
+*/
+class BlockCache {
+public:
+    typedef std::shared_ptr<const std::vector<uint64_t> > Block;
+
+    BlockCache(size_t capacity_bytes, unsigned n_shards = 16);
+
+    // Block *bi* if it's cached (marking it most recently used), else
+    // null. Counts a hit or a miss.
+    Block find(uint64_t bi);
+
+    // Cache the decoded block *bi*, returning it. Blocks too big for a
+    // shard are returned without being cached.
+    Block insert(uint64_t bi, std::vector<uint64_t> values);
+
+    // Drop every block (the counters are kept).
+    void clear();
+
+    BlockCacheStats stats() const;
+
+private:
+    struct Shard {
+        std::mutex mutex;
+        // Most recently used first.
+        std::list<std::pair<uint64_t, Block> > lru;
+        std::unordered_map<uint64_t, std::list<std::pair<uint64_t, Block> >::iterator> index;
+        size_t bytes = 0;
+    };
+    std::vector<std::unique_ptr<Shard> > shards_;
+    size_t capacity_bytes_;
+    size_t shard_capacity_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+
+    Shard& shard_of(uint64_t bi) { return *shards_[bi % shards_.size()]; }
+};
+
+/*
+ * Struct: BlockSkipIndex
+ * ----------------------
+ * Upper level of a Sequence's block index for Sequences with many blocks:
+ * the highest element of each group of SKIP_SAMPLE consecutive blocks, in
+ * Eytzinger (breadth-first) order. Searching it touches one cache line per
+ * level, and the top levels stay in cache across searches, unlike a binary
+ * search over the whole block_last array, whose probes are far apart.
+*/
+// Blocks per group in a BlockSkipIndex.
+const uint64_t SKIP_SAMPLE = 64;
+// Sequences with fewer blocks than this just binary search block_last.
+const uint64_t SKIP_MIN_BLOCKS = 4096;
+
+struct BlockSkipIndex {
+    // keys[k] is the highest element of group rank[k], for k in
+    // [1, n_groups]; keys[0] is unused.
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> rank;
+
+    // Sample the *n_blocks* per-block highest elements at *block_last*,
+    // which are *stride* words apart.
+    BlockSkipIndex(const uint64_t* block_last, uint64_t n_blocks, size_t stride = 1);
+
+    // Number of groups.
+    uint64_t n_groups() const { return keys.size() - 1; }
+
+    // Index of the first group whose highest element is >= q, or
+    // n_groups() if there is none.
+    uint64_t lower_bound(uint64_t q) const;
+};
+
+class SequenceBuilder;
+
 /*
  * Class: Sequence
  * ---------------
  * A nondecreasing sequence of integers in partitioned Elias-Fano (PEF)
  * format. Provides methods to serialize the sequence to a file.
+ *
+ * Thread safety: every const method may be called from any number of
+ * threads at once on the same Sequence (or on copies and views sharing
+ * one buffer). The state they touch behind the scenes is safe to share:
+ * the skip index is published with an atomic compare-and-swap, the
+ * BlockCache locks its shards, and the PEF_STATS counters are atomic.
+ * The non-const methods (append, insert, enable_cache, disable_cache)
+ * must not run concurrently with any other call on the same Sequence.
 */
 class Sequence {
 public:
+    /*
+     * Class: Sequence::Cursor
+     * -----------------------
+     * Forward iterator over a Sequence. Decodes one element at a time
+     * straight out of the payload, keeping a BitReader over the current
+     * block's low bits and a position in its high bits, so that walking
+     * the whole Sequence never allocates. The Sequence must outlive the
+     * Cursor, and append or insert invalidates it. To keep next cheap,
+     * that's checked only when the Cursor moves to another block and in
+     * skip_to, which throw std::runtime_error on a stale Cursor; callers
+     * that can't rule out a change in between should call check_valid.
+    */
+    class Cursor {
+    public:
+        // Start at the first element of *seq*.
+        explicit Cursor(const Sequence& seq);
+
+        // Walk only the elements of *seq* with indices in [begin, end).
+        Cursor(const Sequence& seq, uint64_t begin, uint64_t end);
+
+        // True once we've moved past the last element.
+        bool at_end() const { return index_ >= end_; }
+
+        // Current element. Requires !at_end().
+        uint64_t value() const { return value_; }
+
+        // Index of the current element in the Sequence (n_elem() at the end).
+        uint64_t index() const { return index_; }
+
+        // Move to the next element.
+        void next();
+
+        // Move forward to the first element greater than or equal to *x*.
+        // Never moves backward. Whole blocks are skipped by galloping
+        // (exponential, then binary search) over the block maxima in
+        // block_last_, without touching their payload; within the target
+        // block we jump straight to the high-bit bucket of *x*. So a
+        // skip of distance d costs O(log(d / block_size)) comparisons.
+        void skip_to(uint64_t x);
+
+        // Block of the current element.
+        uint64_t block() const { return block_idx_; }
+
+        // True if the current element is the first of its block and the
+        // whole block lies within the walked range, so that next_block()
+        // passes over exactly that block.
+        bool at_block_start() const {
+            return in_block_ == 0 && index_ + blk_.meta.n_elem <= end_;
+        }
+
+        // Move to the first element of the next block, without decoding
+        // the rest of the current one.
+        void next_block();
+
+        // Throw std::runtime_error if append or insert has run on the
+        // Sequence since we were made, freeing the payload we point into.
+        void check_valid() const;
+
+    private:
+        const Sequence* seq_;
+        // seq_->generation_ when we were made.
+        uint64_t generation_;
+        // Current block and its header / bitvectors.
+        uint64_t block_idx_ = 0;
+        EFBlockView blk_;
+        // Index of the current element in the Sequence and in its block.
+        uint64_t index_ = 0;
+        uint32_t in_block_ = 0;
+        // One past the index of the last element we walk.
+        uint64_t end_ = 0;
+        // Reads the low bits of the next element.
+        BitReader low_ {nullptr, 0};
+        // Word of the high bits that holds the next element's set bit,
+        // with the bits we've already consumed cleared.
+        size_t high_idx_ = 0;
+        uint64_t high_word_ = 0;
+        // Current element, and its high bits.
+        uint64_t value_ = 0;
+        uint64_t hi_ = 0;
+
+        // Position at the first element of block *bi*.
+        void load_block(uint64_t bi);
+
+        // Decode the element at *in_block_* from the current bit positions.
+        void read_value();
+
+        // Jump to element *k* of the current block (k >= in_block_).
+        void seek_in_block(uint32_t k);
+    };
+
     // Construct an empty sequence.
     explicit Sequence(uint32_t block_size = 256);
 
-    // Construct from a raw sequence of nondecreasing integers.
+    // Construct from a raw sequence of nondecreasing integers. Blocks are
+    // independent, so with *n_threads* > 1 they're encoded in parallel.
     explicit Sequence(
         const std::vector<uint64_t>& values, // must be sorted!
-        uint32_t block_size = 256
+        uint32_t block_size = 256,
+        unsigned n_threads = 1
+    );
+
+    // Construct from *n* nondecreasing integers at *values*, encoding
+    // straight from the buffer. Callers that already guarantee the order
+    // can skip the sortedness check with *check_sorted* = false.
+    Sequence(
+        const uint64_t* values, // must be sorted!
+        size_t n,
+        uint32_t block_size = 256,
+        bool check_sorted = true,
+        unsigned n_threads = 1
     );
 
     // Construct from a serialized representation.
@@ -206,29 +549,107 @@ public:
     // Construct from a compressed PPEF file.
     explicit Sequence(const std::string& path);
 
+    // Open a compressed PPEF file as a read-only, memory-mapped view.
+    // Nothing is read up front: the block index and the EFBlocks are
+    // accessed straight out of the mapping, so the pages are shared
+    // with the OS page cache and with every other process that maps
+    // the same file.
+    static Sequence mmap(const std::string& path);
+
+    // Construct with variable-length blocks whose boundaries are chosen by
+    // optimal_partition, rather than cutting every *block_size* elements.
+    // This is usually smaller, especially for clustered values. Blocks hold
+    // at most *max_block_size* elements, which is also the block size used
+    // for the results of set operations on this Sequence.
+    static Sequence optimal(
+        const uint64_t* values, // must be sorted!
+        size_t n,
+        uint32_t max_block_size = 1024,
+        bool check_sorted = true,
+        unsigned n_threads = 1
+    );
+    static Sequence optimal(
+        const std::vector<uint64_t>& values, // must be sorted!
+        uint32_t max_block_size = 1024,
+        unsigned n_threads = 1
+    );
+
+    // View a serialized Sequence (as produced by serialize()) that lives
+    // in an external buffer, without copying it. *owner* keeps the buffer
+    // alive for as long as this Sequence, or any copy of it, exists. If
+    // *data* is not 8-byte aligned, we fall back to copying. Throws
+    // std::runtime_error if the header or block index is inconsistent with
+    // itself or the buffer size; the block headers in the payload aren't
+    // checked.
+    static Sequence from_buffer(
+        const void* data,
+        size_t size,
+        std::shared_ptr<const void> owner = nullptr
+    );
+
     // Copy constructor.
     Sequence(const Sequence& other);
 
     // Move constructor
     Sequence(Sequence&&) noexcept;
 
+    ~Sequence();
+
     // Remove duplicate values, returning a new Sequence with the unique
     // (nonredundant) set of integers from this Sequence.
     Sequence unique() const;
 
-    // Serialize this Sequence in its compressed state to a string.
-    std::string serialize() const;
+    // Serialize this Sequence in its compressed state to a string, in
+    // file format *version* (1, or 2 for the layout described at
+    // BlockEntry). Readers accept either.
+    std::string serialize(uint32_t version = 1) const;
+
+    // Size of serialize(version) in bytes, and write it straight into
+    // *dst*, which has room for *size* bytes (throws if that's too few).
+    size_t serialized_size(uint32_t version = 1) const;
+    void serialize_into(void* dst, size_t size, uint32_t version = 1) const;
 
     // Save serialized Sequence to a file.
-    void save(const std::string& path) const;
+    void save(const std::string& path, uint32_t version = 1) const;
 
     // Decode the i^th EFBlock, returning its original integers.
     std::vector<uint64_t> decode_block(uint64_t i) const;
 
+    // Decode the i^th EFBlock into *out*, which has room for *cap*
+    // integers. Returns the number of integers written; throws if *cap*
+    // is smaller than block_n_elem(i).
+    size_t decode_block_into(uint64_t i, uint64_t* out, size_t cap) const;
+
     // Decode the entire original sequence.
     std::vector<uint64_t> decode() const;
 
-    // Decode the i^th value in the sequence.
+    // Decode the entire sequence into *out*, which has room for *cap*
+    // integers. Returns the number of integers written; throws if *cap*
+    // is smaller than n_elem().
+    size_t decode_into(uint64_t* out, size_t cap) const;
+
+    // Decode the elements with indices in [i, j). Only the blocks that
+    // overlap the range are decoded. decode_slice_into writes them to
+    // *out*, which has room for *cap* integers, and returns j - i; throws
+    // if j - i > cap.
+    std::vector<uint64_t> decode_slice(uint64_t i, uint64_t j) const;
+    size_t decode_slice_into(uint64_t i, uint64_t j, uint64_t* out, size_t cap) const;
+
+    // Decode the elements with values in [lo, hi).
+    std::vector<uint64_t> decode_range(uint64_t lo, uint64_t hi) const;
+
+    // Compressed Sequence of the elements with indices in [i, j). Blocks
+    // that lie entirely inside the range are copied byte for byte; only
+    // the two boundary blocks are decoded and re-encoded. Unless *i* is on
+    // a block boundary of a fixed-size Sequence, the result has variable-
+    // length blocks (see SEQUENCE_VARIABLE_BLOCKS).
+    Sequence slice(uint64_t i, uint64_t j) const;
+
+    // Compressed Sequence of the elements with values in [lo, hi).
+    Sequence range(uint64_t lo, uint64_t hi) const;
+
+    // Decode the i^th value in the sequence. Only reads the i^th element
+    // of its EFBlock, so this is O(block_size / 64) word operations.
     uint64_t get(uint64_t i) const;
     uint64_t operator[](uint64_t i) const;
 
@@ -238,6 +659,31 @@ public:
     // Check if an element exists
     bool contains(uint64_t val) const;
 
+    // Index of the first element greater than or equal to *q*, or
+    // n_elem() if there is none.
+    uint64_t lower_bound(uint64_t q) const;
+
+    // Number of elements strictly less than *q* (same as lower_bound).
+    uint64_t rank(uint64_t q) const;
+
+    // Smallest element greater than or equal to *q*, or UINT64_MAX if
+    // there is none.
+    uint64_t next_geq(uint64_t q) const;
+
+    // Largest element less than or equal to *q*, or UINT64_MAX if there is
+    // none. Finds the block with block_last, then the bucket of *q* in its
+    // high bits, like next_geq.
+    uint64_t prev_leq(uint64_t q) const;
+
+    // Batched get, contains and lower_bound for *n* queries in any order,
+    // writing one result per query to *out*, in query order. Queries are
+    // grouped by block (sorting them first unless they're already sorted),
+    // so each block touched is decoded only once. With *n_threads* > 1,
+    // the groups are split across threads.
+    void get_many(const uint64_t* indices, size_t n, uint64_t* out, unsigned n_threads = 1) const;
+    void contains_many(const uint64_t* values, size_t n, bool* out, unsigned n_threads = 1) const;
+    void rank_many(const uint64_t* values, size_t n, uint64_t* out, unsigned n_threads = 1) const;
+
     // Take all elements that occur between *min_count* and *max_count*
     // times. If *write_multiset*, the multiplicity of each element is
     // retained in the output; otherwise we only write each element once.
@@ -247,16 +693,60 @@ public:
         const bool write_multiset = true
     ) const;
 
-    // Intersect with another Sequence, returning a new Sequence
-    Sequence intersect(const Sequence& other) const;
+    // Intersect with another Sequence, returning a new Sequence. The
+    // smaller input drives the intersection and probes the larger one with
+    // Cursor::skip_to, so intersecting *m* with *n* >> *m* elements costs
+    // about O(m log(n/m)) rather than O(n + m).
+    //
+    // With *n_threads* > 1, the value space is cut at block boundaries of
+    // the larger input into ranges that are merged on separate threads,
+    // and the pieces are stitched back together into a single Sequence. The
+    // same applies to difference() and union_with(). The result is
+    // identical to the single-threaded one (for difference() and
+    // union_with(), it holds the same values, but may be blocked
+    // differently; see operator|).
+    Sequence intersect(const Sequence& other, unsigned n_threads = 1) const;
 
     // Set difference relative to *other*.
     // For multisets, this is a multiset difference, so that
     // so that {1, 2, 2, 3} - {1, 2} => {2, 3}.
+    // As with operator|, blocks with nothing to remove are copied as is.
     Sequence operator-(const Sequence& other) const;
+    Sequence difference(const Sequence& other, unsigned n_threads = 1) const;
 
-    // Take union with another Sequence, returning a new Sequence
+    // Take union with another Sequence, returning a new Sequence.
+    // A block of either input that lies wholly between two values of the
+    // other one is copied to the output without being decoded, so inputs
+    // that barely overlap (like time-partitioned segments) merge at about
+    // the cost of a memcpy. When such a block doesn't land on a block
+    // boundary of the output, the output switches to variable-length
+    // blocks (see SEQUENCE_VARIABLE_BLOCKS).
     Sequence operator|(const Sequence& other) const;
+    Sequence union_with(const Sequence& other, unsigned n_threads = 1) const;
+
+    // Sizes of intersect(other), *this | other and *this - other, computed
+    // without building the result.
+    uint64_t intersect_count(const Sequence& other) const;
+    uint64_t union_count(const Sequence& other) const;
+    uint64_t difference_count(const Sequence& other) const;
+
+    // Check if this Sequence shares any element with *other*, stopping at
+    // the first one found.
+    bool intersects(const Sequence& other) const;
+
+    // Append *n* nondecreasing values, none less than the last element.
+    // Only the last block is re-encoded (if it isn't full), so the cost is
+    // proportional to *n* rather than to the size of this Sequence. A view
+    // is first copied into memory that this Sequence owns.
+    void append(const uint64_t* values, size_t n);
+    void append(const std::vector<uint64_t>& values);
+
+    // Insert *n* nondecreasing values anywhere, keeping any copies already
+    // present (as a multiset). Blocks from the first one holding a value
+    // greater than values[0] onward are decoded, merged and re-encoded, so
+    // values that land near the end are about as cheap as append.
+    void insert(const uint64_t* values, size_t n);
+    void insert(const std::vector<uint64_t>& values);
 
     // Number of integers encoded in this Sequence.
     uint64_t n_elem() const;
@@ -267,22 +757,186 @@ public:
     // Total number of EFBlocks.
     uint64_t n_blocks() const;
 
+    // Number of integers in the i^th EFBlock.
+    uint32_t block_n_elem(uint64_t i) const;
+
+    // Index in the Sequence of the first integer in the i^th EFBlock.
+    uint64_t block_begin(uint64_t i) const;
+
+    // True if blocks have variable lengths (see Sequence::optimal).
+    bool variable_blocks() const;
+
     // Print all SequenceMetadata to stdout.
     void info() const;
 
     // Get a copy of the SequenceMetadata.
     SequenceMetadata get_meta() const;
 
+    // True if this Sequence is a view over external storage (e.g. a
+    // memory-mapped file) rather than owning its data.
+    bool is_view() const;
+
+    // For a view, the buffer passed to from_buffer (or the mapped file),
+    // which holds this Sequence in serialized form; sets *size* to its
+    // size. The pointer shares ownership of the buffer, so it stays valid
+    // even if append or insert later copies this Sequence out of it. Null
+    // (and *size* 0) if we own our data.
+    std::shared_ptr<const void> view_buffer(size_t& size) const;
+
+    // Keep up to *capacity_bytes* of decoded blocks in a BlockCache, so
+    // that repeated get, contains, lower_bound, next_geq and decode_block
+    // calls on the same blocks don't decode them again. Worth it for large
+    // blocks and for callers (e.g. from Python) that probe many nearby
+    // positions without a Cursor. The cache is thread-safe, and isn't
+    // shared with copies of this Sequence. Enabling or disabling it is
+    // not: do it before sharing the Sequence between threads.
+    void enable_cache(size_t capacity_bytes, unsigned n_shards = 16);
+    void disable_cache();
+
+    // Counters for the cache (all zero without one).
+    BlockCacheStats cache_stats() const;
+
 private:
     SequenceMetadata meta {};
     // Highest element in each block (size *n_blocks_*).
     std::vector<uint64_t> block_last_;
     // Byte offset of the start of each block in the file (size *n_blocks_*).
     std::vector<uint64_t> block_offs_;
+    // Index of the first element of each block, for variable-length blocks
+    // only (size *n_blocks_*; empty otherwise).
+    std::vector<uint64_t> block_begin_;
     // All EFBlocks written end-to-end:
     // header0, low0, high0, header1, low1, high1, ...
     std::vector<uint8_t> payload_;
 
+    // External storage that this Sequence is a view over (e.g. a memory
+    // mapping); null if we own our data in the three vectors above.
+    std::shared_ptr<const void> backing_;
+    // If *backing_* is set, these point into it in place of
+    // *block_last_*, *block_offs_*, *block_begin_* and *payload_*.
+    const uint64_t* view_last_ = nullptr;
+    const uint64_t* view_offs_ = nullptr;
+    const uint64_t* view_begin_ = nullptr;
+    const uint8_t* view_payload_ = nullptr;
+    size_t view_payload_size_ = 0;
+    // Distance between consecutive entries of view_last_, view_offs_ and
+    // view_begin_ (in uint64_t): 1 for version 1's separate arrays, or 4
+    // when they're fields of a version 2 BlockEntry table, which also
+    // gives us *view_floor_* (null otherwise).
+    size_t view_stride_ = 1;
+    const uint64_t* view_floor_ = nullptr;
+    // The whole serialized Sequence that the pointers above point into.
+    const void* view_buffer_ = nullptr;
+    size_t view_buffer_size_ = 0;
+
+    // Decoded blocks, if enable_cache was called.
+    std::shared_ptr<BlockCache> cache_;
+
+    // Upper level of the block index, built on the first search of a
+    // Sequence with at least SKIP_MIN_BLOCKS blocks (null until then).
+    // Owned by this Sequence.
+    mutable std::atomic<const BlockSkipIndex*> skip_ {nullptr};
+
+    // Bumped by every append and insert, which can move the payload, so
+    // that Cursors made before can tell they're stale.
+    uint64_t generation_ = 0;
+
+    // Index of the first block whose highest element is >= q. Requires
+    // q <= the last element. Goes through *skip_* for large Sequences.
+    uint64_t find_block(uint64_t q) const;
+
+    // Decoded block *bi*, from the cache if possible. Requires *cache_*.
+    BlockCache::Block cached_block(uint64_t bi) const;
+
+    // Copy the block index and payload of a view into our own vectors, and
+    // drop the external storage. Does nothing if we already own them.
+    void _materialize();
+
+    // Decode blocks [bi, n_blocks) onto the end of *values* and remove them
+    // from this Sequence, ready to push new blocks after block bi - 1.
+    // Returns the payload cursor to push them from.
+    uint64_t _reopen(uint64_t bi, std::vector<uint64_t>& values);
+
+    // Shared logic for append and insert: merge *n* nondecreasing values
+    // into the tail of this Sequence.
+    void _merge_tail(const uint64_t* values, size_t n);
+
+    // Shared logic for the *_many methods: visit *n* queries *keys* grouped
+    // by the block *block_for(key)* they fall in (n_blocks if none), calling
+    // answer(q, bi, values, n_values) with decoded block *bi* for each query
+    // *q* (values is null when bi is n_blocks).
+    template <class BlockFor, class Answer>
+    void batch_by_block(
+        const uint64_t* keys,
+        size_t n,
+        unsigned n_threads,
+        BlockFor block_for,
+        Answer answer
+    ) const;
+
+    // Pointer to the start of the (sorted) array of per-block highest
+    // elements (size *n_blocks*, stride *index_stride*).
+    const uint64_t* block_last_data() const {
+        return backing_ ? view_last_ : block_last_.data();
+    }
+
+    // Pointer to the start of the array of per-block byte offsets into
+    // the payload (size *n_blocks*, stride *index_stride*).
+    const uint64_t* block_offs_data() const {
+        return backing_ ? view_offs_ : block_offs_.data();
+    }
+
+    // Pointer to the start of the array of per-block first element
+    // indices (size *n_blocks*, stride *index_stride*), for variable-length
+    // blocks.
+    const uint64_t* block_begin_data() const {
+        return backing_ ? view_begin_ : block_begin_.data();
+    }
+
+    // Distance between consecutive entries of the three arrays above.
+    size_t index_stride() const {
+        return backing_ ? view_stride_ : 1;
+    }
+
+    // Size of the block index between the header and the payload (bytes).
+    uint64_t index_bytes() const {
+        return meta.n_blocks * sizeof(uint64_t) * (variable_blocks() ? 3 : 2);
+    }
+
+    // Index of the block that holds element *i*.
+    uint64_t block_of(uint64_t i) const;
+
+    // Pointer to the start of the payload.
+    const uint8_t* payload_data() const {
+        return backing_ ? view_payload_ : payload_.data();
+    }
+
+    // Total size of the payload (bytes).
+    size_t payload_size() const {
+        return backing_ ? view_payload_size_ : payload_.size();
+    }
+
+    // Highest element in block *bi*.
+    uint64_t block_last(uint64_t bi) const {
+        return block_last_data()[bi * index_stride()];
+    }
+
+    // Pointer to the start of block *bi* in the payload.
+    const uint8_t* block_data(uint64_t bi) const {
+        return payload_data() + block_offs_data()[bi * index_stride()];
+    }
+
+    // Size of block *bi* in the payload (bytes).
+    size_t block_bytes(uint64_t bi) const {
+        EFBlockMetadata block_meta;
+        std::memcpy(&block_meta, block_data(bi), sizeof(block_meta));
+        return sizeof(block_meta)
+            + (block_meta.low_words + block_meta.high_words) * sizeof(uint64_t);
+    }
+
+    // Append block *bi* of *src* to this Sequence without re-encoding it.
+    void _copy_block(const Sequence& src, uint64_t bi, uint64_t& cursor);
+
     // Write a new chunk of data to *payload_*.
     void append_bytes(const void* src, size_t n) {
         size_t old = payload_.size();
@@ -290,17 +944,358 @@ private:
         std::memcpy(payload_.data() + old, src, n);
     }
 
-    // Flush all values in a block to this Sequence.
+    // Reserve room for about *n_elem* elements in *payload_bytes* of
+    // payload, so that a Sequence built block by block with _push_value
+    // doesn't keep reallocating as it grows.
+    void _reserve(uint64_t n_elem, size_t payload_bytes);
+
+    // Flush all values in a block to this Sequence. The values must
+    // already be counted in meta.n_elem.
     void _flush_block(
         std::vector<uint64_t>& values,
         uint64_t& cursor
     );
 
+    // Append *v* to the block being built in *values*, flushing it to
+    // this Sequence once it's full.
+    void _push_value(
+        uint64_t v,
+        std::vector<uint64_t>& values,
+        uint64_t& cursor
+    ) {
+        values.push_back(v);
+        ++meta.n_elem;
+        if (values.size() == meta.block_size) _flush_block(values, cursor);
+    }
+
+    // Append block *bi* of *src* without re-encoding it, after flushing
+    // the partial block in *values*. Unless *allow_short*, returns false
+    // (and does nothing) if that would leave a block shorter than a
+    // quarter of block_size in the middle of the Sequence; the caller then
+    // pushes the elements one by one instead. A full block on a block
+    // boundary keeps fixed-size blocks; anything else switches this
+    // Sequence to variable-length blocks.
+    bool _splice_block(
+        const Sequence& src,
+        uint64_t bi,
+        std::vector<uint64_t>& values,
+        uint64_t& cursor,
+        bool allow_short
+    );
+
+    // Flush the last (partial) block, if any, and finalize the metadata.
+    void _finish(
+        std::vector<uint64_t>& values,
+        uint64_t& cursor
+    );
+
+    // Encode the concatenation of *segments* (pointer, length), which must
+    // be nondecreasing, into this empty Sequence. Each block is encoded in
+    // place from its segment, and only blocks that straddle two segments
+    // are copied first. Uses up to *n_threads* threads. Blocks are cut
+    // every *block_size* elements, or at *block_begin_* if it's set.
+    void _encode_segments(
+        const std::vector<std::pair<const uint64_t*, size_t> >& segments,
+        unsigned n_threads
+    );
+
     // Serialize this Sequence to an arbitrary ofstream
-    void serialize_to_stream(std::ostream&) const;
+    void serialize_to_stream(std::ostream&, uint32_t version = 1) const;
+
+    // Shared logic for the serialize* methods: call write(p, n, what)
+    // with each piece of the serialized Sequence in turn.
+    template <class Write>
+    void serialize_with(Write& write, uint32_t version) const;
 
     // Initialize from a serialized representation in a stream.
     void init_from_stream(std::istream& in);
+
+    // Read the rest of *in* from meta.payload_offset on into *payload_*,
+    // checking that the offset lies between *index_end*, the end of the
+    // block index, and *sz*, the size of the stream.
+    void read_payload(std::istream& in, uint64_t sz, uint64_t index_end);
+
+    friend Sequence intersect_many(const std::vector<const Sequence*>& seqs);
+    friend Sequence union_many(const std::vector<const Sequence*>& seqs);
+
+    friend class SequenceBuilder;
+    friend class SequenceCollectionWriter;
+};
+
+/*
+ * Class: SequenceBuilder
+ * ----------------------
+ * Builds a Sequence from values pushed one at a time (or in runs), in
+ * nondecreasing order, encoding each block as soon as it fills. Only one
+ * block of raw values is held at a time.
+ *
+ * By default the Sequence is built in memory and returned by finish().
+ * Alternatively, the encoded blocks can be streamed to an output stream or
+ * file as they're built, so that only the block index stays in memory.
+ * Since the block index comes before the payload in the file, streaming
+ * builders need an upper bound on the number of elements to reserve room
+ * for it. close() then writes the header and block index.
+*/
+class SequenceBuilder {
+public:
+    // Build a Sequence in memory.
+    explicit SequenceBuilder(uint32_t block_size = 256);
+
+    // Stream the Sequence to *out* (which must be seekable), starting at
+    // its current position. At most *max_elem* values can be pushed.
+    SequenceBuilder(std::ostream& out, uint64_t max_elem, uint32_t block_size = 256);
+
+    // Stream the Sequence to a new file at *path*.
+    SequenceBuilder(const std::string& path, uint64_t max_elem, uint32_t block_size = 256);
+
+    // Append a value, which must be at least the last one pushed.
+    void push(uint64_t v);
+
+    // Append *n* nondecreasing values.
+    void push_many(const uint64_t* values, size_t n);
+
+    // Number of values pushed so far.
+    uint64_t n_elem() const;
+
+    // Flush the last block and return the Sequence. In-memory builders only.
+    Sequence finish();
+
+    // Flush the last block, then write the header and block index to the
+    // output. Streaming builders only.
+    void close();
+
+private:
+    Sequence seq_;
+    // Values of the block being built.
+    std::vector<uint64_t> block_;
+    // Size of the payload written so far (bytes).
+    uint64_t cursor_ = 0;
+    bool done_ = false;
+
+    // Streaming output, if any, and where the Sequence begins in it.
+    std::unique_ptr<std::ofstream> file_;
+    std::ostream* out_ = nullptr;
+    std::streampos base_ = 0;
+    uint64_t max_elem_ = UINT64_MAX;
+
+    // Set up streaming to *out_*: reserve the header and the block index.
+    void open_stream(uint64_t max_elem);
+
+    // Write any encoded blocks still in memory to *out_*.
+    void write_payload();
+
+    friend class SequenceCollectionWriter;
+};
+
+/*
+ * Class: InsertBuffer
+ * -------------------
+ * Collects values inserted one at a time and in any order, and merges
+ * them into a Sequence with Sequence::insert in sorted batches, once
+ * *capacity* of them have piled up or on flush(). IDs that arrive roughly
+ * in order then only re-encode the last few blocks per batch. Buffered
+ * values aren't visible in the Sequence until they're merged, and are
+ * lost if the buffer is destroyed before a flush(). The Sequence must
+ * outlive the buffer.
+*/
+class InsertBuffer {
+public:
+    explicit InsertBuffer(Sequence& seq, size_t capacity = 4096);
+
+    // Buffer a value, merging the buffer if it's full.
+    void insert(uint64_t v);
+
+    // Merge the buffered values into the Sequence.
+    void flush();
+
+    // Number of values waiting to be merged.
+    size_t size() const;
+
+    // The Sequence they're merged into.
+    Sequence& sequence() const { return seq_; }
+
+private:
+    Sequence& seq_;
+    size_t capacity_;
+    std::vector<uint64_t> pending_;
+};
+
+// Intersect any number of Sequences in a single pass, without building
+// intermediate Sequences. Cursors over all inputs leapfrog one another with
+// skip_to, shortest input first. As with Sequence::intersect, multisets
+// keep the smallest multiplicity of each element, and the output has the
+// block size of the first input.
+Sequence intersect_many(const std::vector<const Sequence*>& seqs);
+
+// Union of any number of Sequences in a single pass, by merging Cursors
+// over all inputs through a min-heap. As with Sequence::operator|,
+// multisets keep the largest multiplicity of each element, and the output
+// has the block size of the first input.
+Sequence union_many(const std::vector<const Sequence*>& seqs);
+
+// File-to-file versions of Sequence::intersect, operator-, operator|,
+// unique and filter_by_count, for inputs and outputs that don't fit in
+// memory. The inputs are memory-mapped and the output is streamed to
+// *out_path* with a SequenceBuilder, so that memory use doesn't grow with
+// the size of the Sequences. Outputs have the block size of the first
+// input. Throws std::runtime_error if *out_path* is one of the inputs.
+void intersect_files(
+    const std::string& path_a,
+    const std::string& path_b,
+    const std::string& out_path
+);
+void difference_files(
+    const std::string& path_a,
+    const std::string& path_b,
+    const std::string& out_path
+);
+void union_files(
+    const std::string& path_a,
+    const std::string& path_b,
+    const std::string& out_path
+);
+void unique_file(const std::string& path, const std::string& out_path);
+void filter_by_count_file(
+    const std::string& path,
+    const std::string& out_path,
+    const int min_count,
+    const int max_count,
+    const bool write_multiset = true
+);
+
+// A collection file holds many Sequences (e.g. the posting lists of an
+// inverted index) back to back, each serialized as a standalone Sequence
+// starting on a V2_ALIGN-byte boundary, followed by a directory with one
+// CollectionEntry per Sequence, sorted by term:
+//
+//   CollectionMetadata | pad | Sequence0 | pad | Sequence1 | ... | directory
+#pragma pack(push, 1)
+struct CollectionMetadata {
+    char     magic[4];         // file magic ("PPEC")
+    uint32_t version;          // 1
+    uint64_t n_sequences;      // number of directory entries
+    uint64_t directory_offset; // byte offset of the directory in the file
+    uint64_t reserved;         // 0
+};
+struct CollectionEntry {
+    uint64_t term;       // key the Sequence is stored under
+    uint64_t offset;     // byte offset of the serialized Sequence in the file
+    uint64_t size;       // size of the serialized Sequence (bytes)
+    uint64_t n_elem;     // its number of elements
+    uint32_t block_size; // and its block size
+    uint32_t reserved;   // 0
+};
+#pragma pack(pop)
+static_assert(sizeof(CollectionMetadata) == 32, "CollectionMetadata must be 32 bytes");
+static_assert(sizeof(CollectionEntry) == 40, "CollectionEntry must be 40 bytes");
+
+/*
+ * Class: SequenceCollection
+ * -------------------------
+ * Read-only, memory-mapped collection file. Opening it maps the file and
+ * checks the header; get(term) finds the term in the directory with a
+ * binary search and returns a view of its Sequence straight out of the
+ * mapping (see Sequence::from_buffer), which keeps the mapping alive.
+*/
+class SequenceCollection {
+public:
+    explicit SequenceCollection(const std::string& path);
+
+    // Number of Sequences.
+    uint64_t size() const;
+
+    // True if there's a Sequence stored under *term*.
+    bool contains(uint64_t term) const;
+
+    // View of the Sequence stored under *term*. Throws if there's none.
+    Sequence get(uint64_t term) const;
+
+    // Directory entry *i* (in order of term). Throws if out of bounds.
+    CollectionEntry entry(uint64_t i) const;
+
+    // All terms, in increasing order.
+    std::vector<uint64_t> terms() const;
+
+private:
+    std::shared_ptr<const void> mapping_;
+    const uint8_t* base_ = nullptr;
+    size_t size_ = 0;
+    CollectionMetadata meta_ {};
+    const CollectionEntry* directory_ = nullptr;
+
+    // Directory entry for *term*, or null if there's none.
+    const CollectionEntry* find(uint64_t term) const;
 };
 
+/*
+ * Class: SequenceCollectionWriter
+ * -------------------------------
+ * Writes a collection file one Sequence at a time, in increasing order of
+ * term. A Sequence is either added whole, or streamed to the file with
+ * the SequenceBuilder returned by build(), which is closed when the next
+ * Sequence begins or the writer closes (after which pushing to it throws).
+ * Only the directory is kept in memory. close() writes the directory and
+ * patches the header.
+*/
+class SequenceCollectionWriter {
+public:
+    // Sequences added whole are written in format *version* (see
+    // Sequence::serialize); streamed ones are version 1, as with any
+    // SequenceBuilder.
+    explicit SequenceCollectionWriter(const std::string& path, uint32_t version = 1);
+
+    // Doesn't close() the file, but leaves a builder still open unusable.
+    ~SequenceCollectionWriter();
+
+    // Write *seq* under *term*, which must be greater than the last one.
+    void add(uint64_t term, const Sequence& seq);
+
+    // Stream a Sequence of at most *max_elem* values under *term*. The
+    // builder takes values until the next call to add, build or close.
+    std::shared_ptr<SequenceBuilder> build(uint64_t term, uint64_t max_elem, uint32_t block_size = 256);
+
+    // Number of Sequences written (or being built) so far.
+    uint64_t size() const;
+
+    // Finish the last Sequence, then write the directory and the header.
+    void close();
+
+private:
+    std::string path_;
+    std::ofstream out_;
+    uint32_t version_;
+    std::vector<CollectionEntry> directory_;
+    // Builder of the last Sequence, if it's being streamed.
+    std::shared_ptr<SequenceBuilder> builder_;
+    bool done_ = false;
+
+    // Check *term* and start a new entry for it at the next aligned offset.
+    void begin_entry(uint64_t term);
+
+    // Close the builder, if any, and fill in the sizes of the last entry.
+    void end_entry();
+};
+
+// Process-wide counts of work done on the hot paths, for attributing the
+// cost of a query to blocks decoded, blocks skipped and so on. They're
+// only collected if the library is compiled with PEF_STATS defined
+// (relaxed atomic increments); otherwise they stay at zero and cost
+// nothing.
+struct Stats {
+    uint64_t blocks_decoded = 0;   // blocks decoded, or loaded by a Cursor
+    uint64_t elements_decoded = 0; // elements in those blocks
+    uint64_t blocks_skipped = 0;   // blocks a Cursor::skip_to jumped over unread
+    uint64_t blocks_copied = 0;    // blocks copied verbatim into another Sequence
+    uint64_t bytes_encoded = 0;    // encoded block bytes written
+    uint64_t get_calls = 0;        // calls to Sequence::get
+    uint64_t contains_calls = 0;   // calls to Sequence::contains
+};
+
+// True if the library was compiled with PEF_STATS.
+bool stats_enabled();
+
+// Current counts, and reset them all to zero.
+Stats stats();
+void reset_stats();
+
 } // end namespace pef
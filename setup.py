@@ -15,7 +15,11 @@ version = tomli.loads(Path("pyproject.toml").read_text(encoding="utf-8"))["proje
 
 SRC_FILES = list(glob(os.path.join("src", "*.cpp")))
 INCLUDE_DIRS = ["include"]
-CXX_STD = 17  # can also be >=c++11
+CXX_STD = 17  # the library needs >=c++11; the bindings use std::shared_mutex
+# std::thread (parallel block encoding) needs pthreads outside of Windows
+THREAD_ARGS = [] if sys.platform == "win32" else ["-pthread"]
+# PEF_STATS=1 pip install . collects the hot-path counters (see pef.stats)
+STATS_MACROS = [("PEF_STATS", "1")] if os.environ.get("PEF_STATS") else []
 
 ext_modules = [
     Pybind11Extension(
@@ -23,7 +27,9 @@ ext_modules = [
         SRC_FILES,
         include_dirs=INCLUDE_DIRS,
         cxx_std=CXX_STD,
-        define_macros=[("VERSION_INFO", f'"{version}"')],
+        define_macros=[("VERSION_INFO", f'"{version}"')] + STATS_MACROS,
+        extra_compile_args=THREAD_ARGS,
+        extra_link_args=THREAD_ARGS,
     )
 ]
 
@@ -1,70 +1,803 @@
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
 #include <pybind11/numpy.h>
+#include <algorithm>
+#include <shared_mutex>
+#include <sstream>
 #include "pef.h"
 
 namespace py = pybind11;
 
-pef::Sequence deserialize(const std::string& s) {
-    std::istringstream in(s);
-    return pef::Sequence(in);
+// Readers that release the GIL can run while another Python thread calls
+// a method that changes the same Sequence (append, insert, enable_cache,
+// disable_cache), which may free the memory they're reading. So readers
+// hold each Sequence they read shared, with the GIL released. Mutators
+// hold it exclusively, and take the GIL back before changing anything,
+// which keeps out readers that kept the GIL too. The locks are striped by
+// address. A reader takes its stripes in order, so readers of several
+// Sequences can't deadlock with mutators.
+std::shared_mutex& sequence_lock(const pef::Sequence* s) {
+    static std::shared_mutex stripes[61];
+    return stripes[(reinterpret_cast<uintptr_t>(s) >> 4) % 61];
+}
+
+// Holds some Sequences shared for as long as it lives.
+class ReadLock {
+public:
+    explicit ReadLock(const std::vector<const pef::Sequence*>& seqs) {
+        for (const pef::Sequence* s: seqs) locks_.push_back(&sequence_lock(s));
+        std::sort(locks_.begin(), locks_.end());
+        locks_.erase(std::unique(locks_.begin(), locks_.end()), locks_.end());
+        for (std::shared_mutex* m: locks_) m->lock_shared();
+    }
+    ReadLock(const ReadLock&) = delete;
+    ReadLock& operator=(const ReadLock&) = delete;
+    ~ReadLock() {
+        for (std::shared_mutex* m: locks_) m->unlock_shared();
+    }
+
+private:
+    std::vector<std::shared_mutex*> locks_;
+};
+
+// Run *change*, which modifies *s*, holding *s* exclusively. Called with
+// the GIL, which is released only while we wait for readers to finish.
+template <class Change>
+void mutate(const pef::Sequence& s, Change change) {
+    std::shared_mutex& m = sequence_lock(&s);
+    {
+        py::gil_scoped_release release;
+        m.lock();
+    }
+    const std::lock_guard<std::shared_mutex> lock(m, std::adopt_lock);
+    change();
+}
+
+// Collect the Sequences among a method's arguments, for reading().
+inline void add_read(std::vector<const pef::Sequence*>& seqs, const pef::Sequence& s) {
+    seqs.push_back(&s);
+}
+template <class T>
+inline void add_read(std::vector<const pef::Sequence*>&, const T&) {}
+
+// Wrap a const method of Sequence, to be bound with the GIL released, so
+// that it holds the Sequence and any Sequence arguments shared.
+template <class R, class... Args>
+auto reading(R (pef::Sequence::*f)(Args...) const) {
+    return [f](const pef::Sequence& s, Args... args) {
+        std::vector<const pef::Sequence*> seqs {&s};
+        (add_read(seqs, args), ...);
+        const ReadLock lock(seqs);
+        return (s.*f)(args...);
+    };
+}
+
+// View a serialized Sequence in any read-only, contiguous buffer (bytes,
+// read-only memoryviews, NumPy arrays and mmaps, a pickle protocol 5
+// PickleBuffer...) without copying it. The Sequence holds on to the buffer
+// until it and every copy of it are gone. Writable buffers could change
+// under a view, so their contents are copied instead.
+pef::Sequence from_buffer(const py::buffer& b) {
+    // The last reference may be dropped on a thread without the GIL.
+    std::shared_ptr<py::buffer_info> info(
+        new py::buffer_info(b.request()),
+        [](py::buffer_info* p) {
+            py::gil_scoped_acquire acquire;
+            delete p;
+        }
+    );
+    for (py::ssize_t k = info->ndim - 1, stride = info->itemsize; k >= 0; --k) {
+        if (info->shape[k] > 1 && info->strides[k] != stride) {
+            throw py::value_error("buffer must be C-contiguous");
+        }
+        stride *= info->shape[k];
+    }
+    const void* data = info->ptr;
+    const size_t size = static_cast<size_t>(info->size * info->itemsize);
+    py::gil_scoped_release release;
+    if (!info->readonly) {
+        std::istringstream in(std::string(static_cast<const char*>(data), size));
+        return pef::Sequence(in);
+    }
+    return pef::Sequence::from_buffer(data, size, info);
+}
+
+// bytes are immutable, so deserializing them needn't copy either.
+pef::Sequence deserialize(const py::bytes& b) {
+    return from_buffer(py::reinterpret_borrow<py::buffer>(b));
+}
+
+// serialize(version), written straight into a new bytes object. The
+// Sequence is held shared (see ReadLock) from sizing to writing.
+py::bytes serialize(const pef::Sequence& s, uint32_t version) {
+    py::object o;
+    {
+        py::gil_scoped_release release;
+        const ReadLock lock({&s});
+        const size_t size = s.serialized_size(version);
+        char* dst = nullptr;
+        {
+            py::gil_scoped_acquire acquire;
+            o = py::bytes(nullptr, size);
+            dst = PyBytes_AS_STRING(o.ptr());
+        }
+        s.serialize_into(dst, size, version);
+    }
+    return py::reinterpret_steal<py::bytes>(o.release());
+}
+
+// Replace *o* with a new array of *n* integers and return its data, for a
+// reader holding its Sequences shared (see ReadLock) with the GIL released.
+// Taking the GIL back only to allocate means the size can be read under the
+// same lock as the data, so a concurrent append can't change it in between.
+uint64_t* new_array(py::array_t<uint64_t>& o, size_t n) {
+    py::gil_scoped_acquire acquire;
+    o = py::array_t<uint64_t>(static_cast<py::ssize_t>(n));
+    return o.mutable_data();
+}
+
+// A read-only buffer_info over *size* bytes at *data*, which holds a
+// reference to *owner* until the buffer is released.
+py::buffer_info export_buffer(const py::object& owner, const void* data, size_t size) {
+    Py_buffer* view = new Py_buffer();
+    // Fails only for writable requests.
+    PyBuffer_FillInfo(
+        view, owner.ptr(), const_cast<void*>(data), static_cast<Py_ssize_t>(size), 1, PyBUF_FULL_RO
+    );
+    return py::buffer_info(view);
+}
+
+// Borrow pointers to the Sequences in a Python iterable.
+std::vector<const pef::Sequence*> sequence_ptrs(const py::iterable& seqs) {
+    std::vector<const pef::Sequence*> o;
+    for (const py::handle& h: seqs) {
+        o.push_back(&h.cast<const pef::Sequence&>());
+    }
+    return o;
 }
 
 PYBIND11_MODULE(pef, m) {
     m.attr("__version__") = VERSION_INFO; // see setup.py
     py::class_<pef::SequenceMetadata>(m, "SequenceMetadata", py::module_local());
-    py::class_<pef::Sequence>(m, "Sequence", py::module_local())
+    py::class_<pef::BlockCacheStats>(m, "BlockCacheStats", py::module_local())
+        .def_readonly("hits", &pef::BlockCacheStats::hits)
+        .def_readonly("misses", &pef::BlockCacheStats::misses)
+        .def_readonly("bytes", &pef::BlockCacheStats::bytes)
+        .def_readonly("capacity_bytes", &pef::BlockCacheStats::capacity_bytes);
+    py::class_<pef::Sequence>(m, "Sequence", py::module_local(), py::buffer_protocol())
+        // Everything that reads files, decodes or encodes whole Sequences
+        // releases the GIL, so that Python threads can share one Sequence
+        // (see the thread-safety notes on pef::Sequence). Single lookups
+        // are cheaper than a release. Methods that change the Sequence wait
+        // for those readers to finish (see mutate).
         .def(
             py::init<const std::string&>(),
-            py::arg("filepath")
+            py::arg("filepath"),
+            py::call_guard<py::gil_scoped_release>()
         )
+        // NumPy arrays are encoded straight from their buffer, with the GIL
+        // released. Other dtypes are converted to one of these by NumPy.
         .def(
-            py::init<const std::vector<uint64_t>&, uint32_t>(),
+            py::init([](
+                py::array_t<uint64_t, py::array::c_style> values,
+                uint32_t block_size,
+                bool check_sorted,
+                unsigned n_threads
+            ) {
+                const uint64_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                py::gil_scoped_release release;
+                return pef::Sequence(p, n, block_size, check_sorted, n_threads);
+            }),
             py::arg("values"),
-            py::arg("block_size") = 256
+            py::arg("block_size") = 256,
+            py::arg("check_sorted") = true,
+            py::arg("n_threads") = 1
+        )
+        .def(
+            py::init([](
+                py::array_t<int64_t, py::array::c_style> values,
+                uint32_t block_size,
+                bool check_sorted,
+                unsigned n_threads
+            ) {
+                const int64_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                // Negatives in a sorted input sit at the front (sorted as
+                // int64) or at the back (sorted as uint64). Without them,
+                // the two types have the same bit patterns.
+                if (n > 0 && (p[0] < 0 || p[n - 1] < 0)) {
+                    throw py::value_error("values must be nonnegative");
+                }
+                py::gil_scoped_release release;
+                return pef::Sequence(
+                    reinterpret_cast<const uint64_t*>(p), n, block_size, check_sorted, n_threads
+                );
+            }),
+            py::arg("values"),
+            py::arg("block_size") = 256,
+            py::arg("check_sorted") = true,
+            py::arg("n_threads") = 1
+        )
+        .def(
+            py::init([](
+                py::array_t<uint32_t, py::array::c_style> values,
+                uint32_t block_size,
+                bool check_sorted,
+                unsigned n_threads
+            ) {
+                const uint32_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                py::gil_scoped_release release;
+                // Widen once, without going through Python objects.
+                const std::vector<uint64_t> wide(p, p + n);
+                return pef::Sequence(wide.data(), n, block_size, check_sorted, n_threads);
+            }),
+            py::arg("values"),
+            py::arg("block_size") = 256,
+            py::arg("check_sorted") = true,
+            py::arg("n_threads") = 1
+        )
+        .def(
+            py::init<const std::vector<uint64_t>&, uint32_t, unsigned>(),
+            py::arg("values"),
+            py::arg("block_size") = 256,
+            py::arg("n_threads") = 1,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def_static(
+            "mmap",
+            &pef::Sequence::mmap,
+            py::arg("filepath"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def_static(
+            "optimal",
+            [](
+                py::array_t<uint64_t, py::array::c_style> values,
+                uint32_t max_block_size,
+                bool check_sorted,
+                unsigned n_threads
+            ) {
+                const uint64_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                py::gil_scoped_release release;
+                return pef::Sequence::optimal(p, n, max_block_size, check_sorted, n_threads);
+            },
+            py::arg("values"),
+            py::arg("max_block_size") = 1024,
+            py::arg("check_sorted") = true,
+            py::arg("n_threads") = 1
         )
         .def(
             py::pickle(
                 // __getstate__
-                [](const pef::Sequence& s) {
-                    std::string o = s.serialize();
-                    return py::bytes(o.data(), o.size());
-                },
+                [](const pef::Sequence& s) { return serialize(s, 1); },
                 // __setstate__
-                [](const py::bytes& b) {
-                    std::istringstream in(b);
-                    return pef::Sequence(in);
-                }
+                [](const py::bytes& b) { return deserialize(b); }
             )
         )
+        // Protocol 5 pickles hand the serialized Sequence over as a
+        // PickleBuffer (see the buffer protocol below), which can travel out
+        // of band and be viewed in place by from_buffer on the other side.
+        .def(
+            "__reduce_ex__",
+            [](const py::object& self, int protocol) {
+                const py::module_ pef_module = py::module_::import("pef");
+                if (protocol < 5) {
+                    return py::make_tuple(
+                        pef_module.attr("deserialize"),
+                        py::make_tuple(serialize(self.cast<const pef::Sequence&>(), 1))
+                    );
+                }
+                const py::object pickle_buffer = py::module_::import("pickle").attr("PickleBuffer");
+                return py::make_tuple(
+                    pef_module.attr("from_buffer"), py::make_tuple(pickle_buffer(self))
+                );
+            },
+            py::arg("protocol")
+        )
+        // The buffer protocol exposes the serialized Sequence, read-only.
+        // A view exposes the buffer it views, without copying; otherwise
+        // we serialize into a new bytes object. Either way the export
+        // keeps its memory alive until it's released, whatever happens to
+        // the Sequence meanwhile. Older pybind11 versions don't catch
+        // exceptions thrown here, and the only ones possible are memory
+        // errors from the capsule or the bytes object.
+        .def_buffer([](const pef::Sequence& s) {
+            size_t size = 0;
+            if (std::shared_ptr<const void> buffer = s.view_buffer(size)) {
+                const void* data = buffer.get();
+                const py::capsule owner(
+                    new std::shared_ptr<const void>(std::move(buffer)),
+                    [](void* p) { delete static_cast<std::shared_ptr<const void>*>(p); }
+                );
+                return export_buffer(owner, data, size);
+            }
+            const py::bytes serialized = serialize(s, 1);
+            return export_buffer(
+                serialized,
+                PyBytes_AS_STRING(serialized.ptr()),
+                static_cast<size_t>(PyBytes_GET_SIZE(serialized.ptr()))
+            );
+        })
         .def_property_readonly("n_elem", &pef::Sequence::n_elem)
         .def_property_readonly("block_size", &pef::Sequence::block_size)
         .def_property_readonly("n_blocks", &pef::Sequence::n_blocks)
+        .def_property_readonly("is_view", &pef::Sequence::is_view)
+        .def_property_readonly("variable_blocks", &pef::Sequence::variable_blocks)
+        .def(
+            "enable_cache",
+            [](pef::Sequence& s, size_t capacity_bytes, unsigned n_shards) {
+                mutate(s, [&]() { s.enable_cache(capacity_bytes, n_shards); });
+            },
+            py::arg("capacity_bytes"),
+            py::arg("n_shards") = 16
+        )
+        .def("disable_cache", [](pef::Sequence& s) { mutate(s, [&]() { s.disable_cache(); }); })
+        .def("cache_stats", &pef::Sequence::cache_stats)
         .def("get_meta", &pef::Sequence::get_meta)
         .def("info", &pef::Sequence::info)
-        .def("save", &pef::Sequence::save, py::arg("filepath"))
-        .def("decode_block", &pef::Sequence::decode_block, py::arg("block_idx"))
-        .def("decode", &pef::Sequence::decode)
-        .def("unique", &pef::Sequence::unique)
+        .def(
+            "save",
+            reading(&pef::Sequence::save),
+            py::arg("filepath"),
+            py::arg("version") = 1,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "decode_block",
+            [](const pef::Sequence& s, uint64_t block_idx) {
+                py::array_t<uint64_t> o;
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    const size_t n = s.block_n_elem(block_idx);
+                    s.decode_block_into(block_idx, new_array(o, n), n);
+                }
+                return o;
+            },
+            py::arg("block_idx")
+        )
+        .def(
+            "decode",
+            [](const pef::Sequence& s) {
+                py::array_t<uint64_t> o;
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    const size_t n = static_cast<size_t>(s.n_elem());
+                    s.decode_into(new_array(o, n), n);
+                }
+                return o;
+            }
+        )
+        .def("unique", reading(&pef::Sequence::unique), py::call_guard<py::gil_scoped_release>())
         .def("__getitem__", &pef::Sequence::get, py::arg("i"))
+        // seq[i:j] decodes only the blocks that overlap [i, j). seq[i:j:k]
+        // decodes the span it covers when k is small, and gathers the
+        // selected elements with get_many when k is larger than a block.
+        .def(
+            "__getitem__",
+            [](const pef::Sequence& s, const py::slice& sl) {
+                py::array_t<uint64_t> o;
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    py::ssize_t start, stop, step, length;
+                    {
+                        py::gil_scoped_acquire acquire;
+                        if (!sl.compute(static_cast<py::ssize_t>(s.n_elem()), &start, &stop, &step, &length)) {
+                            throw py::error_already_set();
+                        }
+                    }
+                    uint64_t* out = new_array(o, static_cast<size_t>(length));
+                    if (length > 0) {
+                        const py::ssize_t first = step > 0 ? start : start + (length - 1) * step;
+                        const py::ssize_t last = step > 0 ? start + (length - 1) * step : start;
+                        const py::ssize_t stride = step > 0 ? step : -step;
+                        if (step == 1) {
+                            s.decode_slice_into(first, last + 1, out, length);
+                        } else if (stride > static_cast<py::ssize_t>(s.block_size())) {
+                            // At most one element per block; gather them in
+                            // ascending (already sorted) order.
+                            std::vector<uint64_t> indices(length);
+                            for (py::ssize_t k = 0; k < length; ++k) {
+                                indices[k] = static_cast<uint64_t>(first + k * stride);
+                            }
+                            s.get_many(indices.data(), indices.size(), out, 1);
+                            if (step < 0) std::reverse(out, out + length);
+                        } else {
+                            // Decode the span covering every selected element.
+                            const std::vector<uint64_t> span = s.decode_slice(first, last + 1);
+                            for (py::ssize_t k = 0; k < length; ++k) {
+                                out[k] = span[start + k * step - first];
+                            }
+                        }
+                    }
+                }
+                return o;
+            },
+            py::arg("slice")
+        )
+        .def(
+            "slice",
+            reading(&pef::Sequence::slice),
+            py::arg("i"),
+            py::arg("j"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "range",
+            reading(&pef::Sequence::range),
+            py::arg("lo"),
+            py::arg("hi"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "decode_range",
+            [](const pef::Sequence& s, uint64_t lo, uint64_t hi) {
+                std::vector<uint64_t> values;
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    values = s.decode_range(lo, hi);
+                }
+                py::array_t<uint64_t> o(static_cast<py::ssize_t>(values.size()));
+                std::copy(values.begin(), values.end(), o.mutable_data());
+                return o;
+            },
+            py::arg("lo"),
+            py::arg("hi")
+        )
         .def("__contains__", &pef::Sequence::contains, py::arg("q"))
+        .def("lower_bound", &pef::Sequence::lower_bound, py::arg("q"))
+        .def("rank", &pef::Sequence::rank, py::arg("q"))
+        .def(
+            "prev_leq",
+            [](const pef::Sequence& s, uint64_t q) -> py::object {
+                if (s.n_elem() == 0 || s.get(0) > q) return py::none();
+                return py::int_(s.prev_leq(q));
+            },
+            py::arg("q")
+        )
+        .def(
+            "next_geq",
+            [](const pef::Sequence& s, uint64_t q) -> py::object {
+                if (s.lower_bound(q) == s.n_elem()) return py::none();
+                return py::int_(s.next_geq(q));
+            },
+            py::arg("q")
+        )
+        .def(
+            "get_many",
+            [](
+                const pef::Sequence& s,
+                py::array_t<uint64_t, py::array::c_style> indices,
+                unsigned n_threads
+            ) {
+                py::array_t<uint64_t> o(indices.size());
+                const uint64_t* p = indices.data();
+                const size_t n = static_cast<size_t>(indices.size());
+                uint64_t* out = o.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    s.get_many(p, n, out, n_threads);
+                }
+                return o;
+            },
+            py::arg("indices"),
+            py::arg("n_threads") = 1
+        )
+        .def(
+            "contains_many",
+            [](
+                const pef::Sequence& s,
+                py::array_t<uint64_t, py::array::c_style> values,
+                unsigned n_threads
+            ) {
+                py::array_t<bool> o(values.size());
+                const uint64_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                bool* out = o.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    s.contains_many(p, n, out, n_threads);
+                }
+                return o;
+            },
+            py::arg("values"),
+            py::arg("n_threads") = 1
+        )
+        .def(
+            "rank_many",
+            [](
+                const pef::Sequence& s,
+                py::array_t<uint64_t, py::array::c_style> values,
+                unsigned n_threads
+            ) {
+                py::array_t<uint64_t> o(values.size());
+                const uint64_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                uint64_t* out = o.mutable_data();
+                {
+                    py::gil_scoped_release release;
+                    const ReadLock lock({&s});
+                    s.rank_many(p, n, out, n_threads);
+                }
+                return o;
+            },
+            py::arg("values"),
+            py::arg("n_threads") = 1
+        )
         .def("__len__", &pef::Sequence::n_elem)
-        .def("__and__", &pef::Sequence::intersect, py::arg("other"))
-        .def("__or__", &pef::Sequence::operator|, py::arg("other"))
-        .def("__sub__", &pef::Sequence::operator-, py::arg("other"))
+        .def(
+            "__and__",
+            [](const pef::Sequence& s, const pef::Sequence& other) {
+                const ReadLock lock({&s, &other});
+                return s.intersect(other);
+            },
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "__or__",
+            reading(&pef::Sequence::operator|),
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "__sub__",
+            reading(&pef::Sequence::operator-),
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "intersect",
+            reading(&pef::Sequence::intersect),
+            py::arg("other"),
+            py::arg("n_threads") = 1,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "union",
+            reading(&pef::Sequence::union_with),
+            py::arg("other"),
+            py::arg("n_threads") = 1,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "difference",
+            reading(&pef::Sequence::difference),
+            py::arg("other"),
+            py::arg("n_threads") = 1,
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "intersect_count",
+            reading(&pef::Sequence::intersect_count),
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "union_count",
+            reading(&pef::Sequence::union_count),
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "difference_count",
+            reading(&pef::Sequence::difference_count),
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def(
+            "intersects",
+            reading(&pef::Sequence::intersects),
+            py::arg("other"),
+            py::call_guard<py::gil_scoped_release>()
+        )
         .def(
             "filter_by_count",
-            &pef::Sequence::filter_by_count,
+            reading(&pef::Sequence::filter_by_count),
             py::arg("min_count") = 0,
             py::arg("max_count") = INT_MAX,
-            py::arg("write_multiset") = true
+            py::arg("write_multiset") = true,
+            py::call_guard<py::gil_scoped_release>()
         )
+        // These change the Sequence in place, so they wait for readers
+        // (see mutate).
         .def(
-            "serialize",
-            [](const pef::Sequence& s) {
-                std::string o = s.serialize();
-                return py::bytes(o.data(), o.size());
+            "append",
+            [](pef::Sequence& s, py::array_t<uint64_t, py::array::c_style> values) {
+                mutate(s, [&]() { s.append(values.data(), static_cast<size_t>(values.size())); });
+            },
+            py::arg("values")
+        )
+        .def(
+            "insert",
+            [](pef::Sequence& s, py::array_t<uint64_t, py::array::c_style> values) {
+                mutate(s, [&]() { s.insert(values.data(), static_cast<size_t>(values.size())); });
+            },
+            py::arg("values")
+        )
+        .def("serialize", &serialize, py::arg("version") = 1);
+    py::class_<pef::Sequence::Cursor>(m, "Cursor", py::module_local())
+        .def(
+            py::init<const pef::Sequence&>(),
+            py::arg("seq"),
+            py::keep_alive<1, 2>()
+        )
+        .def_property_readonly("at_end", &pef::Sequence::Cursor::at_end)
+        .def_property_readonly("value", &pef::Sequence::Cursor::value)
+        .def_property_readonly("index", &pef::Sequence::Cursor::index)
+        // Cursor::next checks for a stale Cursor only when it changes
+        // blocks, and a Python caller may append between any two steps.
+        .def(
+            "next",
+            [](pef::Sequence::Cursor& c) {
+                c.check_valid();
+                c.next();
+            }
+        )
+        .def("skip_to", &pef::Sequence::Cursor::skip_to, py::arg("x"));
+    // Held by shared_ptr, since SequenceCollectionWriter.build shares its
+    // builders with the writer.
+    py::class_<pef::SequenceBuilder, std::shared_ptr<pef::SequenceBuilder>>(
+        m, "SequenceBuilder", py::module_local()
+    )
+        .def(py::init<uint32_t>(), py::arg("block_size") = 256)
+        .def(
+            py::init<const std::string&, uint64_t, uint32_t>(),
+            py::arg("filepath"),
+            py::arg("max_elem"),
+            py::arg("block_size") = 256
+        )
+        .def_property_readonly("n_elem", &pef::SequenceBuilder::n_elem)
+        .def("push", &pef::SequenceBuilder::push, py::arg("value"))
+        .def(
+            "push_many",
+            [](pef::SequenceBuilder& b, py::array_t<uint64_t, py::array::c_style> values) {
+                const uint64_t* p = values.data();
+                const size_t n = static_cast<size_t>(values.size());
+                py::gil_scoped_release release;
+                b.push_many(p, n);
+            },
+            py::arg("values")
+        )
+        .def("finish", &pef::SequenceBuilder::finish)
+        .def("close", &pef::SequenceBuilder::close, py::call_guard<py::gil_scoped_release>());
+    py::class_<pef::InsertBuffer>(m, "InsertBuffer", py::module_local())
+        .def(
+            py::init<pef::Sequence&, size_t>(),
+            py::arg("seq"),
+            py::arg("capacity") = 4096,
+            py::keep_alive<1, 2>()
+        )
+        .def(
+            "insert",
+            [](pef::InsertBuffer& b, uint64_t v) { mutate(b.sequence(), [&]() { b.insert(v); }); },
+            py::arg("value")
+        )
+        .def("flush", [](pef::InsertBuffer& b) { mutate(b.sequence(), [&]() { b.flush(); }); })
+        .def("__len__", &pef::InsertBuffer::size);
+    py::class_<pef::CollectionEntry>(m, "CollectionEntry", py::module_local())
+        .def_readonly("term", &pef::CollectionEntry::term)
+        .def_readonly("offset", &pef::CollectionEntry::offset)
+        .def_readonly("size", &pef::CollectionEntry::size)
+        .def_readonly("n_elem", &pef::CollectionEntry::n_elem)
+        .def_readonly("block_size", &pef::CollectionEntry::block_size);
+    py::class_<pef::SequenceCollection>(m, "SequenceCollection", py::module_local())
+        .def(
+            py::init<const std::string&>(),
+            py::arg("filepath"),
+            py::call_guard<py::gil_scoped_release>()
+        )
+        .def("__len__", &pef::SequenceCollection::size)
+        .def("__contains__", &pef::SequenceCollection::contains, py::arg("term"))
+        .def("__getitem__", &pef::SequenceCollection::get, py::arg("term"))
+        .def("get", &pef::SequenceCollection::get, py::arg("term"))
+        .def("entry", &pef::SequenceCollection::entry, py::arg("i"))
+        .def(
+            "terms",
+            [](const pef::SequenceCollection& c) {
+                const std::vector<uint64_t> terms = c.terms();
+                py::array_t<uint64_t> o(terms.size());
+                std::copy(terms.begin(), terms.end(), o.mutable_data());
+                return o;
             }
         );
+    py::class_<pef::SequenceCollectionWriter>(m, "SequenceCollectionWriter", py::module_local())
+        .def(
+            py::init<const std::string&, uint32_t>(),
+            py::arg("filepath"),
+            py::arg("version") = 1
+        )
+        .def("__len__", &pef::SequenceCollectionWriter::size)
+        .def("add", &pef::SequenceCollectionWriter::add, py::arg("term"), py::arg("seq"))
+        .def(
+            "build",
+            &pef::SequenceCollectionWriter::build,
+            py::arg("term"),
+            py::arg("max_elem"),
+            py::arg("block_size") = 256,
+            py::keep_alive<0, 1>()
+        )
+        .def("close", &pef::SequenceCollectionWriter::close);
     m.def("deserialize", &deserialize, py::arg("serialized"));
+    m.def("from_buffer", &from_buffer, py::arg("buffer"));
+    py::class_<pef::Stats>(m, "Stats", py::module_local())
+        .def_readonly("blocks_decoded", &pef::Stats::blocks_decoded)
+        .def_readonly("elements_decoded", &pef::Stats::elements_decoded)
+        .def_readonly("blocks_skipped", &pef::Stats::blocks_skipped)
+        .def_readonly("blocks_copied", &pef::Stats::blocks_copied)
+        .def_readonly("bytes_encoded", &pef::Stats::bytes_encoded)
+        .def_readonly("get_calls", &pef::Stats::get_calls)
+        .def_readonly("contains_calls", &pef::Stats::contains_calls);
+    m.def("stats", &pef::stats);
+    m.def("reset_stats", &pef::reset_stats);
+    m.def("stats_enabled", &pef::stats_enabled);
+    m.def(
+        "intersect_files",
+        &pef::intersect_files,
+        py::arg("path_a"),
+        py::arg("path_b"),
+        py::arg("out_path"),
+        py::call_guard<py::gil_scoped_release>()
+    );
+    m.def(
+        "difference_files",
+        &pef::difference_files,
+        py::arg("path_a"),
+        py::arg("path_b"),
+        py::arg("out_path"),
+        py::call_guard<py::gil_scoped_release>()
+    );
+    m.def(
+        "union_files",
+        &pef::union_files,
+        py::arg("path_a"),
+        py::arg("path_b"),
+        py::arg("out_path"),
+        py::call_guard<py::gil_scoped_release>()
+    );
+    m.def(
+        "unique_file",
+        &pef::unique_file,
+        py::arg("path"),
+        py::arg("out_path"),
+        py::call_guard<py::gil_scoped_release>()
+    );
+    m.def(
+        "filter_by_count_file",
+        &pef::filter_by_count_file,
+        py::arg("path"),
+        py::arg("out_path"),
+        py::arg("min_count") = 0,
+        py::arg("max_count") = INT_MAX,
+        py::arg("write_multiset") = true,
+        py::call_guard<py::gil_scoped_release>()
+    );
+    m.def(
+        "intersect_many",
+        [](const py::iterable& seqs) {
+            const std::vector<const pef::Sequence*> ptrs = sequence_ptrs(seqs);
+            py::gil_scoped_release release;
+            const ReadLock lock(ptrs);
+            return pef::intersect_many(ptrs);
+        },
+        py::arg("seqs")
+    );
+    m.def(
+        "union_many",
+        [](const py::iterable& seqs) {
+            const std::vector<const pef::Sequence*> ptrs = sequence_ptrs(seqs);
+            py::gil_scoped_release release;
+            const ReadLock lock(ptrs);
+            return pef::union_many(ptrs);
+        },
+        py::arg("seqs")
+    );
 }
@@ -1,7 +1,72 @@
 #include "pef.h"
 
+#if defined(__BMI2__)
+  #include <immintrin.h>
+#endif
+
+#if !defined(_WIN32)
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
 namespace pef {
 
+namespace {
+
+// Backing counters for pef::stats().
+struct StatCounters {
+    std::atomic<uint64_t> blocks_decoded {0};
+    std::atomic<uint64_t> elements_decoded {0};
+    std::atomic<uint64_t> blocks_skipped {0};
+    std::atomic<uint64_t> blocks_copied {0};
+    std::atomic<uint64_t> bytes_encoded {0};
+    std::atomic<uint64_t> get_calls {0};
+    std::atomic<uint64_t> contains_calls {0};
+};
+
+StatCounters counters;
+
+} // end anonymous namespace
+
+// Add *n* to counter *name*, if we're collecting stats.
+#if defined(PEF_STATS)
+  #define PEF_COUNT(name, n) counters.name.fetch_add((n), std::memory_order_relaxed)
+#else
+  #define PEF_COUNT(name, n) ((void)0)
+#endif
+
+bool stats_enabled() {
+#if defined(PEF_STATS)
+    return true;
+#else
+    return false;
+#endif
+}
+
+Stats stats() {
+    Stats o;
+    o.blocks_decoded = counters.blocks_decoded.load(std::memory_order_relaxed);
+    o.elements_decoded = counters.elements_decoded.load(std::memory_order_relaxed);
+    o.blocks_skipped = counters.blocks_skipped.load(std::memory_order_relaxed);
+    o.blocks_copied = counters.blocks_copied.load(std::memory_order_relaxed);
+    o.bytes_encoded = counters.bytes_encoded.load(std::memory_order_relaxed);
+    o.get_calls = counters.get_calls.load(std::memory_order_relaxed);
+    o.contains_calls = counters.contains_calls.load(std::memory_order_relaxed);
+    return o;
+}
+
+void reset_stats() {
+    counters.blocks_decoded.store(0, std::memory_order_relaxed);
+    counters.elements_decoded.store(0, std::memory_order_relaxed);
+    counters.blocks_skipped.store(0, std::memory_order_relaxed);
+    counters.blocks_copied.store(0, std::memory_order_relaxed);
+    counters.bytes_encoded.store(0, std::memory_order_relaxed);
+    counters.get_calls.store(0, std::memory_order_relaxed);
+    counters.contains_calls.store(0, std::memory_order_relaxed);
+}
+
 inline uint32_t floor_log2_u64(uint64_t x) {
 #if defined(_MSC_VER) && !defined(__clang__)
     unsigned long idx;
@@ -16,8 +81,10 @@ inline uint32_t floor_log2_u64(uint64_t x) {
 #endif
 }
 
+// ceil(a / b), without the overflow of (a + b - 1) / b when a is near
+// UINT64_MAX.
 inline uint64_t ceil_div_u64(uint64_t a, uint64_t b) {
-    return (a + b - 1) / b;
+    return a / b + (a % b != 0);
 }
 
 inline uint32_t ctz64(uint64_t x) {
@@ -31,6 +98,69 @@ inline uint32_t ctz64(uint64_t x) {
 #endif
 }
 
+inline uint32_t popcount64(uint64_t x) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    return (uint32_t)__popcnt64(x);
+#else
+    return (uint32_t)__builtin_popcountll(x);
+#endif
+}
+
+inline uint32_t select_in_word(uint64_t x, uint32_t k) {
+    assert(popcount64(x) > k);
+#if defined(__BMI2__)
+    // deposit a single bit at the position of the k^th set bit of *x*.
+    return ctz64(_pdep_u64(1ULL << k, x));
+#else
+    // Broadword popcount of each byte: after these three steps, byte *b*
+    // of *s* holds the number of set bits in byte *b* of *x*.
+    uint64_t s = x - ((x >> 1) & 0x5555555555555555ULL);
+    s = (s & 0x3333333333333333ULL) + ((s >> 2) & 0x3333333333333333ULL);
+    s = (s + (s >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    // Byte *b* of *cum* holds the number of set bits in bytes 0..b of *x*.
+    const uint64_t cum = s * 0x0101010101010101ULL;
+    // Find the byte that contains the k^th set bit.
+    unsigned shift = 0;
+    while (shift < 56 && ((cum >> shift) & 0xFFULL) <= k) shift += 8;
+    if (shift) k -= (uint32_t)((cum >> (shift - 8)) & 0xFFULL);
+    // Clear the *k* lowest set bits of that byte; the next one is our bit.
+    uint64_t w = (x >> shift) & 0xFFULL;
+    while (k--) w &= w - 1ULL;
+    return shift + ctz64(w);
+#endif
+}
+
+inline uint64_t select1(
+    const uint64_t* H,
+    size_t nwords,
+    uint64_t k
+) {
+    // Skip whole words until we reach the one containing the k^th set bit.
+    for (size_t wi = 0; wi < nwords; ++wi) {
+        const uint32_t c = popcount64(H[wi]);
+        if (k < c) {
+            return (uint64_t)((wi << 6) + select_in_word(H[wi], (uint32_t)k));
+        }
+        k -= c;
+    }
+    return UINT64_MAX;
+}
+
+inline uint64_t select0(
+    const uint64_t* H,
+    size_t nwords,
+    uint64_t k
+) {
+    for (size_t wi = 0; wi < nwords; ++wi) {
+        const uint32_t c = 64u - popcount64(H[wi]);
+        if (k < c) {
+            return (uint64_t)((wi << 6) + select_in_word(~H[wi], (uint32_t)k));
+        }
+        k -= c;
+    }
+    return UINT64_MAX;
+}
+
 inline uint64_t next_one_at_or_after(
     const uint64_t* H,
     size_t nwords,
@@ -61,17 +191,21 @@ inline uint64_t next_one_at_or_after(
 // Return the index of the element in a sorted vector *v* corresponding
 // to the smallest value greater than or equal to *q*.
 size_t supremum_index(const std::vector<uint64_t>& v, const uint64_t q) {
-    if (v.size() == 0) {
+    return supremum_index(v.data(), v.size(), q);
+}
+
+size_t supremum_index(const uint64_t* v, size_t n, const uint64_t q) {
+    if (n == 0) {
         throw std::runtime_error("supremum_index: v must be nonempty");
     }
-    if (v.back() < q) {
+    if (v[n - 1] < q) {
         throw std::runtime_error("supremum_index: q is larger than the largest element in v");
     }
-    if (q <= v.front()) {
+    if (q <= v[0]) {
         return 0;
     }
     size_t lo = 0,
-           hi = v.size() - 1,
+           hi = n - 1,
            mid;
     while (lo + 1 < hi) {
         mid = lo + (hi - lo) / 2;
@@ -84,6 +218,33 @@ size_t supremum_index(const std::vector<uint64_t>& v, const uint64_t q) {
     return hi;
 }
 
+namespace {
+
+// Index of the first of the *n* sorted values v[0], v[stride], v[2 stride],
+// ... that is greater than or equal to *q*, or *n* if there is none. Used
+// for the block index, whose arrays are strided in version 2 files.
+size_t strided_lower_bound(const uint64_t* v, size_t stride, size_t n, uint64_t q) {
+    if (stride == 1) return std::lower_bound(v, v + n, q) - v;
+    size_t lo = 0, len = n;
+    while (len > 0) {
+        const size_t half = len / 2;
+        if (v[(lo + half) * stride] < q) {
+            lo += half + 1;
+            len -= half + 1;
+        } else {
+            len = half;
+        }
+    }
+    return lo;
+}
+
+// Round *n* up to a multiple of *align*.
+uint64_t round_up(uint64_t n, uint64_t align) {
+    return ceil_div_u64(n, align) * align;
+}
+
+} // end anonymous namespace
+
 BitReader::BitReader(const uint64_t* words, size_t n_words):
     words(words),
     n_words(n_words),
@@ -175,6 +336,113 @@ void BitWriter::flush() {
     }
 }
 
+namespace {
+
+// Unpack *n* densely packed *L*-bit integers from *low* into *out*. Having
+// *L* known at compile time turns the shifts and masks into constants and
+// lets the compiler unroll the loop.
+template <unsigned L>
+void unpack_low(const uint64_t* low, uint32_t n, uint64_t* out) {
+    const uint64_t mask = (L == 0) ? 0ULL : (~0ULL >> ((64 - L) & 63u));
+    for (uint32_t i = 0; i < n; ++i) {
+        const uint64_t bit = (uint64_t)i * L;
+        const size_t wi = (size_t)(bit >> 6);
+        const unsigned bo = (unsigned)(bit & 63ULL);
+        uint64_t v = (L == 0) ? 0ULL : (low[wi] >> bo);
+        // the integer straddles two words
+        if (bo + L > 64) v |= low[wi + 1] << ((64 - bo) & 63u);
+        out[i] = v & mask;
+    }
+}
+
+typedef void (*UnpackLowFn)(const uint64_t*, uint32_t, uint64_t*);
+
+#define PEF_UNPACK_LOW_4(L) \
+    &unpack_low<(L)>, &unpack_low<(L) + 1>, &unpack_low<(L) + 2>, &unpack_low<(L) + 3>
+#define PEF_UNPACK_LOW_16(L) \
+    PEF_UNPACK_LOW_4(L), PEF_UNPACK_LOW_4((L) + 4), \
+    PEF_UNPACK_LOW_4((L) + 8), PEF_UNPACK_LOW_4((L) + 12)
+
+// unpack_low<L> for L = 0..63, indexed by L.
+const UnpackLowFn unpack_low_fns[64] = {
+    PEF_UNPACK_LOW_16(0), PEF_UNPACK_LOW_16(16),
+    PEF_UNPACK_LOW_16(32), PEF_UNPACK_LOW_16(48)
+};
+
+#undef PEF_UNPACK_LOW_16
+#undef PEF_UNPACK_LOW_4
+
+// Decode the Elias-Fano block with header *meta* and bitvectors *low* and
+// *high* into *out* (size meta.n_elem).
+void decode_ef(
+    const EFBlockMetadata& meta,
+    const uint64_t* low,
+    const uint64_t* high,
+    uint64_t* out
+) {
+    const uint32_t n = meta.n_elem;
+    const unsigned l = meta.l;
+    // Unpack all of the low bits first...
+    unpack_low_fns[l & 63u](low, n, out);
+    // ...then walk the high bits one word at a time, extracting all of the
+    // set bits of each word with ctz and clearing them with w & (w - 1).
+    // There are exactly *n* set bits, one per element.
+    uint32_t i = 0;
+    for (size_t wi = 0; i < n; ++wi) {
+        uint64_t w = high[wi];
+        const uint64_t base = (uint64_t)wi << 6;
+        while (w) {
+            // See EFBlock::decode.
+            const uint64_t hi = base + ctz64(w) - i;
+            out[i] = meta.floor + ((hi << l) | out[i]);
+            ++i;
+            w &= w - 1ULL;
+        }
+    }
+}
+
+// Decode a BLOCK_BITMAP block: the elements are the positions of the set
+// bits in *high*, plus the floor.
+void decode_bitmap(
+    const EFBlockMetadata& meta,
+    const uint64_t* high,
+    uint64_t* out
+) {
+    uint32_t i = 0;
+    for (size_t wi = 0; i < meta.n_elem; ++wi) {
+        uint64_t w = high[wi];
+        const uint64_t base = meta.floor + ((uint64_t)wi << 6);
+        while (w) {
+            out[i++] = base + ctz64(w);
+            w &= w - 1ULL;
+        }
+    }
+}
+
+// Decode a block of any BlockEncoding into *out* (size meta.n_elem).
+void decode_any(
+    const EFBlockMetadata& meta,
+    const uint64_t* low,
+    const uint64_t* high,
+    uint64_t* out
+) {
+    PEF_COUNT(blocks_decoded, 1);
+    PEF_COUNT(elements_decoded, meta.n_elem);
+    switch (meta.encoding) {
+        case BLOCK_RUN:
+            for (uint32_t i = 0; i < meta.n_elem; ++i) out[i] = meta.floor + i;
+            break;
+        case BLOCK_BITMAP:
+            decode_bitmap(meta, high, out);
+            break;
+        default:
+            decode_ef(meta, low, high, out);
+            break;
+    }
+}
+
+} // end anonymous namespace
+
 EFBlock::EFBlock(
     EFBlockMetadata meta,
     std::vector<uint64_t> low,
@@ -192,7 +460,50 @@ inline uint32_t EFBlock::choose_l(uint64_t range, uint32_t n) {
     return floor_log2_u64(q);
 }
 
+namespace {
+
+// True if none of the *n* nondecreasing *values* repeat.
+bool all_distinct(const uint64_t* values, uint32_t n) {
+    for (uint32_t i = 1; i < n; ++i) {
+        if (values[i] == values[i - 1]) return false;
+    }
+    return true;
+}
+
+// Words taken by the low and high bits of an Elias-Fano block of *n*
+// integers spanning *range* (see EFBlock::EFBlock).
+uint64_t ef_words(uint64_t range, uint32_t n) {
+    const uint32_t l = EFBlock::choose_l(range, n);
+    const uint64_t range_hi = (l == 0) ? range
+        : (range >> l) + ((range & ((1ULL << l) - 1ULL)) != 0);
+    return ceil_div_u64((uint64_t)n * l, 64)
+        + ceil_div_u64((uint64_t)n + range_hi, 64);
+}
+
+} // end anonymous namespace
+
+BlockEncoding EFBlock::choose_encoding(uint64_t range, uint32_t n, bool distinct) {
+    if (!distinct) return BLOCK_EF;
+    // n distinct integers spanning exactly n values are a single run.
+    if (range == n) return BLOCK_RUN;
+    // A bitmap never pays off for ranges wider than 64 bits per element,
+    // and ruling those out keeps its word count clear of overflow.
+    if (range > (uint64_t)n * 64) return BLOCK_EF;
+    return (ceil_div_u64(range, 64) <= ef_words(range, n)) ? BLOCK_BITMAP : BLOCK_EF;
+}
+
 EFBlock::EFBlock(const uint64_t* values, uint32_t n_elem) {
+    // Encode into a scratch buffer laid out like a Sequence's payload,
+    // then split it into the header and the two bitvectors.
+    std::vector<uint64_t> buf(encoded_size(values, n_elem) / sizeof(uint64_t));
+    encode_into(values, n_elem, reinterpret_cast<uint8_t*>(buf.data()));
+    std::memcpy(&meta, buf.data(), sizeof(meta));
+    const uint64_t* words = buf.data() + sizeof(meta) / sizeof(uint64_t);
+    low.assign(words, words + meta.low_words);
+    high.assign(words + meta.low_words, words + meta.low_words + meta.high_words);
+}
+
+size_t EFBlock::encode_into(const uint64_t* values, uint32_t n_elem, uint8_t* dst) {
     if (n_elem == 0) {
         std::ostringstream msg;
         msg << "EFBlock cannot be constructed from zero elements, "
@@ -200,6 +511,7 @@ EFBlock::EFBlock(const uint64_t* values, uint32_t n_elem) {
             << "bit boundary";
         throw std::runtime_error(msg.str());
     }
+    EFBlockMetadata meta {};
     meta.n_elem = n_elem;
 
     // smallest element in the universe
@@ -211,6 +523,32 @@ EFBlock::EFBlock(const uint64_t* values, uint32_t n_elem) {
     // number of bits required to span universe
     const uint64_t range = (last - values[0]) + 1ULL;
 
+    // The low and high words go right after the header; *dst* is 8-byte
+    // aligned in a payload, since every block is a whole number of words.
+    uint64_t* low = reinterpret_cast<uint64_t*>(dst + sizeof(meta));
+
+    meta.encoding = choose_encoding(range, n_elem, all_distinct(values, n_elem));
+    if (meta.encoding == BLOCK_RUN) {
+        // Nothing to store beyond the header.
+        std::memcpy(dst, &meta, sizeof(meta));
+        PEF_COUNT(bytes_encoded, sizeof(meta));
+        return sizeof(meta);
+    }
+    if (meta.encoding == BLOCK_BITMAP) {
+        uint64_t* high = low;
+        const size_t hw = (size_t)ceil_div_u64(range, 64);
+        std::fill(high, high + hw, 0ULL);
+        for (uint32_t i = 0; i < n_elem; ++i) {
+            const uint64_t x = values[i] - meta.floor;
+            high[x >> 6] |= (1ULL << (x & 63ULL));
+        }
+        meta.high_words = hw;
+        meta.high_bits_len = range;
+        std::memcpy(dst, &meta, sizeof(meta));
+        PEF_COUNT(bytes_encoded, sizeof(meta) + hw * sizeof(uint64_t));
+        return sizeof(meta) + hw * sizeof(uint64_t);
+    }
+
     // choose the partition between the "low" and "high" bits.
     // this is essentially the number of bits required to encode
     // the distance between adjacent elements if the elements were
@@ -221,22 +559,23 @@ EFBlock::EFBlock(const uint64_t* values, uint32_t n_elem) {
     const uint64_t one = 1ULL;
 
     // Write the *l* least significant bits from each element in *v*
-    // to a dense bitvector.
-    BitWriter bw;
+    // to a dense bitvector, in the same order as BitWriter::put: element
+    // *i* takes bits [i*l, (i+1)*l), and may straddle two words.
+    const size_t lw = (size_t)ceil_div_u64((uint64_t)n_elem * l, 64);
+    std::fill(low, low + lw, 0ULL);
     if (l > 0) {
+        const uint64_t mask = (l == 64) ? ~0ULL : ((one << l) - 1ULL);
         for (uint32_t i = 0; i < n_elem; ++i) {
             // value of this element relative to the least element
-            uint64_t x = values[i] - meta.floor;
-            // assign the *l* least significant bits in *x* to *low*
-            uint64_t low = x & ((one << l) - 1ULL);
-            // write these bits to the output bitvector
-            bw.put(low, l);
+            const uint64_t x = values[i] - meta.floor;
+            // the *l* least significant bits in *x*
+            const uint64_t bits = x & mask;
+            const uint64_t pos = (uint64_t)i * l;
+            const unsigned off = (unsigned)(pos & 63ULL);
+            low[pos >> 6] |= bits << off;
+            if (off + l > 64) low[(pos >> 6) + 1] |= bits >> (64 - off);
         }
-        // write the last word, even if it's incomplete
-        bw.flush();
     }
-    // get the output packed bitvector
-    low = std::move(bw.words);
 
     // bits_hi is the number of bits required for the high bit representation.
     // How much space do we need?
@@ -245,13 +584,14 @@ EFBlock::EFBlock(const uint64_t* values, uint32_t n_elem) {
     // bits to represent gaps between the elements.
     // So we need a total of n + range//(2^l) bits.
     const uint64_t range_hi = (l == 0) ? range
-        : ((range + ((one << l) - 1ULL)) >> l);
+        : (range >> l) + ((range & ((one << l) - 1ULL)) != 0);
     const uint64_t bits_hi = (uint64_t)n_elem + range_hi;
 
     // Number of 8-byte "blocks" required to for *bits_hi* bits.
-    size_t hw = (size_t)ceil_div_u64(bits_hi, 64);
-    // Allocate these blocks and initialize to zero.
-    high.assign(hw, 0ULL);
+    const size_t hw = (size_t)ceil_div_u64(bits_hi, 64);
+    uint64_t* high = low + lw;
+    // Initialize these blocks to zero.
+    std::fill(high, high + hw, 0ULL);
     // for each element in the input...
     for (uint32_t i = 0; i < n_elem; ++i) {
         // value of this element relative to the least element
@@ -280,49 +620,222 @@ EFBlock::EFBlock(const uint64_t* values, uint32_t n_elem) {
     }
 
     // Number of 8-byte blocks in the (uncompressed) low bit representation.
-    meta.low_words = low.size();
+    meta.low_words = lw;
 
     // Number of 8-byte blocks in the (unary-compressed) high bit representation.
-    meta.high_words = high.size();
+    meta.high_words = hw;
 
     // Total number of bits in the high bit representation (bits_hi <= high_words * 64).
     meta.high_bits_len = bits_hi;
+
+    std::memcpy(dst, &meta, sizeof(meta));
+    PEF_COUNT(bytes_encoded, sizeof(meta) + (lw + hw) * sizeof(uint64_t));
+    return sizeof(meta) + (lw + hw) * sizeof(uint64_t);
 }
 
-std::vector<uint64_t> EFBlock::decode() const {
-    // Low bits are written densely, so we can read them by simply striding
-    // across the *low* bitarray.
-    BitReader br(low.data(), low.size());
-    // Bit position of the previous element in the high bits.
-    uint64_t prev_hi_pos = UINT64_MAX;
-    // Pointer to start of the unary encoding.
-    const uint64_t *highw = high.data();
+size_t EFBlock::encoded_size(const uint64_t* values, uint32_t n_elem) {
+    if (n_elem == 0) {
+        throw std::runtime_error("EFBlock cannot be constructed from zero elements");
+    }
+    return encoded_size(
+        (values[n_elem - 1] - values[0]) + 1ULL,
+        n_elem,
+        all_distinct(values, n_elem)
+    );
+}
 
-    std::vector<uint64_t> out(meta.n_elem);
-    for (uint32_t i = 0; i < meta.n_elem; ++i) {
-        // Start looking for the next set bit, after the previous elements'
-        // set bit. *pos* is the bit position relative to *highw*.
-        uint64_t start = (prev_hi_pos == UINT64_MAX) ? 0ULL : (prev_hi_pos + 1ULL);
-        uint64_t pos = next_one_at_or_after(highw, (size_t)meta.high_words, start);
-        prev_hi_pos = pos;
-        // Since pos = (# of prev elements) + (value of curr. element - floor),
-        // this is the value of the current element (minus the floor).
-        uint64_t hi = pos - i;
-        // Write the low bits into *lo*, LSB first.
-        uint64_t lo = (meta.l ? br.get(meta.l) : 0ULL);
-        // Combine low and high bits to get the original element's value.
-        out[i] = meta.floor + ((hi << meta.l) | lo);
+size_t EFBlock::encoded_size(uint64_t range, uint32_t n_elem, bool distinct) {
+    // Same arithmetic as EFBlock::EFBlock.
+    uint64_t words = 0;
+    switch (choose_encoding(range, n_elem, distinct)) {
+        case BLOCK_RUN: words = 0; break;
+        case BLOCK_BITMAP: words = ceil_div_u64(range, 64); break;
+        default: words = ef_words(range, n_elem); break;
+    }
+    return sizeof(EFBlockMetadata) + (size_t)words * sizeof(uint64_t);
+}
+
+std::vector<uint64_t> optimal_partition(
+    const uint64_t* values,
+    size_t n,
+    uint32_t max_block_size,
+    double eps1,
+    double eps2
+) {
+    if (n == 0) return std::vector<uint64_t>();
+    if (max_block_size == 0) {
+        throw std::runtime_error("optimal_partition: max_block_size must be positive");
+    }
+    // n_repeats[i] is the number of values among values[1, i] equal to
+    // their predecessor, so that values[i, j) are distinct iff
+    // n_repeats[j - 1] == n_repeats[i].
+    std::vector<uint32_t> n_repeats(n, 0);
+    for (size_t i = 1; i < n; ++i) {
+        n_repeats[i] = n_repeats[i - 1] + (values[i] == values[i - 1]);
+    }
+    // Bytes taken by values[i, j) as one block, counting its three entries
+    // in the block index.
+    auto cost = [&](size_t i, size_t j) {
+        return (uint64_t)EFBlock::encoded_size(
+            values[j - 1] - values[i] + 1ULL,
+            (uint32_t)(j - i),
+            n_repeats[j - 1] == n_repeats[i]
+        ) + 3 * sizeof(uint64_t);
+    };
+
+    // A block costs at least F = cost(0, 1), the fixed overhead. Splitting a
+    // block whose cost is at least F / eps1 adds at most a factor (1 + eps1)
+    // to the total, so we only need to consider blocks that end where their
+    // cost crosses one of the bounds F, F(1 + eps2), F(1 + eps2)^2, ... up
+    // to F / eps1, plus the longest ones allowed. For each bound, a sliding
+    // window tracks the longest block starting at *i* that stays below it.
+    struct Window {
+        size_t end;
+        uint64_t cost_bound;
+    };
+    const uint64_t fixed_cost = cost(0, 1);
+    std::vector<Window> windows;
+    for (double bound = (double)fixed_cost; ; bound *= (1.0 + eps2)) {
+        windows.push_back(Window {0, (uint64_t)bound});
+        if (eps1 > 0 && bound >= fixed_cost / eps1) break;
+        if (bound >= (double)cost(0, std::min<size_t>(n, max_block_size))) break;
+    }
+
+    // min_cost[j] is the cheapest encoding of values[0, j) found so far,
+    // and path[j] the start of its last block.
+    std::vector<uint64_t> min_cost(n + 1, UINT64_MAX),
+                          path(n + 1, 0);
+    min_cost[0] = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const size_t max_end = std::min<size_t>(n, i + max_block_size);
+        // Each window ends at or after the previous (smaller) one.
+        size_t last_end = i + 1;
+        for (Window& w: windows) {
+            w.end = std::max(w.end, last_end);
+            while (true) {
+                const uint64_t c = cost(i, w.end);
+                if (min_cost[i] + c < min_cost[w.end]) {
+                    min_cost[w.end] = min_cost[i] + c;
+                    path[w.end] = i;
+                }
+                last_end = w.end;
+                if (w.end == max_end || c >= w.cost_bound) break;
+                ++w.end;
+            }
+        }
     }
+
+    // Walk back from the end to recover the block boundaries.
+    std::vector<uint64_t> begins;
+    for (size_t j = n; j > 0; j = (size_t)path[j]) begins.push_back(path[j]);
+    std::reverse(begins.begin(), begins.end());
+    return begins;
+}
+
+std::vector<uint64_t> EFBlock::decode() const {
+    // Low bits are written densely, one *l*-bit integer per element. The
+    // high bits hold one set bit per element at position (x >> l) + i,
+    // where *x* is element i minus the floor.
+    std::vector<uint64_t> out(meta.n_elem);
+    decode_any(meta, low.data(), high.data(), out.data());
     return out;
 }
 
+EFBlockView::EFBlockView(const uint8_t* base) {
+    std::memcpy(&meta, base, sizeof(meta));
+    low = reinterpret_cast<const uint64_t*>(base + sizeof(meta));
+    high = low + meta.low_words;
+}
+
+uint64_t EFBlockView::get(uint32_t i) const {
+    assert(i < meta.n_elem);
+    if (meta.encoding == BLOCK_RUN) return meta.floor + i;
+    if (meta.encoding == BLOCK_BITMAP) {
+        return meta.floor + select1(high, (size_t)meta.high_words, i);
+    }
+    // Position of the i^th set bit is (value of element i - floor) >> l,
+    // plus i (see EFBlock::EFBlock).
+    const uint64_t pos = select1(high, (size_t)meta.high_words, i);
+    const uint64_t hi = pos - i;
+    uint64_t lo = 0ULL;
+    if (meta.l) {
+        // The low bits are packed densely, so element i starts at bit i*l.
+        BitReader br(low, (size_t)meta.low_words);
+        br.scan((uint64_t)i * meta.l);
+        lo = br.get(meta.l);
+    }
+    return meta.floor + ((hi << meta.l) | lo);
+}
+
+uint32_t EFBlockView::lower_bound(uint64_t q, uint64_t& value) const {
+    if (q <= meta.floor) {
+        value = meta.floor;
+        return 0;
+    }
+    const uint64_t x = q - meta.floor;
+    if (meta.encoding == BLOCK_RUN) {
+        if (x >= meta.n_elem) return meta.n_elem;
+        value = q;
+        return (uint32_t)x;
+    }
+    if (meta.encoding == BLOCK_BITMAP) {
+        if (x >= meta.high_bits_len) return meta.n_elem;
+        // The answer is the first set bit at or after *x*, and its index
+        // is the number of set bits before it.
+        const size_t wi = (size_t)(x >> 6);
+        uint32_t i = 0;
+        for (size_t k = 0; k < wi; ++k) i += popcount64(high[k]);
+        i += popcount64(high[wi] & ((1ULL << (x & 63ULL)) - 1ULL));
+        value = meta.floor + next_one_at_or_after(high, (size_t)meta.high_words, x);
+        return i;
+    }
+    // Every element in a lower high-bit bucket is smaller than *q*.
+    const uint64_t bucket = x >> meta.l;
+    // Index of the first element whose high bits are >= *bucket*, and the
+    // bit position in *high* at which to start looking for it. Element i
+    // is preceded by exactly (its high bits) zeros in *high*, so this is
+    // just after the (bucket-1)^th zero.
+    uint64_t i = 0,
+             pos = 0;
+    if (bucket > 0) {
+        const uint64_t z = select0(high, (size_t)meta.high_words, bucket - 1);
+        if (z == UINT64_MAX || z >= meta.high_bits_len) return meta.n_elem;
+        pos = z + 1;
+        i = pos - bucket;
+    }
+    BitReader br(low, (size_t)meta.low_words);
+    if (meta.l && i < meta.n_elem) br.scan(i * meta.l);
+    // Scan the candidates within the bucket.
+    for (; i < meta.n_elem; ++i, ++pos) {
+        pos = next_one_at_or_after(high, (size_t)meta.high_words, pos);
+        const uint64_t hi = pos - i;
+        const uint64_t lo = (meta.l ? br.get(meta.l) : 0ULL);
+        const uint64_t rel = (hi << meta.l) | lo;
+        // Any element in a later bucket is necessarily >= q.
+        if (hi > bucket || rel >= x) {
+            value = meta.floor + rel;
+            return (uint32_t)i;
+        }
+    }
+    return meta.n_elem;
+}
+
+uint32_t EFBlockView::lower_bound(uint64_t q) const {
+    uint64_t value;
+    return lower_bound(q, value);
+}
+
+void EFBlockView::decode(uint64_t* out) const {
+    decode_any(meta, low, high, out);
+}
+
 void EFBlock::show() const {
     std::cout << "Header:\n";
     std::cout << "  n_elem:        " << meta.n_elem << std::endl;
     std::cout << "  l:             " << meta.l << std::endl;
+    std::cout << "  encoding:      " << (int)meta.encoding << std::endl;
     std::cout << "  pad[0]:        " << meta.pad[0] << std::endl;
     std::cout << "  pad[1]:        " << meta.pad[1] << std::endl;
-    std::cout << "  pad[2]:        " << meta.pad[2] << std::endl;
     std::cout << "  floor:         " << meta.floor << std::endl;
     std::cout << "  low_words:     " << meta.low_words << std::endl;
     std::cout << "  high_words:    " << meta.high_words << std::endl;
@@ -445,82 +958,103 @@ Sequence::Sequence(uint32_t block_size):
 
 Sequence::Sequence(
     const std::vector<uint64_t>& values,
-    uint32_t block_size
-) {
-    if (!std::is_sorted(values.begin(), values.end())) {
+    uint32_t block_size,
+    unsigned n_threads
+): Sequence(values.data(), values.size(), block_size, true, n_threads) {}
+
+Sequence::Sequence(
+    const uint64_t* values,
+    size_t n_values,
+    uint32_t block_size,
+    bool check_sorted,
+    unsigned n_threads
+): Sequence(block_size) {
+    if (check_sorted && !std::is_sorted(values, values + n_values)) {
         throw std::runtime_error(
             "input sequence must be nondecreasing"
         );
     }
-    const uint64_t n_elem = static_cast<uint64_t>(values.size()),
-                   n_blocks = (uint64_t)ceil_div_u64(n_elem, block_size);
-    block_last_.resize(n_blocks);
-    block_offs_.resize(n_blocks);
-    payload_.clear();
-
-    // Current byte offset into the block. We require that all blocks
-    // have 8-byte alignment here for performance resaons, so there can
-    // be unused space in each EFBlock.
-    size_t cursor = 0; // payload size so far (bytes)
+    _encode_segments(
+        std::vector<std::pair<const uint64_t*, size_t> >(1, std::make_pair(values, n_values)),
+        n_threads
+    );
+}
 
-    for (uint64_t bi = 0; bi < n_blocks; ++bi) {
-        // Start of this block.
-        const uint64_t begin = bi * block_size;
-        // End of this block; could be less than *block_size* if we're at
-        // the end of the sequence.
-        const uint64_t end = std::min(n_elem, begin + block_size);
-        // Number of elements in the block (n <= block_size).
-        const uint32_t n = (uint32_t)(end - begin);
-        // Pointer to the first element in the block.
-        const uint64_t* p = values.data() + begin;
-        // Record the byte offset of this block in the file.
-        block_offs_[bi] = cursor;
-        // Record the value of the highest element in this block.
-        block_last_[bi] = p[n - 1];
-        // Compress this block.
-        EFBlock blk(p, n);
-        // Write the BlockHeader.
-        append_bytes(&blk.meta, sizeof(blk.meta));
-        cursor += sizeof(blk.meta);
-        // Write the low bit representation (u64)
-        if (!blk.low.empty()) {
-            append_bytes(blk.low.data(), blk.low.size() * sizeof(uint64_t));
-            cursor += blk.low.size() * sizeof(uint64_t);
-        }
-        // Write the high bit representation (u64)
-        if (!blk.high.empty()) {
-            append_bytes(blk.high.data(), blk.high.size() * sizeof(uint64_t));
-            cursor += blk.high.size() * sizeof(uint64_t);
-        }
+Sequence Sequence::optimal(
+    const uint64_t* values,
+    size_t n_values,
+    uint32_t max_block_size,
+    bool check_sorted,
+    unsigned n_threads
+) {
+    if (check_sorted && !std::is_sorted(values, values + n_values)) {
+        throw std::runtime_error(
+            "input sequence must be nondecreasing"
+        );
     }
+    Sequence o(max_block_size);
+    o.meta.reserved |= SEQUENCE_VARIABLE_BLOCKS;
+    o.block_begin_ = optimal_partition(values, n_values, max_block_size);
+    o._encode_segments(
+        std::vector<std::pair<const uint64_t*, size_t> >(1, std::make_pair(values, n_values)),
+        n_threads
+    );
+    return o;
+}
 
-    // Configure SequenceMetadata
-    meta.magic[0] = 'P';
-    meta.magic[1] = 'P';
-    meta.magic[2] = 'E';
-    meta.magic[3] = 'F';
-    meta.version = 1;
-    meta.block_size = block_size;
-    meta.reserved = 0;
-    meta.n_elem = n_elem;
-    meta.n_blocks = n_blocks;
-    meta.payload_offset = sizeof(SequenceMetadata) + n_blocks * sizeof(uint64_t) * 2;
+Sequence Sequence::optimal(
+    const std::vector<uint64_t>& values,
+    uint32_t max_block_size,
+    unsigned n_threads
+) {
+    return optimal(values.data(), values.size(), max_block_size, true, n_threads);
 }
 
+// Copying a view is cheap: the copy shares the same external storage.
 Sequence::Sequence(const Sequence& other):
     meta(other.meta),
     block_last_(other.block_last_),
     block_offs_(other.block_offs_),
-    payload_(other.payload_)
+    block_begin_(other.block_begin_),
+    payload_(other.payload_),
+    backing_(other.backing_),
+    view_last_(other.view_last_),
+    view_offs_(other.view_offs_),
+    view_begin_(other.view_begin_),
+    view_payload_(other.view_payload_),
+    view_payload_size_(other.view_payload_size_),
+    view_stride_(other.view_stride_),
+    view_floor_(other.view_floor_),
+    view_buffer_(other.view_buffer_),
+    view_buffer_size_(other.view_buffer_size_)
+    // The cache and the skip index aren't copied: the copy starts
+    // without them.
 {}
 
 Sequence::Sequence(Sequence&& other) noexcept:
     meta(std::move(other.meta)),
     block_last_(std::move(other.block_last_)),
     block_offs_(std::move(other.block_offs_)),
-    payload_(std::move(other.payload_))
+    block_begin_(std::move(other.block_begin_)),
+    payload_(std::move(other.payload_)),
+    backing_(std::move(other.backing_)),
+    view_last_(other.view_last_),
+    view_offs_(other.view_offs_),
+    view_begin_(other.view_begin_),
+    view_payload_(other.view_payload_),
+    view_payload_size_(other.view_payload_size_),
+    view_stride_(other.view_stride_),
+    view_floor_(other.view_floor_),
+    view_buffer_(other.view_buffer_),
+    view_buffer_size_(other.view_buffer_size_),
+    cache_(std::move(other.cache_)),
+    skip_(other.skip_.exchange(nullptr))
 {}
 
+Sequence::~Sequence() {
+    delete skip_.load();
+}
+
 void file_error(
     const std::string& operation,
     const std::string& path,
@@ -532,54 +1066,176 @@ void file_error(
     throw std::runtime_error(o.str());
 }
 
-void Sequence::serialize_to_stream(std::ostream& out) const {
-    if (!out) {
-        throw std::runtime_error("failed to open stream for writing");
+template <class Write>
+void Sequence::serialize_with(Write& write, uint32_t version) const {
+    if (version != 1 && version != 2) {
+        throw std::runtime_error("Sequence::serialize: version must be 1 or 2");
     }
-    out.write(
-        reinterpret_cast<const char*>(&meta),
-        sizeof(meta)
-    );
-    if (!out) {
-        throw std::runtime_error("failed to write header");
+    const uint64_t n_blocks = meta.n_blocks,
+                   align = (version == 2) ? V2_ALIGN : 1;
+    const std::vector<char> zeros(V2_ALIGN, 0);
+
+    // Lay out the output payload: blocks end to end, each starting at a
+    // multiple of *align*. If that's exactly how our payload is laid out
+    // already, it's written in one piece.
+    std::vector<uint64_t> offs(n_blocks);
+    uint64_t payload_bytes = 0;
+    for (uint64_t bi = 0; bi < n_blocks; ++bi) {
+        offs[bi] = payload_bytes;
+        payload_bytes += round_up(block_bytes(bi), align);
+    }
+    bool verbatim = payload_bytes == payload_size();
+    const size_t stride = index_stride();
+    for (uint64_t bi = 0; verbatim && bi < n_blocks; ++bi) {
+        verbatim = offs[bi] == block_offs_data()[bi * stride];
+    }
+
+    // The payload always directly follows the block index here, even if
+    // this Sequence was read from a file with a gap in between (see
+    // SequenceBuilder).
+    SequenceMetadata m = meta;
+    m.version = version;
+    if (version == 1) {
+        m.payload_offset = sizeof(SequenceMetadata) + index_bytes();
+        write(&m, sizeof(m), "header");
+        // Gather each array of the block index.
+        std::vector<uint64_t> column(n_blocks);
+        auto write_column = [&](const uint64_t* p, const char* what) {
+            for (uint64_t bi = 0; bi < n_blocks; ++bi) column[bi] = p[bi * stride];
+            write(column.data(), n_blocks * sizeof(uint64_t), what);
+        };
+        write_column(block_last_data(), "block_last_");
+        write(offs.data(), n_blocks * sizeof(uint64_t), "block_offs_");
+        if (variable_blocks()) write_column(block_begin_data(), "block_begin_");
+    } else {
+        const uint64_t table_offset = round_up(sizeof(SequenceMetadata), V2_ALIGN);
+        m.payload_offset = round_up(table_offset + n_blocks * sizeof(BlockEntry), V2_ALIGN);
+        write(&m, sizeof(m), "header");
+        write(zeros.data(), table_offset - sizeof(m), "header");
+        std::vector<BlockEntry> table(n_blocks);
+        for (uint64_t bi = 0; bi < n_blocks; ++bi) {
+            EFBlockMetadata block_meta;
+            std::memcpy(&block_meta, block_data(bi), sizeof(block_meta));
+            table[bi].last = block_last(bi);
+            table[bi].offset = offs[bi];
+            table[bi].begin = block_begin(bi);
+            table[bi].floor = block_meta.floor;
+        }
+        write(table.data(), n_blocks * sizeof(BlockEntry), "block table");
+        write(zeros.data(), m.payload_offset - table_offset - n_blocks * sizeof(BlockEntry), "block table");
     }
-    out.write(
-        reinterpret_cast<const char*>(block_last_.data()),
-        static_cast<std::streamsize>(block_last_.size() * sizeof(uint64_t))
-    );
-    if (!out) {
-        throw std::runtime_error("failed to write block_last_");
+
+    if (verbatim) {
+        write(payload_data(), payload_size(), "payload_");
+        return;
     }
-    out.write(
-        reinterpret_cast<const char*>(block_offs_.data()),
-        static_cast<std::streamsize>(block_offs_.size() * sizeof(uint64_t))
-    );
-    if (!out) {
-        throw std::runtime_error("failed to write block_offs_");
+    for (uint64_t bi = 0; bi < n_blocks; ++bi) {
+        const size_t nbytes = block_bytes(bi);
+        write(block_data(bi), nbytes, "payload_");
+        write(zeros.data(), round_up(nbytes, align) - nbytes, "payload_");
     }
-    out.write(
-        reinterpret_cast<const char*>(payload_.data()),
-        static_cast<std::streamsize>(payload_.size())
-    );
+}
+
+void Sequence::serialize_to_stream(std::ostream& out, uint32_t version) const {
     if (!out) {
-        throw std::runtime_error("failed to write payload_");
+        throw std::runtime_error("failed to open stream for writing");
     }
+    auto write = [&out](const void* p, size_t n, const char* what) {
+        out.write(reinterpret_cast<const char*>(p), static_cast<std::streamsize>(n));
+        if (!out) {
+            throw std::runtime_error(std::string("failed to write ") + what);
+        }
+    };
+    serialize_with(write, version);
 }
 
-std::string Sequence::serialize() const {
-    std::ostringstream o;
-    serialize_to_stream(o);
-    return o.str();
+size_t Sequence::serialized_size(uint32_t version) const {
+    size_t size = 0;
+    auto count = [&size](const void*, size_t n, const char*) { size += n; };
+    serialize_with(count, version);
+    return size;
+}
+
+void Sequence::serialize_into(void* dst, size_t size, uint32_t version) const {
+    uint8_t* pos = static_cast<uint8_t*>(dst);
+    const uint8_t* end = pos + size;
+    auto write = [&pos, end](const void* p, size_t n, const char* what) {
+        if (n > static_cast<size_t>(end - pos)) {
+            throw std::runtime_error(std::string("Sequence::serialize_into: no room for ") + what);
+        }
+        if (n > 0) std::memcpy(pos, p, n);
+        pos += n;
+    };
+    serialize_with(write, version);
+}
+
+std::string Sequence::serialize(uint32_t version) const {
+    // Written in place, rather than through an ostringstream and a copy.
+    std::string o(serialized_size(version), '\0');
+    serialize_into(&o[0], o.size(), version);
+    return o;
 }
 
-void Sequence::save(const std::string& path) const {
+void Sequence::save(const std::string& path, uint32_t version) const {
     std::ofstream o(path, std::ios::binary);
     if (!o) {
         file_error("save", path, "failure to open file");
     }
-    serialize_to_stream(o);
+    serialize_to_stream(o, version);
+}
+
+namespace {
+
+// Check the block index of a serialized Sequence before anything trusts
+// it: the block count must match the header, variable-length blocks must
+// start at 0 and hold 1 to block_size elements each, block maxima must not
+// decrease, and each block's offset must leave room for at least a header
+// after the previous one and lie within the *payload_size*-byte payload.
+// The arrays have stride *stride*; *begin* is only read for variable-length
+// blocks. The block headers themselves are trusted, so that viewing a
+// buffer doesn't touch its whole payload.
+void check_block_index(
+    const SequenceMetadata& meta,
+    const uint64_t* last,
+    const uint64_t* offs,
+    const uint64_t* begin,
+    size_t stride,
+    uint64_t payload_size
+) {
+    const bool variable = (meta.reserved & SEQUENCE_VARIABLE_BLOCKS) != 0;
+    bool counts_ok;
+    if (variable) {
+        counts_ok = meta.n_blocks <= meta.n_elem && (meta.n_blocks == 0) == (meta.n_elem == 0);
+    } else if (meta.n_elem == 0) {
+        counts_ok = meta.n_blocks == 0;
+    } else {
+        counts_ok = meta.block_size > 0
+            && meta.n_blocks == ceil_div_u64(meta.n_elem, meta.block_size);
+    }
+    if (!counts_ok) {
+        throw std::runtime_error("invalid n_blocks");
+    }
+    const uint64_t header = sizeof(EFBlockMetadata);
+    for (uint64_t bi = 0; bi < meta.n_blocks; ++bi) {
+        const uint64_t k = bi * stride;
+        if (payload_size < header || offs[k] > payload_size - header
+            || (bi > 0 && offs[k] < offs[k - stride] + header)) {
+            throw std::runtime_error("invalid block offsets");
+        }
+        if (bi > 0 && last[k] < last[k - stride]) {
+            throw std::runtime_error("invalid block maxima");
+        }
+        // Variable-length blocks hold from 1 to block_size elements.
+        if (!variable) continue;
+        const uint64_t end = bi + 1 < meta.n_blocks ? begin[k + stride] : meta.n_elem;
+        if ((bi == 0 && begin[k] != 0) || end <= begin[k] || end - begin[k] > meta.block_size) {
+            throw std::runtime_error("invalid block first element indices");
+        }
+    }
 }
 
+} // end anonymous namespace
+
 void Sequence::init_from_stream(std::istream& in) {
     if (!in) {
         throw std::runtime_error("stream is not readable");
@@ -599,11 +1255,46 @@ void Sequence::init_from_stream(std::istream& in) {
         throw std::runtime_error("failure to read header");
     }
 
-    // Check that it's a PPEF filetype and has version 1
-    if (std::strncmp(meta.magic, "PPEF", 4) != 0 || meta.version != 1) {
+    // Check that it's a PPEF filetype and has version 1 or 2
+    if (std::strncmp(meta.magic, "PPEF", 4) != 0 || (meta.version != 1 && meta.version != 2)) {
         throw std::runtime_error("invalid magic and/or version");
     }
 
+    if (meta.version == 2) {
+        // Unpack the block table into the separate arrays.
+        const uint64_t table_offset = round_up(sizeof(SequenceMetadata), V2_ALIGN);
+        // (Divided rather than multiplied, so a corrupt n_blocks can't overflow.)
+        if (static_cast<uint64_t>(sz) < table_offset
+            || meta.n_blocks > (static_cast<uint64_t>(sz) - table_offset) / sizeof(BlockEntry)) {
+            throw std::runtime_error("stream is too short for its block table");
+        }
+        std::vector<BlockEntry> table(meta.n_blocks);
+        in.seekg(static_cast<std::streamoff>(table_offset));
+        in.read(
+            reinterpret_cast<char*>(table.data()),
+            meta.n_blocks * sizeof(BlockEntry)
+        );
+        if (!in) {
+            throw std::runtime_error("failure to read block table");
+        }
+        block_last_.resize(meta.n_blocks);
+        block_offs_.resize(meta.n_blocks);
+        if (variable_blocks()) block_begin_.resize(meta.n_blocks);
+        for (uint64_t bi = 0; bi < meta.n_blocks; ++bi) {
+            block_last_[bi] = table[bi].last;
+            block_offs_[bi] = table[bi].offset;
+            if (variable_blocks()) block_begin_[bi] = table[bi].begin;
+        }
+        read_payload(in, static_cast<uint64_t>(sz), table_offset + meta.n_blocks * sizeof(BlockEntry));
+        check_block_index(meta, block_last_.data(), block_offs_.data(), block_begin_.data(), 1, payload_.size());
+        return;
+    }
+
+    const uint64_t index_arrays = variable_blocks() ? 3 : 2;
+    if (meta.n_blocks > (static_cast<uint64_t>(sz) - sizeof(SequenceMetadata)) / (index_arrays * sizeof(uint64_t))) {
+        throw std::runtime_error("stream is too short for its block index");
+    }
+
     // Special case: zero elements.
     if (meta.n_elem == 0) {
         block_last_.resize(0);
@@ -631,10 +1322,32 @@ void Sequence::init_from_stream(std::istream& in) {
         throw std::runtime_error("failure to read block_offs_ array");
     }
 
-    // Read all of the EFBlocks into memory (TODO: replace with mmap)
-    const size_t size_so_far = sizeof(SequenceMetadata)
-        + meta.n_blocks * sizeof(uint64_t) * 2;
-    const size_t bytes_to_read = static_cast<size_t>(sz) - size_so_far;
+    // For variable-length blocks, read the index of the first element
+    // of each EFBlock
+    if (variable_blocks()) {
+        block_begin_.resize(meta.n_blocks);
+        in.read(
+            reinterpret_cast<char*>(block_begin_.data()),
+            meta.n_blocks * sizeof(uint64_t)
+        );
+        if (!in) {
+            throw std::runtime_error("failure to read block_begin_ array");
+        }
+    }
+
+    read_payload(in, static_cast<uint64_t>(sz), sizeof(SequenceMetadata) + index_bytes());
+    check_block_index(meta, block_last_.data(), block_offs_.data(), block_begin_.data(), 1, payload_.size());
+}
+
+void Sequence::read_payload(std::istream& in, uint64_t sz, uint64_t index_end) {
+    // Read all of the EFBlocks into memory (see Sequence::mmap for a
+    // zero-copy alternative). The payload usually follows the block index
+    // directly, but streamed files can leave a gap in between.
+    if (meta.payload_offset < index_end || meta.payload_offset > sz) {
+        throw std::runtime_error("invalid payload_offset");
+    }
+    const size_t bytes_to_read = static_cast<size_t>(sz - meta.payload_offset);
+    in.seekg(static_cast<std::streamoff>(meta.payload_offset));
     payload_.resize(bytes_to_read);
     in.read(
         reinterpret_cast<char*>(payload_.data()),
@@ -655,77 +1368,397 @@ Sequence::Sequence(std::istream& in) {
     init_from_stream(in);
 }
 
-std::vector<uint64_t> Sequence::decode_block(uint64_t bi) const {
-    // Check for out-of-bounds
-    if (bi >= meta.n_blocks) {
-        std::ostringstream msg;
-        msg << "invalid block index " << bi << "; total blocks = " << meta.n_blocks;
-        throw std::runtime_error(msg.str());
+Sequence Sequence::from_buffer(
+    const void* data,
+    size_t size,
+    std::shared_ptr<const void> owner
+) {
+    const uint8_t* base = static_cast<const uint8_t*>(data);
+    if (size < sizeof(SequenceMetadata)) {
+        throw std::runtime_error("buffer is missing header");
     }
-    // Pointer to the start of this block in the raw file.
-    const uint8_t* base = payload_.data() + block_offs_.at(bi);
-    // Read the EFBlock header.
-    EFBlockMetadata block_meta {};
-    std::memcpy(&block_meta, base, sizeof(block_meta));
+    Sequence o;
+    std::memcpy(&o.meta, base, sizeof(o.meta));
 
-    // Pointer to the start of the low bit representation.
-    const uint64_t* loww = reinterpret_cast<const uint64_t*>(
-        base + sizeof(block_meta)
-    );
-    // Pointer to the start of the high bit representation.
-    const uint64_t* highw = loww + block_meta.low_words;
-    // Allocate enough space for all elements in this block.
-    std::vector<uint64_t> o(block_meta.n_elem);
-    // The low bits are written densely, so we can read them by simply striding
-    // across the byte array.
-    BitReader br(loww, (size_t)block_meta.low_words);
-    // Bit position of the previous element in the high bits.
-    // Set to UINT64_MAX for element 0, so we know
-    uint64_t prev_hi_pos = UINT64_MAX;
-    for (uint32_t i = 0; i < block_meta.n_elem; ++i) {
-        // Start looking for the next set bit, after the previous element's set bit.
-        uint64_t start = (prev_hi_pos == UINT64_MAX) ? 0ULL : (prev_hi_pos + 1ULL);
-        // Find the next set bit in *highw*. This is the bit position relative to
-        // the start of *highw*.
-        uint64_t pos = next_one_at_or_after(highw, (size_t)block_meta.high_words, start);
-        prev_hi_pos = pos;
-        // Since pos = (# of previous elements) + (value of current element-floor),
-        // this is the value of the current element (minus the floor).
-        uint64_t hi = pos - i;
-        // Number of bits per element in the low bit representation.
-        uint64_t lo = (block_meta.l ? br.get(block_meta.l) : 0ULL);
-        // Combine the low bits and high bits to get the original element's
-        // difference from the floor, and then add back the floor.
-        o[i] = block_meta.floor + ((hi << block_meta.l) | lo);
+    // Check that it's a PPEF filetype and has version 1 or 2
+    if (std::strncmp(o.meta.magic, "PPEF", 4) != 0 || (o.meta.version != 1 && o.meta.version != 2)) {
+        throw std::runtime_error("invalid magic and/or version");
+    }
+    const bool v2 = o.meta.version == 2;
+    const size_t table_offset = v2 ? round_up(sizeof(SequenceMetadata), V2_ALIGN) : sizeof(SequenceMetadata);
+    // Bytes per block in the index. Dividing rather than multiplying keeps
+    // a corrupt n_blocks from overflowing.
+    const size_t entry_bytes = v2 ? sizeof(BlockEntry)
+        : sizeof(uint64_t) * (o.variable_blocks() ? 3 : 2);
+    if (size < table_offset || o.meta.n_blocks > (size - table_offset) / entry_bytes) {
+        throw std::runtime_error("buffer is too short for its block index");
+    }
+    const size_t size_so_far = table_offset + static_cast<size_t>(o.meta.n_blocks) * entry_bytes;
+    if (o.meta.payload_offset < size_so_far || o.meta.payload_offset > size) {
+        throw std::runtime_error("invalid payload_offset");
+    }
+    const size_t payload_offset = static_cast<size_t>(o.meta.payload_offset);
+
+    // The block index and EFBlocks are read as arrays of uint64_t, so we
+    // can only point into buffers that are suitably aligned.
+    if (reinterpret_cast<uintptr_t>(base) % alignof(uint64_t) != 0 && v2) {
+        std::istringstream in(std::string(reinterpret_cast<const char*>(base), size));
+        o.init_from_stream(in);
+        return o;
+    }
+    if (reinterpret_cast<uintptr_t>(base) % alignof(uint64_t) != 0) {
+        o.block_last_.resize(o.meta.n_blocks);
+        o.block_offs_.resize(o.meta.n_blocks);
+        o.payload_.resize(size - payload_offset);
+        std::memcpy(
+            o.block_last_.data(),
+            base + sizeof(SequenceMetadata),
+            o.meta.n_blocks * sizeof(uint64_t)
+        );
+        std::memcpy(
+            o.block_offs_.data(),
+            base + sizeof(SequenceMetadata) + o.meta.n_blocks * sizeof(uint64_t),
+            o.meta.n_blocks * sizeof(uint64_t)
+        );
+        if (o.variable_blocks()) {
+            o.block_begin_.resize(o.meta.n_blocks);
+            std::memcpy(
+                o.block_begin_.data(),
+                base + sizeof(SequenceMetadata) + 2 * o.meta.n_blocks * sizeof(uint64_t),
+                o.meta.n_blocks * sizeof(uint64_t)
+            );
+        }
+        std::memcpy(o.payload_.data(), base + payload_offset, size - payload_offset);
+        check_block_index(
+            o.meta, o.block_last_.data(), o.block_offs_.data(), o.block_begin_.data(), 1, o.payload_.size()
+        );
+        return o;
     }
+
+    if (v2) {
+        // The fields of the BlockEntry table, in place.
+        const uint64_t* table = reinterpret_cast<const uint64_t*>(base + table_offset);
+        o.view_stride_ = sizeof(BlockEntry) / sizeof(uint64_t);
+        o.view_last_ = table + offsetof(BlockEntry, last) / sizeof(uint64_t);
+        o.view_offs_ = table + offsetof(BlockEntry, offset) / sizeof(uint64_t);
+        o.view_begin_ = table + offsetof(BlockEntry, begin) / sizeof(uint64_t);
+        o.view_floor_ = table + offsetof(BlockEntry, floor) / sizeof(uint64_t);
+    } else {
+        o.view_last_ = reinterpret_cast<const uint64_t*>(base + sizeof(SequenceMetadata));
+        o.view_offs_ = o.view_last_ + o.meta.n_blocks;
+        if (o.variable_blocks()) o.view_begin_ = o.view_offs_ + o.meta.n_blocks;
+    }
+    check_block_index(o.meta, o.view_last_, o.view_offs_, o.view_begin_, o.view_stride_, size - payload_offset);
+    // Without an owner, the caller is responsible for keeping *data* alive.
+    o.backing_ = owner ? std::move(owner) : std::shared_ptr<const void>(data, [](const void*) {});
+    o.view_payload_ = base + payload_offset;
+    o.view_payload_size_ = size - payload_offset;
+    o.view_buffer_ = data;
+    o.view_buffer_size_ = size;
     return o;
 }
 
-uint64_t Sequence::get(uint64_t i) const {
-    if (i >= meta.n_elem) {
-        throw std::runtime_error("Sequence::get: out-of-bounds");
-    }
-    const uint64_t block_idx = i / meta.block_size,
-                   block_pos = i % meta.block_size;
-    std::vector<uint64_t> values = decode_block(block_idx);
-    return values.at(block_pos);
+namespace {
+
+// Map the file at *path* read-only, setting *size* to its size. Empty
+// files aren't mapped, and give a null pointer.
+std::shared_ptr<const void> map_file(const std::string& path, size_t& size) {
+#if defined(_WIN32)
+    // No mmap here; read the whole file into a buffer.
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) throw std::runtime_error("failed to open file for reading");
+    size = static_cast<size_t>(in.tellg());
+    std::shared_ptr<std::vector<uint64_t>> buf = std::make_shared<std::vector<uint64_t>>(
+        ceil_div_u64(size, sizeof(uint64_t))
+    );
+    in.seekg(0);
+    in.read(reinterpret_cast<char*>(buf->data()), size);
+    if (!in) throw std::runtime_error("failed to read file");
+    return std::shared_ptr<const void>(buf, buf->data());
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("failed to open file for reading");
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("failed to stat file");
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+    void* addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the file descriptor is closed.
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        file_error("mmap", path, "failure to map file");
+    }
+    const size_t n = size;
+    return std::shared_ptr<const void>(
+        addr,
+        [n](const void* p) { ::munmap(const_cast<void*>(p), n); }
+    );
+#endif
 }
 
-uint64_t Sequence::operator[](uint64_t i) const {
-    if (i >= meta.n_elem) {
-        throw std::runtime_error("Sequence::get: out-of-bounds");
+// Throw if *out_path* names the same file as *path*. The file operations
+// truncate their output while the inputs are still mapped, so writing over an
+// input would corrupt it mid-read. (Without mmap, inputs are read into memory
+// and aliasing is harmless.)
+void check_not_input(const std::string& path, const std::string& out_path) {
+#if !defined(_WIN32)
+    struct stat in_st, out_st;
+    if (::stat(path.c_str(), &in_st) == 0
+        && ::stat(out_path.c_str(), &out_st) == 0
+        && in_st.st_dev == out_st.st_dev
+        && in_st.st_ino == out_st.st_ino) {
+        throw std::runtime_error(
+            "output file " + out_path + " is also an input"
+        );
     }
-    const uint64_t block_idx = i / meta.block_size,
-                   block_pos = i % meta.block_size;
-    std::vector<uint64_t> values = decode_block(block_idx);
-    return values.at(block_pos);
+#else
+    (void)path;
+    (void)out_path;
+#endif
 }
 
-EFBlock Sequence::get_efblock(uint64_t bi) const {
+} // end anonymous namespace
+
+Sequence Sequence::mmap(const std::string& path) {
+    size_t size = 0;
+    std::shared_ptr<const void> mapping = map_file(path, size);
+    if (size < sizeof(SequenceMetadata)) {
+        throw std::runtime_error("stream is missing header");
+    }
+    return from_buffer(mapping.get(), size, mapping);
+}
+
+bool Sequence::is_view() const {
+    return static_cast<bool>(backing_);
+}
+
+std::shared_ptr<const void> Sequence::view_buffer(size_t& size) const {
+    size = view_buffer_size_;
+    if (!backing_) return nullptr;
+    return std::shared_ptr<const void>(backing_, view_buffer_);
+}
+
+std::vector<uint64_t> Sequence::decode_slice(uint64_t i, uint64_t j) const {
+    std::vector<uint64_t> o(j > i ? j - i : 0);
+    decode_slice_into(i, j, o.data(), o.size());
+    return o;
+}
+
+size_t Sequence::decode_slice_into(uint64_t i, uint64_t j, uint64_t* out, size_t cap) const {
+    if (i > j || j > meta.n_elem) {
+        throw std::runtime_error("Sequence::decode_slice_into: out-of-bounds");
+    }
+    if (cap < j - i) {
+        throw std::runtime_error("Sequence::decode_slice_into: output buffer too small");
+    }
+    if (i == j) return 0;
+    // Interior blocks are decoded straight into *out*; the boundary blocks
+    // go through *buf* first.
+    std::vector<uint64_t> buf;
+    size_t n = 0;
+    for (uint64_t bi = block_of(i); bi <= block_of(j - 1); ++bi) {
+        const uint64_t begin = block_begin(bi),
+                       end = begin + block_n_elem(bi),
+                       lo = std::max(i, begin),
+                       hi = std::min(j, end);
+        if (lo == begin && hi == end) {
+            n += decode_block_into(bi, out + n, cap - n);
+        } else {
+            buf.resize(end - begin);
+            decode_block_into(bi, buf.data(), buf.size());
+            std::copy(buf.begin() + (lo - begin), buf.begin() + (hi - begin), out + n);
+            n += hi - lo;
+        }
+    }
+    return n;
+}
+
+std::vector<uint64_t> Sequence::decode_range(uint64_t lo, uint64_t hi) const {
+    if (hi <= lo) return std::vector<uint64_t>();
+    return decode_slice(lower_bound(lo), lower_bound(hi));
+}
+
+Sequence Sequence::slice(uint64_t i, uint64_t j) const {
+    if (i > j || j > meta.n_elem) {
+        throw std::runtime_error("Sequence::slice: out-of-bounds");
+    }
+    Sequence o(meta.block_size);
+    if (i == j) return o;
+    const uint64_t first = block_of(i), last = block_of(j - 1);
+    // A fixed-size Sequence cut on a block boundary keeps fixed-size blocks:
+    // every block but the last is full.
+    if (variable_blocks() || block_begin(first) != i) {
+        o.meta.reserved |= SEQUENCE_VARIABLE_BLOCKS;
+    }
+    uint64_t cursor = 0;
+    std::vector<uint64_t> buf, values;
+    for (uint64_t bi = first; bi <= last; ++bi) {
+        const uint64_t begin = block_begin(bi),
+                       end = begin + block_n_elem(bi),
+                       lo = std::max(i, begin),
+                       hi = std::min(j, end);
+        if (lo == begin && hi == end) {
+            o._copy_block(*this, bi, cursor);
+            continue;
+        }
+        buf.resize(end - begin);
+        decode_block_into(bi, buf.data(), buf.size());
+        values.assign(buf.begin() + (lo - begin), buf.begin() + (hi - begin));
+        o.meta.n_elem += values.size();
+        o._flush_block(values, cursor);
+    }
+    o._finish(values, cursor);
+    return o;
+}
+
+Sequence Sequence::range(uint64_t lo, uint64_t hi) const {
+    if (hi <= lo) return Sequence(meta.block_size);
+    return slice(lower_bound(lo), lower_bound(hi));
+}
+
+std::vector<uint64_t> Sequence::decode_block(uint64_t bi) const {
+    if (cache_ && bi < meta.n_blocks) return *cached_block(bi);
+    std::vector<uint64_t> o(block_n_elem(bi));
+    decode_block_into(bi, o.data(), o.size());
+    return o;
+}
+
+size_t Sequence::decode_block_into(uint64_t bi, uint64_t* out, size_t cap) const {
+    // Check for out-of-bounds
+    if (bi >= meta.n_blocks) {
+        std::ostringstream msg;
+        msg << "invalid block index " << bi << "; total blocks = " << meta.n_blocks;
+        throw std::runtime_error(msg.str());
+    }
+    // View the EFBlock in place, and decode it straight into the output.
+    const EFBlockView blk(block_data(bi));
+    if (cap < blk.meta.n_elem) {
+        throw std::runtime_error("Sequence::decode_block_into: output buffer too small");
+    }
+    if (cache_) {
+        const BlockCache::Block values = cached_block(bi);
+        std::copy(values->begin(), values->end(), out);
+    } else {
+        blk.decode(out);
+    }
+    return blk.meta.n_elem;
+}
+
+BlockCache::Block Sequence::cached_block(uint64_t bi) const {
+    BlockCache::Block values = cache_->find(bi);
+    if (values) return values;
+    std::vector<uint64_t> decoded(block_n_elem(bi));
+    EFBlockView(block_data(bi)).decode(decoded.data());
+    return cache_->insert(bi, std::move(decoded));
+}
+
+void Sequence::enable_cache(size_t capacity_bytes, unsigned n_shards) {
+    cache_ = std::make_shared<BlockCache>(capacity_bytes, n_shards);
+}
+
+void Sequence::disable_cache() {
+    cache_.reset();
+}
+
+BlockCacheStats Sequence::cache_stats() const {
+    return cache_ ? cache_->stats() : BlockCacheStats();
+}
+
+BlockCache::BlockCache(size_t capacity_bytes, unsigned n_shards):
+    capacity_bytes_(capacity_bytes),
+    shard_capacity_(capacity_bytes / std::max(1u, n_shards)),
+    hits_(0),
+    misses_(0)
+{
+    for (unsigned k = 0; k < std::max(1u, n_shards); ++k) {
+        shards_.emplace_back(new Shard());
+    }
+}
+
+BlockCache::Block BlockCache::find(uint64_t bi) {
+    Shard& shard = shard_of(bi);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.index.find(bi);
+    if (it == shard.index.end()) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return Block();
+    }
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+BlockCache::Block BlockCache::insert(uint64_t bi, std::vector<uint64_t> values) {
+    const size_t size = values.size() * sizeof(uint64_t);
+    Block block = std::make_shared<const std::vector<uint64_t> >(std::move(values));
+    if (size > shard_capacity_) return block;
+    Shard& shard = shard_of(bi);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Another thread may have decoded the same block in the meantime.
+    auto it = shard.index.find(bi);
+    if (it != shard.index.end()) {
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        return it->second->second;
+    }
+    shard.lru.emplace_front(bi, block);
+    shard.index[bi] = shard.lru.begin();
+    shard.bytes += size;
+    while (shard.bytes > shard_capacity_) {
+        const auto& oldest = shard.lru.back();
+        shard.bytes -= oldest.second->size() * sizeof(uint64_t);
+        shard.index.erase(oldest.first);
+        shard.lru.pop_back();
+    }
+    return block;
+}
+
+void BlockCache::clear() {
+    for (auto& shard: shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        shard->lru.clear();
+        shard->index.clear();
+        shard->bytes = 0;
+    }
+}
+
+BlockCacheStats BlockCache::stats() const {
+    BlockCacheStats o;
+    o.hits = hits_.load(std::memory_order_relaxed);
+    o.misses = misses_.load(std::memory_order_relaxed);
+    o.capacity_bytes = capacity_bytes_;
+    for (const auto& shard: shards_) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        o.bytes += shard->bytes;
+    }
+    return o;
+}
+
+uint64_t Sequence::get(uint64_t i) const {
+    PEF_COUNT(get_calls, 1);
+    if (i >= meta.n_elem) {
+        throw std::runtime_error("Sequence::get: out-of-bounds");
+    }
+    const uint64_t block_idx = block_of(i),
+                   block_pos = i - block_begin(block_idx);
+    if (cache_) return (*cached_block(block_idx))[block_pos];
+    return EFBlockView(block_data(block_idx)).get((uint32_t)block_pos);
+}
+
+uint64_t Sequence::operator[](uint64_t i) const {
+    return get(i);
+}
+
+EFBlock Sequence::get_efblock(uint64_t bi) const {
     if (bi >= meta.n_blocks) {
         throw std::runtime_error("Sequence::get_efblock: out-of-bounds");
     }
-    const uint8_t* base = payload_.data() + block_offs_.at(bi);
+    const uint8_t* base = block_data(bi);
     EFBlockMetadata meta;
     std::memcpy(&meta, base, sizeof(meta));
     const uint64_t* loww = reinterpret_cast<const uint64_t*>(base+sizeof(meta));
@@ -741,18 +1774,260 @@ EFBlock Sequence::get_efblock(uint64_t bi) const {
 }
 
 bool Sequence::contains(uint64_t q) const {
-    if (meta.n_elem == 0) {
+    PEF_COUNT(contains_calls, 1);
+    // Rule out q > max first, so that a UINT64_MAX from next_geq is real.
+    if (meta.n_elem == 0 || block_last(meta.n_blocks - 1) < q) {
         return false;
     }
-    else if (block_last_.back() < q) {
-        return false;
+    return next_geq(q) == q;
+}
+
+uint64_t Sequence::lower_bound(uint64_t q) const {
+    if (meta.n_elem == 0 || block_last(meta.n_blocks - 1) < q) {
+        return meta.n_elem;
     }
     // binary search to identify the EFBlock that would contain this element
-    size_t block_idx = supremum_index(block_last_, q);
-    // decompress this block
-    std::vector<uint64_t> values = decode_block(block_idx);
-    // binary search to identify the element within this block
-    return std::binary_search(values.begin(), values.end(), q);
+    const size_t block_idx = find_block(q);
+    if (view_floor_ && q <= view_floor_[block_idx * view_stride_]) {
+        return block_begin(block_idx);
+    }
+    if (cache_) {
+        const BlockCache::Block values = cached_block(block_idx);
+        return block_begin(block_idx)
+            + (std::lower_bound(values->begin(), values->end(), q) - values->begin());
+    }
+    // then jump to its bucket within the block
+    const uint64_t i = EFBlockView(block_data(block_idx)).lower_bound(q);
+    return block_begin(block_idx) + i;
+}
+
+template <class BlockFor, class Answer>
+void Sequence::batch_by_block(
+    const uint64_t* keys,
+    size_t n,
+    unsigned n_threads,
+    BlockFor block_for,
+    Answer answer
+) const {
+    // Visit the queries in sorted order of their keys, so that queries in
+    // the same block are adjacent. If they're already sorted, we don't need
+    // the permutation.
+    std::vector<size_t> order;
+    if (!std::is_sorted(keys, keys + n)) {
+        order.resize(n);
+        for (size_t q = 0; q < n; ++q) order[q] = q;
+        std::sort(order.begin(), order.end(), [keys](size_t a, size_t b) {
+            return keys[a] < keys[b];
+        });
+    }
+    auto run = [&](size_t first, size_t last) {
+        std::vector<uint64_t> values(meta.block_size);
+        uint64_t current = UINT64_MAX; // block decoded into *values*
+        size_t n_values = 0;
+        for (size_t k = first; k < last; ++k) {
+            const size_t q = order.empty() ? k : order[k];
+            const uint64_t bi = block_for(keys[q]);
+            if (bi >= meta.n_blocks) {
+                answer(q, bi, (const uint64_t*)nullptr, (size_t)0);
+                continue;
+            }
+            if (bi != current) {
+                n_values = decode_block_into(bi, values.data(), values.size());
+                current = bi;
+            }
+            answer(q, bi, (const uint64_t*)values.data(), n_values);
+        }
+    };
+    const size_t n_workers = std::max<size_t>(1, std::min<size_t>(n_threads, n / 1024 + 1));
+    if (n_workers == 1) {
+        run(0, n);
+        return;
+    }
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < n_workers; ++t) {
+        workers.emplace_back(run, n * t / n_workers, n * (t + 1) / n_workers);
+    }
+    for (auto& w: workers) w.join();
+}
+
+void Sequence::get_many(
+    const uint64_t* indices,
+    size_t n,
+    uint64_t* out,
+    unsigned n_threads
+) const {
+    for (size_t q = 0; q < n; ++q) {
+        if (indices[q] >= meta.n_elem) {
+            throw std::runtime_error("Sequence::get_many: out-of-bounds");
+        }
+    }
+    batch_by_block(
+        indices, n, n_threads,
+        [this](uint64_t i) { return block_of(i); },
+        [&](size_t q, uint64_t bi, const uint64_t* values, size_t) {
+            out[q] = values[indices[q] - block_begin(bi)];
+        }
+    );
+}
+
+void Sequence::contains_many(
+    const uint64_t* values,
+    size_t n,
+    bool* out,
+    unsigned n_threads
+) const {
+    const uint64_t last = meta.n_elem ? block_last(meta.n_blocks - 1) : 0;
+    batch_by_block(
+        values, n, n_threads,
+        [&](uint64_t v) -> uint64_t {
+            if (meta.n_elem == 0 || v > last) return meta.n_blocks;
+            return find_block(v);
+        },
+        [&](size_t q, uint64_t, const uint64_t* block, size_t n_block) {
+            out[q] = block && std::binary_search(block, block + n_block, values[q]);
+        }
+    );
+}
+
+void Sequence::rank_many(
+    const uint64_t* values,
+    size_t n,
+    uint64_t* out,
+    unsigned n_threads
+) const {
+    const uint64_t last = meta.n_elem ? block_last(meta.n_blocks - 1) : 0;
+    batch_by_block(
+        values, n, n_threads,
+        [&](uint64_t v) -> uint64_t {
+            if (meta.n_elem == 0 || v > last) return meta.n_blocks;
+            return find_block(v);
+        },
+        [&](size_t q, uint64_t bi, const uint64_t* block, size_t n_block) {
+            if (!block) {
+                out[q] = meta.n_elem;
+                return;
+            }
+            out[q] = block_begin(bi)
+                + (std::lower_bound(block, block + n_block, values[q]) - block);
+        }
+    );
+}
+
+uint64_t Sequence::next_geq(uint64_t q) const {
+    if (meta.n_elem == 0 || block_last(meta.n_blocks - 1) < q) {
+        return UINT64_MAX;
+    }
+    const size_t block_idx = find_block(q);
+    // If q is at or below the block's floor, the floor is the answer; with
+    // a version 2 block table we know that without reading the block.
+    if (view_floor_) {
+        const uint64_t floor = view_floor_[block_idx * view_stride_];
+        if (q <= floor) return floor;
+    }
+    // Since block_last(block_idx) >= q, this always finds an element.
+    if (cache_) {
+        const BlockCache::Block values = cached_block(block_idx);
+        return *std::lower_bound(values->begin(), values->end(), q);
+    }
+    uint64_t value = UINT64_MAX;
+    EFBlockView(block_data(block_idx)).lower_bound(q, value);
+    return value;
+}
+
+BlockSkipIndex::BlockSkipIndex(const uint64_t* block_last, uint64_t n_blocks, size_t stride) {
+    const uint64_t n = ceil_div_u64(n_blocks, SKIP_SAMPLE);
+    keys.resize(n + 1);
+    rank.resize(n + 1);
+    // Fill the tree in order, so that an in-order walk visits the groups
+    // in sorted order: node k has children 2k and 2k + 1.
+    uint64_t g = 0;
+    std::vector<uint64_t> stack;
+    for (uint64_t k = 1; k <= n || !stack.empty(); ) {
+        if (k <= n) {
+            stack.push_back(k);
+            k = 2 * k;
+            continue;
+        }
+        k = stack.back();
+        stack.pop_back();
+        keys[k] = block_last[(std::min(g * SKIP_SAMPLE + SKIP_SAMPLE, n_blocks) - 1) * stride];
+        rank[k] = g++;
+        k = 2 * k + 1;
+    }
+}
+
+uint64_t BlockSkipIndex::lower_bound(uint64_t q) const {
+    const uint64_t n = n_groups();
+    uint64_t k = 1;
+    while (k <= n) {
+#if defined(__GNUC__)
+        // The node four levels down, whose 16 descendants share a line.
+        __builtin_prefetch(keys.data() + std::min<uint64_t>(16 * k, n));
+#endif
+        k = 2 * k + (keys[k] < q);
+    }
+    // Undo the right turns after the last left turn: that node is the
+    // first key >= q (k = 0 if we never went left).
+    k >>= ctz64(~k) + 1;
+    return k == 0 ? n : rank[k];
+}
+
+uint64_t Sequence::find_block(uint64_t q) const {
+    const uint64_t* last = block_last_data();
+    const size_t stride = index_stride();
+    if (meta.n_blocks < SKIP_MIN_BLOCKS) {
+        return strided_lower_bound(last, stride, meta.n_blocks, q);
+    }
+    const BlockSkipIndex* skip = skip_.load(std::memory_order_acquire);
+    if (!skip) {
+        // Threads that race to build the index agree on its contents,
+        // so whoever loses just drops theirs.
+        std::unique_ptr<const BlockSkipIndex> built(new BlockSkipIndex(last, meta.n_blocks, stride));
+        const BlockSkipIndex* expected = nullptr;
+        if (skip_.compare_exchange_strong(expected, built.get(), std::memory_order_acq_rel)) {
+            skip = built.release();
+        } else {
+            skip = expected;
+        }
+    }
+    // Then binary search within the group.
+    const uint64_t first = skip->lower_bound(q) * SKIP_SAMPLE;
+    return first + strided_lower_bound(
+        last + first * stride, stride, std::min(SKIP_SAMPLE, meta.n_blocks - first), q
+    );
+}
+
+uint64_t Sequence::rank(uint64_t q) const {
+    return lower_bound(q);
+}
+
+uint64_t Sequence::prev_leq(uint64_t q) const {
+    if (meta.n_elem == 0) {
+        return UINT64_MAX;
+    }
+    const uint64_t last = block_last(meta.n_blocks - 1);
+    if (last <= q) {
+        return last;
+    }
+    // The first block with an element >= q holds the answer, unless q
+    // comes before all of its elements: then it's the previous block's last.
+    const size_t block_idx = find_block(q);
+    uint64_t value = UINT64_MAX;
+    uint64_t i = 0;
+    if (cache_) {
+        const BlockCache::Block values = cached_block(block_idx);
+        const auto it = std::lower_bound(values->begin(), values->end(), q);
+        value = *it;
+        i = it - values->begin();
+        if (value == q) return q;
+        if (i > 0) return values->at(i - 1);
+    } else {
+        const EFBlockView blk(block_data(block_idx));
+        i = blk.lower_bound(q, value);
+        if (value == q) return q;
+        if (i > 0) return blk.get(static_cast<uint32_t>(i - 1));
+    }
+    return block_idx > 0 ? block_last(block_idx - 1) : UINT64_MAX;
 }
 
 SequenceMetadata Sequence::get_meta() const {
@@ -765,22 +2040,52 @@ void Sequence::info() const {
     std::cout << "n_elem = " << meta.n_elem << "\n";
     std::cout << "block_size = " << meta.block_size << "\n";
     std::cout << "n_blocks = " << meta.n_blocks << "\n";
+    std::cout << "variable_blocks = " << variable_blocks() << "\n";
     std::cout << "payload_offset = " << meta.payload_offset << "\n";
 
     // Compute compression ratio
     const float compression_ratio = 1.f
-        - static_cast<float>(40 + 2*8*meta.n_blocks + payload_.size())
+        - static_cast<float>(40 + index_bytes() + payload_size())
         / (meta.n_elem * 8);
     std::cout << "compression factor = " << compression_ratio << std::endl;
 }
 
 std::vector<uint64_t> Sequence::decode() const {
-    std::vector<uint64_t> o;
+    std::vector<uint64_t> o(meta.n_elem);
+    decode_into(o.data(), o.size());
+    return o;
+}
+
+size_t Sequence::decode_into(uint64_t* out, size_t cap) const {
+    if (cap < meta.n_elem) {
+        throw std::runtime_error("Sequence::decode_into: output buffer too small");
+    }
+    size_t n = 0;
     for (uint64_t bi = 0; bi < meta.n_blocks; ++bi) {
-        std::vector<uint64_t> block = decode_block(bi);
-        o.insert(o.end(), block.begin(), block.end());
+        const EFBlockView blk(block_data(bi));
+        blk.decode(out + n);
+        n += blk.meta.n_elem;
     }
-    return o;
+    return n;
+}
+
+void Sequence::_copy_block(const Sequence& src, uint64_t bi, uint64_t& cursor) {
+    const size_t nbytes = src.block_bytes(bi);
+    PEF_COUNT(blocks_copied, 1);
+    if (variable_blocks()) block_begin_.push_back(meta.n_elem);
+    block_offs_.push_back(cursor);
+    append_bytes(src.block_data(bi), nbytes);
+    cursor += nbytes;
+    block_last_.push_back(src.block_last(bi));
+    meta.n_elem += src.block_n_elem(bi);
+    ++meta.n_blocks;
+}
+
+void Sequence::_reserve(uint64_t n_elem, size_t payload_bytes) {
+    const uint64_t n_blocks = ceil_div_u64(n_elem, meta.block_size);
+    block_last_.reserve(n_blocks);
+    block_offs_.reserve(n_blocks);
+    payload_.reserve(payload_bytes);
 }
 
 // Utility used in several of the functions below.
@@ -788,312 +2093,728 @@ void Sequence::_flush_block(
     std::vector<uint64_t>& values,
     uint64_t& cursor
 ) {
-    EFBlock blk(values.data(), values.size());
+    // The size of the block is known up front, so we encode it straight
+    // into the end of the payload.
+    const size_t nbytes = EFBlock::encoded_size(values.data(), values.size());
+    if (variable_blocks()) block_begin_.push_back(meta.n_elem - values.size());
     block_offs_.push_back(cursor);
-    // Write the BlockHeader.
-    append_bytes(&blk.meta, sizeof(blk.meta));
-    cursor += sizeof(blk.meta);
-    // Write the low bit representation (u64)
-    if (!blk.low.empty()) {
-        append_bytes(blk.low.data(), blk.low.size() * sizeof(uint64_t));
-        cursor += blk.low.size() * sizeof(uint64_t);
-    }
-    // Write the high bit representation (u64)
-    if (!blk.high.empty()) {
-        append_bytes(blk.high.data(), blk.high.size() * sizeof(uint64_t));
-        cursor += blk.high.size() * sizeof(uint64_t);
-    }
+    payload_.resize(payload_.size() + nbytes);
+    EFBlock::encode_into(values.data(), values.size(), payload_.data() + payload_.size() - nbytes);
+    cursor += nbytes;
     // Update indices
     block_last_.push_back(values.back());
     ++meta.n_blocks;
     values.clear();
 }
 
-Sequence Sequence::filter_by_count(
-    const int min_count,
-    const int max_count,
-    const bool write_multiset
-) const {
-    Sequence o(meta.block_size);
-    if (meta.n_elem == 0) return o;
-    std::vector<uint64_t> ovalues;
-    uint64_t last = UINT64_MAX;
-    int count = 0;
-    uint64_t cursor = 0; // byte offset
-    for (uint64_t block_idx = 0; block_idx < meta.n_blocks; ++block_idx) {
-        std::vector<uint64_t> values = decode_block(block_idx);
-        for (const auto& v: values) {
-            if (v == last) {
-                ++count;
-                continue;
-            }
-            if (count >= min_count && count <= max_count && last != UINT64_MAX) {
-                if (write_multiset) {
-                    for (int i = 0; i < count; ++i) {
-                        ovalues.push_back(last);
-                        ++o.meta.n_elem;
-                        if (ovalues.size() == meta.block_size) o._flush_block(ovalues, cursor);
-                    }
-                } else {
-                    ovalues.push_back(last);
-                    ++o.meta.n_elem;
-                    if (ovalues.size() == meta.block_size) o._flush_block(ovalues, cursor);
-                }
-            }
-            last = v;
-            count = 1;
-        }
+bool Sequence::_splice_block(
+    const Sequence& src,
+    uint64_t bi,
+    std::vector<uint64_t>& values,
+    uint64_t& cursor,
+    bool allow_short
+) {
+    const uint64_t n = src.block_n_elem(bi);
+    if (n > meta.block_size
+            || (!allow_short && !values.empty() && values.size() < meta.block_size / 4)) {
+        return false;
     }
-
-    // Flush last value
-    if (count >= min_count && count <= max_count) {
-        if (write_multiset) {
-            for (int i = 0; i < count; ++i) {
-                ovalues.push_back(last);
-                ++o.meta.n_elem;
-                if (ovalues.size() == meta.block_size) o._flush_block(ovalues, cursor);
-            }
-        } else {
-            ovalues.push_back(last);
-            ++o.meta.n_elem;
-            if (ovalues.size() == meta.block_size) o._flush_block(ovalues, cursor);
-        }
+    if (!variable_blocks() && !(values.empty() && n == meta.block_size)) {
+        // Every block so far is full.
+        block_begin_.resize(meta.n_blocks);
+        for (uint64_t k = 0; k < meta.n_blocks; ++k) block_begin_[k] = k * meta.block_size;
+        meta.reserved |= SEQUENCE_VARIABLE_BLOCKS;
     }
-
-    // Flush last block if necessary
-    if (ovalues.size() > 0) o._flush_block(ovalues, cursor);
-
-    // Update payload offset for output files.
-    o.meta.payload_offset = sizeof(SequenceMetadata) + o.meta.n_blocks * sizeof(uint64_t) * 2;
-
-    return o;
+    if (!values.empty()) _flush_block(values, cursor);
+    _copy_block(src, bi, cursor);
+    return true;
 }
 
-Sequence Sequence::unique() const {
-    Sequence o(meta.block_size);
-    if (meta.n_elem == 0) return o;
-    std::vector<uint64_t> ovalues;
-    uint64_t last = UINT64_MAX;
-    uint64_t cursor = 0; // byte offset
-    for (uint64_t block_idx = 0; block_idx < meta.n_blocks; ++block_idx) {
-        std::vector<uint64_t> values = decode_block(block_idx);
-        for (const auto& v: values) {
-            if (v == last) continue;
-            ovalues.push_back(v);
-            ++o.meta.n_elem;
-            last = v;
-            // flush
-            if (ovalues.size() == meta.block_size) {
-                o._flush_block(ovalues, cursor);
-            }
-        }
-    }
-
-    // Flush last block if necessary.
-    if (ovalues.size() > 0) {
-        o._flush_block(ovalues, cursor);
-    }
+void Sequence::_finish(
+    std::vector<uint64_t>& values,
+    uint64_t& cursor
+) {
+    // Flush the last block, if necessary
+    if (values.size() > 0) _flush_block(values, cursor);
 
     // Update payload offset for output files.
-    o.meta.payload_offset = sizeof(SequenceMetadata) + o.meta.n_blocks * sizeof(uint64_t) * 2;
-
-    return o;
+    meta.payload_offset = sizeof(SequenceMetadata) + index_bytes();
 }
 
-Sequence Sequence::intersect(const Sequence& other) const {
-    const uint64_t block_size_0 = static_cast<uint64_t>(meta.block_size),
-                   block_size_1 = static_cast<uint64_t>(other.block_size());
-    Sequence o(block_size_0);
-    if (meta.n_elem == 0 || other.meta.n_elem == 0) {
-        return o;
-    }
+void Sequence::_encode_segments(
+    const std::vector<std::pair<const uint64_t*, size_t> >& segments,
+    unsigned n_threads
+) {
+    const uint64_t block_size = meta.block_size;
+    // starts[s] is the index of the first value of segment *s* in the
+    // concatenation, and starts.back() the total number of values.
+    std::vector<uint64_t> starts(1, 0);
+    for (const auto& seg: segments) starts.push_back(starts.back() + seg.second);
+    const uint64_t n_elem = starts.back(),
+                   n_blocks = variable_blocks() ? block_begin_.size()
+                       : (uint64_t)ceil_div_u64(n_elem, block_size);
+    block_last_.resize(n_blocks);
+    block_offs_.resize(n_blocks);
 
-    // Values in the current block to be compressed; flush at block_size_0
-    std::vector<uint64_t> new_values;
+    // Index of the first element of block *bi*, and the number of elements
+    // in it (<= block_size; the last block can be shorter).
+    auto block_first = [&](uint64_t bi) {
+        return variable_blocks() ? block_begin_[bi] : bi * block_size;
+    };
+    auto block_n = [&](uint64_t bi) {
+        return (uint32_t)((bi + 1 < n_blocks ? block_first(bi + 1) : n_elem) - block_first(bi));
+    };
 
-    // Global index from 0 to n_elem
-    uint64_t idx_0 = 0,
-             idx_1 = 0,
-    // Corresponding values
-             val_0,
-             val_1,
-    // Index within the current block
-             idx_in_block_0 = 0,
-             idx_in_block_1 = 0,
-    // Current block indices
-             block_idx_0 = 0, 
-             block_idx_1 = 0,
-    // Byte offset within encoded payload
-             cursor = 0;
-
-    // Current values within each block
-    std::vector<uint64_t> values_0 = decode_block(block_idx_0),
-                          values_1 = other.decode_block(block_idx_1);
-
-    while (idx_0 < meta.n_elem && idx_1 < other.meta.n_elem) {
-        // Decode the next block(s) if necessary
-        if (idx_in_block_0 == block_size_0) {
-            ++block_idx_0;
-            idx_in_block_0 = 0;
-            // skip forward to the next relevant block, if we can
-            while (block_idx_0 < meta.n_blocks && block_last_.at(block_idx_0) < val_1) {
-                idx_0 += block_size_0;
-                block_idx_0 += 1;
-            }
-            values_0 = decode_block(block_idx_0);
+    // Values of block *bi*: either a pointer into the one segment that
+    // holds them all, or a copy gathered into *scratch*.
+    auto block_values = [&](uint64_t bi, std::vector<uint64_t>& scratch) {
+        const uint64_t begin = block_first(bi),
+                       end = begin + block_n(bi);
+        // the (nonempty) segment that holds *begin*
+        size_t s = (size_t)(std::upper_bound(starts.begin(), starts.end(), begin)
+            - starts.begin()) - 1;
+        if (end <= starts[s + 1]) {
+            return segments[s].first + (begin - starts[s]);
         }
-        if (idx_in_block_1 == block_size_1) {
-            ++block_idx_1;
-            idx_in_block_1 = 0;
-            // skip forward to the next relevant block, if we can
-            while (block_idx_1 < other.meta.n_blocks && other.block_last_.at(block_idx_1) < val_0) {
-                idx_1 += block_size_1;
-                block_idx_1 += 1;
-            }
-            values_1 = other.decode_block(block_idx_1);
+        scratch.clear();
+        for (uint64_t i = begin; i < end; ++s) {
+            const uint64_t stop = std::min(end, starts[s + 1]);
+            scratch.insert(
+                scratch.end(),
+                segments[s].first + (i - starts[s]),
+                segments[s].first + (stop - starts[s])
+            );
+            i = stop;
         }
+        return (const uint64_t*)scratch.data();
+    };
 
-        // Get the values to compare
-        val_0 = values_0.at(idx_in_block_0);
-        val_1 = values_1.at(idx_in_block_1);
-
-        // Actually do the intersection and increment indices
-        if (val_0 == val_1) {
-            new_values.push_back(val_0);
-            ++o.meta.n_elem;
-            if (new_values.size() == block_size_0) {
-                o._flush_block(new_values, cursor);
-            }
-            ++idx_0;
-            ++idx_in_block_0;
-            ++idx_1;
-            ++idx_in_block_1;
-        } else if (val_0 < val_1) {
-            ++idx_0;
-            ++idx_in_block_0;
-        } else {
-            ++idx_1;
-            ++idx_in_block_1;
+    // First pass: the size of every block is known without encoding it,
+    // so we can lay out the whole payload up front. We require that all
+    // blocks have 8-byte alignment here for performance resaons, so there
+    // can be unused space in each EFBlock.
+    std::vector<uint64_t> scratch;
+    size_t cursor = 0; // payload size so far (bytes)
+    for (uint64_t bi = 0; bi < n_blocks; ++bi) {
+        const uint64_t* p = block_values(bi, scratch);
+        const uint32_t n = block_n(bi);
+        // Record the byte offset of this block in the file.
+        block_offs_[bi] = cursor;
+        // Record the value of the highest element in this block.
+        block_last_[bi] = p[n - 1];
+        cursor += EFBlock::encoded_size(p, n);
+    }
+    payload_.resize(cursor);
+
+    // Second pass: encode each block into its slot. Blocks don't depend
+    // on each other, so ranges of blocks can go to separate threads.
+    auto encode_blocks = [&](uint64_t first, uint64_t last) {
+        std::vector<uint64_t> scratch;
+        for (uint64_t bi = first; bi < last; ++bi) {
+            EFBlock::encode_into(
+                block_values(bi, scratch), block_n(bi), payload_.data() + block_offs_[bi]
+            );
+        }
+    };
+    const uint64_t n_workers = std::max<uint64_t>(1, std::min<uint64_t>(n_threads, n_blocks));
+    if (n_workers == 1) {
+        encode_blocks(0, n_blocks);
+    } else {
+        std::vector<std::thread> workers;
+        for (uint64_t t = 0; t < n_workers; ++t) {
+            workers.emplace_back(
+                encode_blocks,
+                n_blocks * t / n_workers,
+                n_blocks * (t + 1) / n_workers
+            );
         }
+        for (auto& w: workers) w.join();
     }
 
-    // Flush the last block, if necessary
-    if (new_values.size() > 0) {
-        o._flush_block(new_values, cursor);
+    meta.n_elem = n_elem;
+    meta.n_blocks = n_blocks;
+    meta.payload_offset = sizeof(SequenceMetadata) + index_bytes();
+}
+
+Sequence::Cursor::Cursor(const Sequence& seq):
+    seq_(&seq),
+    generation_(seq.generation_),
+    end_(seq.meta.n_elem)
+{
+    if (seq.meta.n_elem > 0) load_block(0);
+}
+
+Sequence::Cursor::Cursor(const Sequence& seq, uint64_t begin, uint64_t end):
+    seq_(&seq),
+    generation_(seq.generation_),
+    end_(std::min(end, seq.meta.n_elem))
+{
+    if (begin >= end_) {
+        index_ = end_;
+        return;
+    }
+    const uint64_t bi = seq.block_of(begin);
+    index_ = seq.block_begin(bi);
+    load_block(bi);
+    if (begin > index_) seek_in_block((uint32_t)(begin - index_));
+}
+
+void Sequence::Cursor::check_valid() const {
+    if (generation_ != seq_->generation_) {
+        throw std::runtime_error("Sequence::Cursor: the Sequence was modified since the Cursor was made");
     }
+}
 
-    // Update payload offset for output files.
-    o.meta.payload_offset = sizeof(SequenceMetadata) + o.meta.n_blocks * sizeof(uint64_t) * 2;
+void Sequence::Cursor::load_block(uint64_t bi) {
+    check_valid();
+    block_idx_ = bi;
+    blk_ = EFBlockView(seq_->block_data(bi));
+    // Counted up front, though a skip_to may leave the block before the
+    // Cursor has read all of it.
+    PEF_COUNT(blocks_decoded, 1);
+    PEF_COUNT(elements_decoded, blk_.meta.n_elem);
+    in_block_ = 0;
+    low_ = BitReader(blk_.low, (size_t)blk_.meta.low_words);
+    high_idx_ = 0;
+    high_word_ = blk_.meta.high_words ? blk_.high[0] : 0ULL;
+    read_value();
+}
 
-    return o;
+void Sequence::Cursor::read_value() {
+    if (blk_.meta.encoding == BLOCK_RUN) {
+        value_ = blk_.meta.floor + in_block_;
+        return;
+    }
+    // Find the next set bit in the high bits. Every element has one, so
+    // this never runs off the end of the block.
+    while (high_word_ == 0) high_word_ = blk_.high[++high_idx_];
+    const uint64_t pos = ((uint64_t)high_idx_ << 6) + ctz64(high_word_);
+    // Clear the lowest set bit, which we've now consumed.
+    high_word_ &= high_word_ - 1ULL;
+    if (blk_.meta.encoding == BLOCK_BITMAP) {
+        value_ = blk_.meta.floor + pos;
+        return;
+    }
+    // See EFBlock::decode.
+    hi_ = pos - in_block_;
+    const uint64_t lo = (blk_.meta.l ? low_.get(blk_.meta.l) : 0ULL);
+    value_ = blk_.meta.floor + ((hi_ << blk_.meta.l) | lo);
 }
 
-Sequence Sequence::operator-(const Sequence& other) const {
-    const uint64_t block_size_0 = static_cast<uint64_t>(meta.block_size),
-                   block_size_1 = static_cast<uint64_t>(other.block_size());
-    Sequence o(block_size_0);
-    if (meta.n_elem == 0 || other.meta.n_elem == 0) {
-        return o;
+void Sequence::Cursor::next_block() {
+    index_ += blk_.meta.n_elem - in_block_;
+    if (!at_end()) load_block(block_idx_ + 1);
+}
+
+void Sequence::Cursor::next() {
+    ++index_;
+    if (at_end()) return;
+    ++in_block_;
+    if (in_block_ == blk_.meta.n_elem) {
+        load_block(block_idx_ + 1);
+    } else {
+        read_value();
     }
+}
 
-    // Values in the current block to be compressed; flush at block_size_0
-    std::vector<uint64_t> new_values;
+void Sequence::Cursor::seek_in_block(uint32_t k) {
+    index_ += k - in_block_;
+    in_block_ = k;
+    if (blk_.meta.encoding == BLOCK_RUN) {
+        read_value();
+        return;
+    }
+    // Resume the high bits at element k's set bit, and the low bits at
+    // element k's slot.
+    const uint64_t pos = select1(blk_.high, (size_t)blk_.meta.high_words, k);
+    high_idx_ = (size_t)(pos >> 6);
+    high_word_ = blk_.high[high_idx_] & (~0ULL << (pos & 63ULL));
+    if (blk_.meta.l) low_.scan((uint64_t)k * blk_.meta.l);
+    read_value();
+}
 
-    // Global index from 0 to n_elem
-    uint64_t idx_0 = 0,
-             idx_1 = 0,
-    // Corresponding values
-             val_0,
-             val_1,
-    // Index within the current block
-             idx_in_block_0 = 0,
-             idx_in_block_1 = 0,
-    // Current block indices
-             block_idx_0 = 0, 
-             block_idx_1 = 0,
-    // Byte offset within encoded payload
-             cursor = 0;
-
-    // Current values within each block
-    std::vector<uint64_t> values_0 = decode_block(block_idx_0),
-                          values_1 = other.decode_block(block_idx_1);
-
-    while (idx_0 < meta.n_elem && idx_1 < other.meta.n_elem) {
-        // Decode the next block(s) if necessary
-        if (idx_in_block_0 == block_size_0) {
-            ++block_idx_0;
-            idx_in_block_0 = 0;
-            values_0 = decode_block(block_idx_0);
+void Sequence::Cursor::skip_to(uint64_t x) {
+    check_valid();
+    if (at_end() || value_ >= x) return;
+    const uint64_t n_blocks = seq_->meta.n_blocks;
+    if (seq_->block_last(block_idx_) < x) {
+        // Nothing left in the Sequence is >= x.
+        if (seq_->block_last(n_blocks - 1) < x) {
+            PEF_COUNT(blocks_skipped, n_blocks - 1 - block_idx_);
+            index_ = seq_->meta.n_elem;
+            return;
         }
-        if (idx_in_block_1 == block_size_1) {
-            ++block_idx_1;
-            idx_in_block_1 = 0;
-            // skip forward to the next relevant block, if we can
-            while (block_idx_1 < other.meta.n_blocks && other.block_last_.at(block_idx_1) < val_0) {
-                idx_1 += block_size_1;
-                block_idx_1 += 1;
-            }
-            values_1 = other.decode_block(block_idx_1);
+        // Gallop forward over the block maxima until we overshoot x...
+        const bool two_level = n_blocks >= SKIP_MIN_BLOCKS;
+        uint64_t lo = block_idx_, // block_last(lo) < x
+                 step = 1;
+        while (lo + step < n_blocks && seq_->block_last(lo + step) < x) {
+            lo += step;
+            step <<= 1;
+            if (two_level && step > SKIP_SAMPLE) break;
         }
-
-        // Get the values to compare
-        val_0 = values_0.at(idx_in_block_0);
-        val_1 = values_1.at(idx_in_block_1);
-
-        // Actually do the intersection and increment indices
-        if (val_0 == val_1) {
-            ++idx_0;
-            ++idx_in_block_0;
-            ++idx_1;
-            ++idx_in_block_1;
-        } else if (val_0 < val_1) {
-            new_values.push_back(val_0);
-            ++o.meta.n_elem;
-            if (new_values.size() == block_size_0) {
-                o._flush_block(new_values, cursor);
-            }
-            ++idx_0;
-            ++idx_in_block_0;
+        uint64_t bi;
+        if (two_level && step > SKIP_SAMPLE) {
+            // x is far ahead, so go through the upper level of the block
+            // index rather than galloping over block_last.
+            bi = seq_->find_block(x);
         } else {
-            ++idx_1;
-            ++idx_in_block_1;
+            const uint64_t hi = std::min(lo + step, n_blocks - 1); // block_last(hi) >= x
+            // ...then binary search for the first block that could contain x.
+            const size_t stride = seq_->index_stride();
+            bi = lo + 1 + strided_lower_bound(
+                seq_->block_last_data() + (lo + 1) * stride,
+                stride,
+                (size_t)(hi - lo),
+                x
+            );
         }
+        PEF_COUNT(blocks_skipped, bi - block_idx_ - 1);
+        index_ = seq_->block_begin(bi);
+        load_block(bi);
+        if (value_ >= x) return;
+    }
+    // x is now within the current block. If it's in a later high-bit bucket
+    // than the current element, jump straight to that bucket; otherwise the
+    // candidates are the few elements left in the current bucket. Bitmap
+    // and run blocks find x directly.
+    const uint64_t bucket = (x - blk_.meta.floor) >> blk_.meta.l;
+    if (blk_.meta.encoding != BLOCK_EF || bucket > hi_) {
+        seek_in_block(blk_.lower_bound(x));
+    } else {
+        while (!at_end() && value_ < x) next();
     }
+}
 
-    // If we've reached the end of the right Sequence but not the left
-    // one, then every remaining value in the left one goes into the difference
-    if (idx_1 == other.meta.n_elem) {
-        while (idx_0 < meta.n_elem) {
-            if (idx_in_block_0 == block_size_0) {
-                ++block_idx_0;
-                idx_in_block_0 = 0;
-                values_0 = decode_block(block_idx_0);
-            }
-            new_values.push_back(values_0.at(idx_in_block_0));
-            ++o.meta.n_elem;
-            if (new_values.size() == block_size_0) {
-                o._flush_block(new_values, cursor);
-            }
-            ++idx_0;
-            ++idx_in_block_0;
+namespace {
+
+// The logic behind filter_by_count and unique, passing the elements of the
+// result in order to *emit*.
+
+template <class Emit>
+void filter_cursor(
+    Sequence::Cursor it,
+    const int min_count,
+    const int max_count,
+    const bool write_multiset,
+    Emit& emit
+) {
+    while (!it.at_end()) {
+        // Count the run of elements equal to *v*.
+        const uint64_t v = it.value();
+        int count = 0;
+        while (!it.at_end() && it.value() == v) {
+            ++count;
+            it.next();
+        }
+        if (count >= min_count && count <= max_count) {
+            const int copies = write_multiset ? count : 1;
+            for (int i = 0; i < copies; ++i) emit(v);
         }
     }
+}
 
-    // Flush the last block, if necessary
-    if (new_values.size() > 0) {
-        o._flush_block(new_values, cursor);
+template <class Emit>
+void unique_cursor(Sequence::Cursor it, Emit& emit) {
+    while (!it.at_end()) {
+        const uint64_t v = it.value();
+        emit(v);
+        // skip the repeats of *v*
+        it.skip_to(v + 1);
+        if (v == UINT64_MAX) break;
     }
-
-    // Update payload offset for output files.
-    o.meta.payload_offset = sizeof(SequenceMetadata) + o.meta.n_blocks * sizeof(uint64_t) * 2;
-
-    return o;
 }
 
-Sequence Sequence::operator|(const Sequence& other) const {
-    const uint64_t block_size_0 = static_cast<uint64_t>(meta.block_size),
-                   block_size_1 = static_cast<uint64_t>(other.block_size());
+} // end anonymous namespace
+
+Sequence Sequence::filter_by_count(
+    const int min_count,
+    const int max_count,
+    const bool write_multiset
+) const {
+    Sequence o(meta.block_size);
+    if (meta.n_elem == 0) return o;
+    o._reserve(meta.n_elem, payload_size());
+    std::vector<uint64_t> ovalues;
+    uint64_t cursor = 0; // byte offset
+    auto emit = [&](uint64_t v) { o._push_value(v, ovalues, cursor); };
+    filter_cursor(Cursor(*this), min_count, max_count, write_multiset, emit);
+    o._finish(ovalues, cursor);
+    return o;
+}
+
+Sequence Sequence::unique() const {
+    Sequence o(meta.block_size);
+    if (meta.n_elem == 0) return o;
+    o._reserve(meta.n_elem, payload_size());
+    std::vector<uint64_t> ovalues;
+    uint64_t cursor = 0; // byte offset
+    auto emit = [&](uint64_t v) { o._push_value(v, ovalues, cursor); };
+    unique_cursor(Cursor(*this), emit);
+    o._finish(ovalues, cursor);
+    return o;
+}
+
+SequenceBuilder::SequenceBuilder(uint32_t block_size):
+    seq_(block_size)
+{}
+
+SequenceBuilder::SequenceBuilder(
+    std::ostream& out,
+    uint64_t max_elem,
+    uint32_t block_size
+):
+    seq_(block_size),
+    out_(&out)
+{
+    open_stream(max_elem);
+}
+
+SequenceBuilder::SequenceBuilder(
+    const std::string& path,
+    uint64_t max_elem,
+    uint32_t block_size
+):
+    seq_(block_size),
+    file_(new std::ofstream(path, std::ios::binary))
+{
+    if (!*file_) {
+        file_error("build", path, "failure to open file");
+    }
+    out_ = file_.get();
+    open_stream(max_elem);
+}
+
+void SequenceBuilder::open_stream(uint64_t max_elem) {
+    if (!*out_) {
+        throw std::runtime_error("failed to open stream for writing");
+    }
+    max_elem_ = max_elem;
+    base_ = out_->tellp();
+    if (base_ == std::streampos(-1)) {
+        throw std::runtime_error("SequenceBuilder: output stream must be seekable");
+    }
+    // Zeros for now; close() fills in the header and however much of the
+    // block index we end up using. The payload starts after all of it.
+    const uint64_t max_blocks = ceil_div_u64(max_elem, seq_.meta.block_size);
+    seq_.meta.payload_offset = sizeof(SequenceMetadata) + max_blocks * sizeof(uint64_t) * 2;
+    const std::vector<char> zeros(4096, 0);
+    for (uint64_t left = seq_.meta.payload_offset; left > 0; ) {
+        const size_t n = (size_t)std::min<uint64_t>(left, zeros.size());
+        out_->write(zeros.data(), static_cast<std::streamsize>(n));
+        left -= n;
+    }
+    if (!*out_) {
+        throw std::runtime_error("failed to reserve the header and block index");
+    }
+}
+
+void SequenceBuilder::push(uint64_t v) {
+    if (done_) {
+        throw std::runtime_error("SequenceBuilder: already finished");
+    }
+    if (seq_.meta.n_elem > 0 && v < (block_.empty() ? seq_.block_last_.back() : block_.back())) {
+        throw std::runtime_error("SequenceBuilder: values must be nondecreasing");
+    }
+    if (seq_.meta.n_elem == max_elem_) {
+        throw std::runtime_error("SequenceBuilder: more than max_elem values");
+    }
+    seq_._push_value(v, block_, cursor_);
+    if (out_ && block_.empty()) write_payload();
+}
+
+void SequenceBuilder::push_many(const uint64_t* values, size_t n) {
+    for (size_t i = 0; i < n; ++i) push(values[i]);
+}
+
+uint64_t SequenceBuilder::n_elem() const {
+    return seq_.meta.n_elem;
+}
+
+void SequenceBuilder::write_payload() {
+    out_->write(
+        reinterpret_cast<const char*>(seq_.payload_.data()),
+        static_cast<std::streamsize>(seq_.payload_.size())
+    );
+    if (!*out_) {
+        throw std::runtime_error("failed to write payload_");
+    }
+    seq_.payload_.clear();
+}
+
+Sequence SequenceBuilder::finish() {
+    if (out_) {
+        throw std::runtime_error("SequenceBuilder: streaming builders are closed, not finished");
+    }
+    if (done_) {
+        throw std::runtime_error("SequenceBuilder: already finished");
+    }
+    done_ = true;
+    seq_._finish(block_, cursor_);
+    return std::move(seq_);
+}
+
+void SequenceBuilder::close() {
+    if (!out_) {
+        throw std::runtime_error("SequenceBuilder: only streaming builders can be closed");
+    }
+    if (done_) return;
+    done_ = true;
+    // Keep the payload_offset reserved in open_stream.
+    const uint64_t payload_offset = seq_.meta.payload_offset;
+    seq_._finish(block_, cursor_);
+    seq_.meta.payload_offset = payload_offset;
+    write_payload();
+    const std::streampos end = out_->tellp();
+
+    // Patch the header and block index.
+    out_->seekp(base_);
+    out_->write(reinterpret_cast<const char*>(&seq_.meta), sizeof(seq_.meta));
+    out_->write(
+        reinterpret_cast<const char*>(seq_.block_last_.data()),
+        static_cast<std::streamsize>(seq_.meta.n_blocks * sizeof(uint64_t))
+    );
+    out_->write(
+        reinterpret_cast<const char*>(seq_.block_offs_.data()),
+        static_cast<std::streamsize>(seq_.meta.n_blocks * sizeof(uint64_t))
+    );
+    out_->seekp(end);
+    if (!*out_) {
+        throw std::runtime_error("failed to write header and block index");
+    }
+    if (file_) file_->close();
+}
+
+namespace {
+
+// The merge logic behind the binary set operations. Each one walks two
+// Cursors and passes the elements of the result, in order, to *emit*,
+// stopping early if *emit* returns false. Multisets follow the std::
+// algorithms: intersections keep the smaller multiplicity of each element,
+// unions the larger, and differences subtract multiplicities.
+
+template <class Emit>
+void intersect_cursors(
+    Sequence::Cursor driver,
+    Sequence::Cursor probe,
+    Emit& emit
+) {
+    // The driver should be the smaller input: the other one is only ever
+    // probed with skip_to, so most of its blocks are never decoded.
+    while (!driver.at_end()) {
+        probe.skip_to(driver.value());
+        if (probe.at_end()) return;
+        if (probe.value() == driver.value()) {
+            if (!emit(driver.value())) return;
+            driver.next();
+            probe.next();
+        } else {
+            driver.skip_to(probe.value());
+        }
+    }
+}
+
+template <class Emit>
+void difference_cursors(
+    Sequence::Cursor it_0,
+    Sequence::Cursor it_1,
+    Emit& emit
+) {
+    while (!it_0.at_end() && !it_1.at_end()) {
+        const uint64_t val_0 = it_0.value(),
+                       val_1 = it_1.value();
+        if (val_0 == val_1) {
+            it_0.next();
+            it_1.next();
+        } else if (val_0 < val_1) {
+            if (!emit(val_0)) return;
+            it_0.next();
+        } else {
+            it_1.skip_to(val_0);
+        }
+    }
+    // If we've reached the end of the right Sequence but not the left
+    // one, then every remaining value in the left one goes into the difference
+    for (; !it_0.at_end(); it_0.next()) {
+        if (!emit(it_0.value())) return;
+    }
+}
+
+template <class Emit>
+void union_cursors(
+    Sequence::Cursor it_0,
+    Sequence::Cursor it_1,
+    Emit& emit
+) {
+    // Write the smaller of the two values and advance the corresponding
+    // Cursor. This maintains sorting order.
+    while (!it_0.at_end() && !it_1.at_end()) {
+        const uint64_t val_0 = it_0.value(),
+                       val_1 = it_1.value();
+        if (val_0 == val_1) {
+            if (!emit(val_0)) return;
+            it_0.next();
+            it_1.next();
+        } else if (val_0 < val_1) {
+            if (!emit(val_0)) return;
+            it_0.next();
+        } else {
+            if (!emit(val_1)) return;
+            it_1.next();
+        }
+    }
+    // Once one Sequence is exhausted, write the rest of the other one.
+    for (; !it_0.at_end(); it_0.next()) {
+        if (!emit(it_0.value())) return;
+    }
+    for (; !it_1.at_end(); it_1.next()) {
+        if (!emit(it_1.value())) return;
+    }
+}
+
+// Collects the output of a merge into a vector.
+struct PushBack {
+    std::vector<uint64_t>* out;
+    bool operator()(uint64_t v) {
+        out->push_back(v);
+        return true;
+    }
+};
+
+typedef void (*MergeFn)(Sequence::Cursor, Sequence::Cursor, PushBack&);
+
+// Run *merge* over *a* and *b* on up to *n_threads* threads. The value
+// space is cut at the floors of evenly spaced blocks of the larger input,
+// giving ranges [cut_t, cut_{t+1}) that hold every copy of their values in
+// both inputs, so each range merges independently of the others. Returns
+// the output of each range, in order.
+std::vector<std::vector<uint64_t> > merge_parallel(
+    const Sequence& a,
+    const Sequence& b,
+    unsigned n_threads,
+    MergeFn merge
+) {
+    const Sequence& big = (a.n_blocks() >= b.n_blocks()) ? a : b;
+    const uint64_t n_parts = std::max<uint64_t>(
+        1, std::min<uint64_t>(n_threads, big.n_blocks())
+    );
+    // Element index ranges of each part in *a* and *b*.
+    std::vector<uint64_t> a_begin(n_parts + 1, 0), b_begin(n_parts + 1, 0);
+    for (uint64_t t = 1; t < n_parts; ++t) {
+        const uint64_t bi = big.n_blocks() * t / n_parts,
+                       cut = big.get(big.block_begin(bi));
+        a_begin[t] = a.lower_bound(cut);
+        b_begin[t] = b.lower_bound(cut);
+    }
+    a_begin[n_parts] = a.n_elem();
+    b_begin[n_parts] = b.n_elem();
+
+    std::vector<std::vector<uint64_t> > parts(n_parts);
+    auto run = [&](uint64_t t) {
+        PushBack emit = {&parts[t]};
+        merge(
+            Sequence::Cursor(a, a_begin[t], a_begin[t + 1]),
+            Sequence::Cursor(b, b_begin[t], b_begin[t + 1]),
+            emit
+        );
+    };
+    std::vector<std::thread> workers;
+    for (uint64_t t = 1; t < n_parts; ++t) workers.emplace_back(run, t);
+    run(0);
+    for (auto& w: workers) w.join();
+    return parts;
+}
+
+// The outputs of merge_parallel as segments for Sequence::_encode_segments.
+std::vector<std::pair<const uint64_t*, size_t> > segments_of(
+    const std::vector<std::vector<uint64_t> >& parts
+) {
+    std::vector<std::pair<const uint64_t*, size_t> > o;
+    for (const auto& part: parts) o.push_back(std::make_pair(part.data(), part.size()));
+    return o;
+}
+
+} // end anonymous namespace
+
+Sequence Sequence::intersect(const Sequence& other, unsigned n_threads) const {
+    Sequence o(meta.block_size);
+    if (meta.n_elem == 0 || other.meta.n_elem == 0) {
+        return o;
+    }
+    if (n_threads > 1) {
+        const bool this_drives = meta.n_elem <= other.meta.n_elem;
+        const std::vector<std::vector<uint64_t> > parts = merge_parallel(
+            this_drives ? *this : other,
+            this_drives ? other : *this,
+            n_threads,
+            &intersect_cursors<PushBack>
+        );
+        o._encode_segments(segments_of(parts), n_threads);
+        return o;
+    }
 
+    // The output is a subset of the smaller input, and rarely takes more
+    // room than it does.
+    const Sequence& small = (meta.n_elem <= other.meta.n_elem) ? *this : other;
+    o._reserve(small.meta.n_elem, small.payload_size());
+
+    // Values in the current block to be compressed; flush at block_size
+    std::vector<uint64_t> new_values;
+    // Byte offset within encoded payload
+    uint64_t cursor = 0;
+
+    auto emit = [&](uint64_t v) {
+        o._push_value(v, new_values, cursor);
+        return true;
+    };
+    if (meta.n_elem <= other.meta.n_elem) {
+        intersect_cursors(Cursor(*this), Cursor(other), emit);
+    } else {
+        intersect_cursors(Cursor(other), Cursor(*this), emit);
+    }
+
+    o._finish(new_values, cursor);
+    return o;
+}
+
+Sequence Sequence::operator-(const Sequence& other) const {
+    Sequence o(meta.block_size);
+    if (meta.n_elem == 0) {
+        return o;
+    }
+    // The output is a subset of *this.
+    o._reserve(meta.n_elem, payload_size());
+
+    // Values in the current block to be compressed; flush at block_size
+    std::vector<uint64_t> new_values;
+    // Byte offset within encoded payload
+    uint64_t cursor = 0;
+
+    // Same walk as difference_cursors, except that a block of *this with
+    // no value left in *other* is copied to the output as it stands. Once
+    // *other* runs out, everything left is copied, so a short block there
+    // is worth it.
+    Cursor it_0(*this), it_1(other);
+    while (!it_0.at_end()) {
+        if (!it_1.at_end() && it_1.value() < it_0.value()) it_1.skip_to(it_0.value());
+        if (it_0.at_block_start()
+                && (it_1.at_end() || block_last(it_0.block()) < it_1.value())
+                && o._splice_block(*this, it_0.block(), new_values, cursor, it_1.at_end())) {
+            it_0.next_block();
+        } else if (!it_1.at_end() && it_0.value() == it_1.value()) {
+            it_0.next();
+            it_1.next();
+        } else {
+            o._push_value(it_0.value(), new_values, cursor);
+            it_0.next();
+        }
+    }
+
+    o._finish(new_values, cursor);
+    return o;
+}
+
+Sequence Sequence::operator|(const Sequence& other) const {
     // Special cases: if either Sequence is empty, we just copy the existing
     // object. In this case, the block size of the output object is equal to
     // whatever the block size of the nonempty Sequence was.
@@ -1106,102 +2827,322 @@ Sequence Sequence::operator|(const Sequence& other) const {
         return seq;
     }
 
-    Sequence o(block_size_0);
+    Sequence o(meta.block_size);
+    // The union of two Sequences rarely takes more room than both of them.
+    o._reserve(meta.n_elem + other.meta.n_elem, payload_size() + other.payload_size());
 
-    // Values in the current block to be compressed; flush at block_size_0
+    // Values in the current block to be compressed; flush at block_size
     std::vector<uint64_t> new_values;
-
-    // Global index from 0 to n_elem
-    uint64_t idx_0 = 0,
-             idx_1 = 0,
-    // Corresponding values
-             val_0,
-             val_1,
-    // Index within the current block
-             idx_in_block_0 = 0,
-             idx_in_block_1 = 0,
-    // Current block indices
-             block_idx_0 = 0, 
-             block_idx_1 = 0,
     // Byte offset within encoded payload
-             cursor = 0;
-
-    // Current values within each block
-    std::vector<uint64_t> values_0 = decode_block(block_idx_0),
-                          values_1 = other.decode_block(block_idx_1);
-
-    while (idx_0 < meta.n_elem || idx_1 < other.meta.n_elem) {
-        // Decode new block(s) if necessary
-        if (idx_0 < meta.n_elem && idx_in_block_0 == block_size_0) {
-            ++block_idx_0;
-            values_0 = decode_block(block_idx_0);
-            idx_in_block_0 = 0;
-        }
-        if (idx_1 < other.meta.n_elem && idx_in_block_1 == block_size_1) {
-            ++block_idx_1;
-            values_1 = other.decode_block(block_idx_1);
-            idx_in_block_1 = 0;
+    uint64_t cursor = 0;
+
+    // Same walk as union_cursors, except that a block of either input that
+    // lies entirely below the other input's next value is copied to the
+    // output as it stands, without decoding it (as with operator-, always
+    // once the other input runs out).
+    Cursor it_0(*this), it_1(other);
+    while (!it_0.at_end() || !it_1.at_end()) {
+        if (it_0.at_block_start()
+                && (it_1.at_end() || block_last(it_0.block()) < it_1.value())
+                && o._splice_block(*this, it_0.block(), new_values, cursor, it_1.at_end())) {
+            it_0.next_block();
+        } else if (it_1.at_block_start()
+                && (it_0.at_end() || other.block_last(it_1.block()) < it_0.value())
+                && o._splice_block(other, it_1.block(), new_values, cursor, it_0.at_end())) {
+            it_1.next_block();
+        } else if (it_1.at_end() || (!it_0.at_end() && it_0.value() < it_1.value())) {
+            o._push_value(it_0.value(), new_values, cursor);
+            it_0.next();
+        } else if (it_0.at_end() || it_1.value() < it_0.value()) {
+            o._push_value(it_1.value(), new_values, cursor);
+            it_1.next();
+        } else {
+            o._push_value(it_0.value(), new_values, cursor);
+            it_0.next();
+            it_1.next();
         }
+    }
 
-        // If we've reached the end of the first Sequence, write the next value
-        // from the second Sequence.
-        if (idx_0 == meta.n_elem) {
-            new_values.push_back(values_1.at(idx_in_block_1));
-            ++o.meta.n_elem;
-            ++idx_1;
-            ++idx_in_block_1;
-        }
+    o._finish(new_values, cursor);
+    return o;
+}
 
-        // If we've reached the end of the second Sequence, write the next value
-        // from the first Sequence.
-        else if (idx_1 == other.meta.n_elem) {
-            new_values.push_back(values_0.at(idx_in_block_0));
-            ++o.meta.n_elem;
-            ++idx_0;
-            ++idx_in_block_0;
+Sequence Sequence::difference(const Sequence& other, unsigned n_threads) const {
+    if (n_threads <= 1 || meta.n_elem == 0) return *this - other;
+    const std::vector<std::vector<uint64_t> > parts = merge_parallel(
+        *this, other, n_threads, &difference_cursors<PushBack>
+    );
+    Sequence o(meta.block_size);
+    o._encode_segments(segments_of(parts), n_threads);
+    return o;
+}
+
+Sequence Sequence::union_with(const Sequence& other, unsigned n_threads) const {
+    if (n_threads <= 1 || meta.n_elem == 0 || other.meta.n_elem == 0) {
+        return *this | other;
+    }
+    const std::vector<std::vector<uint64_t> > parts = merge_parallel(
+        *this, other, n_threads, &union_cursors<PushBack>
+    );
+    Sequence o(meta.block_size);
+    o._encode_segments(segments_of(parts), n_threads);
+    return o;
+}
+
+uint64_t Sequence::intersect_count(const Sequence& other) const {
+    if (meta.n_elem == 0 || other.meta.n_elem == 0) return 0;
+    uint64_t count = 0;
+    auto emit = [&](uint64_t) {
+        ++count;
+        return true;
+    };
+    if (meta.n_elem <= other.meta.n_elem) {
+        intersect_cursors(Cursor(*this), Cursor(other), emit);
+    } else {
+        intersect_cursors(Cursor(other), Cursor(*this), emit);
+    }
+    return count;
+}
+
+uint64_t Sequence::union_count(const Sequence& other) const {
+    // Per element, max(a, b) = a + b - min(a, b), so this only needs the
+    // (galloping) intersection rather than a full merge.
+    return meta.n_elem + other.meta.n_elem - intersect_count(other);
+}
+
+uint64_t Sequence::difference_count(const Sequence& other) const {
+    // Per element, max(a - b, 0) = a - min(a, b).
+    return meta.n_elem - intersect_count(other);
+}
+
+bool Sequence::intersects(const Sequence& other) const {
+    if (meta.n_elem == 0 || other.meta.n_elem == 0) return false;
+    bool found = false;
+    auto emit = [&](uint64_t) {
+        found = true;
+        return false;
+    };
+    if (meta.n_elem <= other.meta.n_elem) {
+        intersect_cursors(Cursor(*this), Cursor(other), emit);
+    } else {
+        intersect_cursors(Cursor(other), Cursor(*this), emit);
+    }
+    return found;
+}
+
+void Sequence::_materialize() {
+    if (!backing_) return;
+    const uint64_t n_blocks = meta.n_blocks;
+    const size_t stride = index_stride();
+    std::vector<uint64_t> last(n_blocks), offs(n_blocks), begin;
+    for (uint64_t bi = 0; bi < n_blocks; ++bi) {
+        last[bi] = block_last_data()[bi * stride];
+        offs[bi] = block_offs_data()[bi * stride];
+    }
+    if (variable_blocks()) {
+        begin.resize(n_blocks);
+        for (uint64_t bi = 0; bi < n_blocks; ++bi) begin[bi] = block_begin_data()[bi * stride];
+    }
+    payload_.assign(payload_data(), payload_data() + payload_size());
+    block_last_.swap(last);
+    block_offs_.swap(offs);
+    block_begin_.swap(begin);
+    backing_.reset();
+    view_last_ = view_offs_ = view_begin_ = view_floor_ = nullptr;
+    view_payload_ = nullptr;
+    view_payload_size_ = 0;
+    view_stride_ = 1;
+    view_buffer_ = nullptr;
+    view_buffer_size_ = 0;
+}
+
+uint64_t Sequence::_reopen(uint64_t bi, std::vector<uint64_t>& values) {
+    _materialize();
+    const uint64_t first = bi < meta.n_blocks ? block_begin(bi) : meta.n_elem;
+    const size_t old = values.size();
+    values.resize(old + (meta.n_elem - first));
+    for (uint64_t k = bi, pos = old; k < meta.n_blocks; ++k) {
+        pos += decode_block_into(k, values.data() + pos, values.size() - pos);
+    }
+    if (bi < meta.n_blocks) payload_.resize(block_offs_[bi]);
+    block_last_.resize(bi);
+    block_offs_.resize(bi);
+    if (variable_blocks()) block_begin_.resize(bi);
+    meta.n_blocks = bi;
+    meta.n_elem = first;
+    // Both are keyed by block, and the blocks from *bi* on are about to
+    // change.
+    delete skip_.exchange(nullptr);
+    if (cache_) cache_->clear();
+    return payload_.size();
+}
+
+void Sequence::_merge_tail(const uint64_t* values, size_t n) {
+    if (n == 0) return;
+    ++generation_;
+    // The first block with an element greater than values[0]; if there's
+    // none, the last block, unless it's full.
+    uint64_t bi = meta.n_blocks;
+    if (meta.n_elem > 0 && values[0] < block_last(meta.n_blocks - 1)) {
+        bi = find_block(values[0] + 1);
+    } else if (meta.n_blocks > 0 && block_n_elem(meta.n_blocks - 1) < meta.block_size) {
+        bi = meta.n_blocks - 1;
+    }
+    std::vector<uint64_t> tail;
+    uint64_t cursor = _reopen(bi, tail);
+    std::vector<uint64_t> block;
+    block.reserve(meta.block_size);
+    // Values already present go first, as with std::merge.
+    size_t i = 0, j = 0;
+    while (i < tail.size() || j < n) {
+        if (j == n || (i < tail.size() && tail[i] <= values[j])) {
+            _push_value(tail[i++], block, cursor);
+        } else {
+            _push_value(values[j++], block, cursor);
         }
+    }
+    _finish(block, cursor);
+}
 
-        // Otherwise, write the smaller of the two values and increment
-        // the corresponding Sequence's index. This maintains sorting order.
-        else {
-            val_0 = values_0.at(idx_in_block_0);
-            val_1 = values_1.at(idx_in_block_1);
-            // Determine which value to write to the output.
-            if (val_0 == val_1) {
-                new_values.push_back(val_0);
-                ++o.meta.n_elem;
-                ++idx_0;
-                ++idx_in_block_0;
-                ++idx_1;
-                ++idx_in_block_1;
-            }
-            else if (val_0 < val_1) {
-                new_values.push_back(val_0);
-                ++o.meta.n_elem;
-                ++idx_0;
-                ++idx_in_block_0;
-            } else {
-                new_values.push_back(val_1);
-                ++o.meta.n_elem;
-                ++idx_1;
-                ++idx_in_block_1;
+void Sequence::append(const uint64_t* values, size_t n) {
+    if (n == 0) return;
+    if (!std::is_sorted(values, values + n)) {
+        throw std::runtime_error("Sequence::append: values must be nondecreasing");
+    }
+    if (meta.n_elem > 0 && values[0] < block_last(meta.n_blocks - 1)) {
+        throw std::runtime_error("Sequence::append: values must not be less than the last element");
+    }
+    _merge_tail(values, n);
+}
+
+void Sequence::append(const std::vector<uint64_t>& values) {
+    append(values.data(), values.size());
+}
+
+void Sequence::insert(const uint64_t* values, size_t n) {
+    if (!std::is_sorted(values, values + n)) {
+        throw std::runtime_error("Sequence::insert: values must be nondecreasing");
+    }
+    _merge_tail(values, n);
+}
+
+void Sequence::insert(const std::vector<uint64_t>& values) {
+    insert(values.data(), values.size());
+}
+
+InsertBuffer::InsertBuffer(Sequence& seq, size_t capacity):
+    seq_(seq),
+    capacity_(std::max<size_t>(capacity, 1))
+{
+    pending_.reserve(capacity_);
+}
+
+void InsertBuffer::insert(uint64_t v) {
+    pending_.push_back(v);
+    if (pending_.size() >= capacity_) flush();
+}
+
+void InsertBuffer::flush() {
+    std::sort(pending_.begin(), pending_.end());
+    seq_.insert(pending_);
+    pending_.clear();
+}
+
+size_t InsertBuffer::size() const {
+    return pending_.size();
+}
+
+Sequence intersect_many(const std::vector<const Sequence*>& seqs) {
+    if (seqs.empty()) return Sequence();
+    Sequence o(seqs[0]->block_size());
+    // Shortest input first, so that it drives the leapfrog.
+    std::vector<const Sequence*> order(seqs);
+    std::sort(
+        order.begin(), order.end(),
+        [](const Sequence* a, const Sequence* b) { return a->n_elem() < b->n_elem(); }
+    );
+    if (order[0]->n_elem() == 0) return o;
+
+    // Values in the current block to be compressed; flush at block_size
+    std::vector<uint64_t> new_values;
+    // Byte offset within encoded payload
+    uint64_t cursor = 0;
+
+    std::vector<Sequence::Cursor> its;
+    its.reserve(order.size());
+    for (const Sequence* seq: order) its.emplace_back(*seq);
+
+    // Candidate for the next element of the intersection.
+    uint64_t x = its[0].value();
+    bool done = false;
+    while (!done) {
+        // Try to find *x* in every input. If one of them overshoots, its
+        // value becomes the new candidate and we start over.
+        bool found = true;
+        for (size_t i = 0; i < its.size() && found; ++i) {
+            its[i].skip_to(x);
+            if (its[i].at_end()) {
+                done = true;
+                found = false;
+            } else if (its[i].value() != x) {
+                x = its[i].value();
+                found = false;
             }
         }
-
-        // Compress a new block, if we've reached the block size
-        if (new_values.size() == block_size_0) {
-            o._flush_block(new_values, cursor);
+        if (!found) continue;
+        o._push_value(x, new_values, cursor);
+        for (auto& it: its) {
+            it.next();
+            done = done || it.at_end();
         }
+        if (!done) x = its[0].value();
     }
 
-    // Flush the last block, if necessary
-    if (new_values.size() > 0) {
-        o._flush_block(new_values, cursor);
-    }
+    o._finish(new_values, cursor);
+    return o;
+}
 
-    // Update payload offset for output files.
-    o.meta.payload_offset = sizeof(SequenceMetadata) + o.meta.n_blocks * sizeof(uint64_t) * 2;
+Sequence union_many(const std::vector<const Sequence*>& seqs) {
+    if (seqs.empty()) return Sequence();
+    Sequence o(seqs[0]->block_size());
+
+    // Values in the current block to be compressed; flush at block_size
+    std::vector<uint64_t> new_values;
+    // Byte offset within encoded payload
+    uint64_t cursor = 0;
+
+    std::vector<Sequence::Cursor> its;
+    its.reserve(seqs.size());
+    for (const Sequence* seq: seqs) its.emplace_back(*seq);
+
+    // Min-heap of (current value, input index).
+    typedef std::pair<uint64_t, size_t> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    for (size_t i = 0; i < its.size(); ++i) {
+        if (!its[i].at_end()) heap.push(Entry(its[i].value(), i));
+    }
+
+    while (!heap.empty()) {
+        // Pop every input sitting on the smallest value *v*, and count how
+        // many times each of them repeats it.
+        const uint64_t v = heap.top().first;
+        uint64_t copies = 0;
+        while (!heap.empty() && heap.top().first == v) {
+            const size_t i = heap.top().second;
+            Sequence::Cursor& it = its[i];
+            heap.pop();
+            uint64_t count = 0;
+            while (!it.at_end() && it.value() == v) {
+                ++count;
+                it.next();
+            }
+            copies = std::max(copies, count);
+            if (!it.at_end()) heap.push(Entry(it.value(), i));
+        }
+        for (uint64_t c = 0; c < copies; ++c) o._push_value(v, new_values, cursor);
+    }
 
+    o._finish(new_values, cursor);
     return o;
 }
 
@@ -1217,4 +3158,271 @@ uint64_t Sequence::n_blocks() const {
     return meta.n_blocks;
 }
 
+uint64_t Sequence::block_begin(uint64_t bi) const {
+    return variable_blocks() ? block_begin_data()[bi * index_stride()] : bi * meta.block_size;
+}
+
+uint64_t Sequence::block_of(uint64_t i) const {
+    if (!variable_blocks()) return i / meta.block_size;
+    // The last block that starts at or before i.
+    return strided_lower_bound(block_begin_data(), index_stride(), meta.n_blocks, i + 1) - 1;
+}
+
+bool Sequence::variable_blocks() const {
+    return (meta.reserved & SEQUENCE_VARIABLE_BLOCKS) != 0;
+}
+
+uint32_t Sequence::block_n_elem(uint64_t bi) const {
+    if (bi >= meta.n_blocks) {
+        throw std::runtime_error("Sequence::block_n_elem: out-of-bounds");
+    }
+    EFBlockMetadata block_meta;
+    std::memcpy(&block_meta, block_data(bi), sizeof(block_meta));
+    return block_meta.n_elem;
+}
+
+// Out-of-core set operations. Inputs are memory-mapped, so only the blocks
+// under the Cursors are paged in, and the output is streamed to its file
+// through a SequenceBuilder, so it never has to fit in memory either.
+
+void intersect_files(
+    const std::string& path_a,
+    const std::string& path_b,
+    const std::string& out_path
+) {
+    check_not_input(path_a, out_path);
+    check_not_input(path_b, out_path);
+    const Sequence a = Sequence::mmap(path_a),
+                   b = Sequence::mmap(path_b);
+    SequenceBuilder builder(out_path, std::min(a.n_elem(), b.n_elem()), a.block_size());
+    auto emit = [&](uint64_t v) {
+        builder.push(v);
+        return true;
+    };
+    if (a.n_elem() <= b.n_elem()) {
+        intersect_cursors(Sequence::Cursor(a), Sequence::Cursor(b), emit);
+    } else {
+        intersect_cursors(Sequence::Cursor(b), Sequence::Cursor(a), emit);
+    }
+    builder.close();
+}
+
+void difference_files(
+    const std::string& path_a,
+    const std::string& path_b,
+    const std::string& out_path
+) {
+    check_not_input(path_a, out_path);
+    check_not_input(path_b, out_path);
+    const Sequence a = Sequence::mmap(path_a),
+                   b = Sequence::mmap(path_b);
+    SequenceBuilder builder(out_path, a.n_elem(), a.block_size());
+    auto emit = [&](uint64_t v) {
+        builder.push(v);
+        return true;
+    };
+    difference_cursors(Sequence::Cursor(a), Sequence::Cursor(b), emit);
+    builder.close();
+}
+
+void union_files(
+    const std::string& path_a,
+    const std::string& path_b,
+    const std::string& out_path
+) {
+    check_not_input(path_a, out_path);
+    check_not_input(path_b, out_path);
+    const Sequence a = Sequence::mmap(path_a),
+                   b = Sequence::mmap(path_b);
+    SequenceBuilder builder(out_path, a.n_elem() + b.n_elem(), a.block_size());
+    auto emit = [&](uint64_t v) {
+        builder.push(v);
+        return true;
+    };
+    union_cursors(Sequence::Cursor(a), Sequence::Cursor(b), emit);
+    builder.close();
+}
+
+void unique_file(const std::string& path, const std::string& out_path) {
+    check_not_input(path, out_path);
+    const Sequence seq = Sequence::mmap(path);
+    SequenceBuilder builder(out_path, seq.n_elem(), seq.block_size());
+    auto emit = [&](uint64_t v) { builder.push(v); };
+    unique_cursor(Sequence::Cursor(seq), emit);
+    builder.close();
+}
+
+void filter_by_count_file(
+    const std::string& path,
+    const std::string& out_path,
+    const int min_count,
+    const int max_count,
+    const bool write_multiset
+) {
+    check_not_input(path, out_path);
+    const Sequence seq = Sequence::mmap(path);
+    SequenceBuilder builder(out_path, seq.n_elem(), seq.block_size());
+    auto emit = [&](uint64_t v) { builder.push(v); };
+    filter_cursor(Sequence::Cursor(seq), min_count, max_count, write_multiset, emit);
+    builder.close();
+}
+
+
+SequenceCollection::SequenceCollection(const std::string& path) {
+    mapping_ = map_file(path, size_);
+    base_ = static_cast<const uint8_t*>(mapping_.get());
+    if (size_ < sizeof(CollectionMetadata)) {
+        throw std::runtime_error("collection file is missing header");
+    }
+    std::memcpy(&meta_, base_, sizeof(meta_));
+    if (std::strncmp(meta_.magic, "PPEC", 4) != 0 || meta_.version != 1) {
+        throw std::runtime_error("invalid collection magic and/or version");
+    }
+    if (meta_.directory_offset % alignof(uint64_t) != 0
+            || meta_.directory_offset > size_
+            || (size_ - meta_.directory_offset) / sizeof(CollectionEntry) < meta_.n_sequences) {
+        throw std::runtime_error("collection directory is out of bounds");
+    }
+    directory_ = reinterpret_cast<const CollectionEntry*>(base_ + meta_.directory_offset);
+}
+
+uint64_t SequenceCollection::size() const {
+    return meta_.n_sequences;
+}
+
+const CollectionEntry* SequenceCollection::find(uint64_t term) const {
+    const CollectionEntry* end = directory_ + meta_.n_sequences;
+    const CollectionEntry* e = std::lower_bound(
+        directory_, end, term,
+        [](const CollectionEntry& entry, uint64_t t) { return entry.term < t; }
+    );
+    return (e != end && e->term == term) ? e : nullptr;
+}
+
+bool SequenceCollection::contains(uint64_t term) const {
+    return find(term) != nullptr;
+}
+
+Sequence SequenceCollection::get(uint64_t term) const {
+    const CollectionEntry* e = find(term);
+    if (!e) {
+        std::ostringstream msg;
+        msg << "no Sequence for term " << term << " in collection";
+        throw std::runtime_error(msg.str());
+    }
+    if (e->offset > size_ || e->size > size_ - e->offset) {
+        throw std::runtime_error("collection entry is out of bounds");
+    }
+    return Sequence::from_buffer(base_ + e->offset, static_cast<size_t>(e->size), mapping_);
+}
+
+CollectionEntry SequenceCollection::entry(uint64_t i) const {
+    if (i >= meta_.n_sequences) {
+        std::ostringstream msg;
+        msg << "invalid entry index " << i << "; total entries = " << meta_.n_sequences;
+        throw std::runtime_error(msg.str());
+    }
+    return directory_[i];
+}
+
+std::vector<uint64_t> SequenceCollection::terms() const {
+    std::vector<uint64_t> o(meta_.n_sequences);
+    for (uint64_t i = 0; i < meta_.n_sequences; ++i) o[i] = directory_[i].term;
+    return o;
+}
+
+SequenceCollectionWriter::SequenceCollectionWriter(const std::string& path, uint32_t version):
+    path_(path),
+    out_(path, std::ios::binary),
+    version_(version)
+{
+    if (!out_) {
+        file_error("write", path, "failure to open file");
+    }
+    if (version != 1 && version != 2) {
+        throw std::runtime_error("SequenceCollectionWriter: version must be 1 or 2");
+    }
+    // Zeros for now; close() fills in the header.
+    const CollectionMetadata header {};
+    out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+SequenceCollectionWriter::~SequenceCollectionWriter() {
+    // The builder may outlive us, but mustn't write to out_ once it's gone.
+    if (builder_) builder_->done_ = true;
+}
+
+void SequenceCollectionWriter::begin_entry(uint64_t term) {
+    if (done_) {
+        throw std::runtime_error("SequenceCollectionWriter: already closed");
+    }
+    end_entry();
+    if (!directory_.empty() && term <= directory_.back().term) {
+        throw std::runtime_error("SequenceCollectionWriter: terms must be increasing");
+    }
+    const uint64_t pos = static_cast<uint64_t>(out_.tellp());
+    const std::vector<char> zeros(V2_ALIGN, 0);
+    out_.write(zeros.data(), static_cast<std::streamsize>(round_up(pos, V2_ALIGN) - pos));
+    CollectionEntry e {};
+    e.term = term;
+    e.offset = round_up(pos, V2_ALIGN);
+    directory_.push_back(e);
+}
+
+void SequenceCollectionWriter::end_entry() {
+    if (!builder_) return;
+    builder_->close();
+    CollectionEntry& e = directory_.back();
+    e.n_elem = builder_->n_elem();
+    e.size = static_cast<uint64_t>(out_.tellp()) - e.offset;
+    builder_.reset();
+}
+
+void SequenceCollectionWriter::add(uint64_t term, const Sequence& seq) {
+    begin_entry(term);
+    seq.serialize_to_stream(out_, version_);
+    if (!out_) file_error("write", path_, "failure to write Sequence");
+    CollectionEntry& e = directory_.back();
+    e.size = static_cast<uint64_t>(out_.tellp()) - e.offset;
+    e.n_elem = seq.n_elem();
+    e.block_size = seq.block_size();
+}
+
+std::shared_ptr<SequenceBuilder> SequenceCollectionWriter::build(
+    uint64_t term,
+    uint64_t max_elem,
+    uint32_t block_size
+) {
+    begin_entry(term);
+    directory_.back().block_size = block_size;
+    builder_ = std::make_shared<SequenceBuilder>(out_, max_elem, block_size);
+    return builder_;
+}
+
+uint64_t SequenceCollectionWriter::size() const {
+    return directory_.size();
+}
+
+void SequenceCollectionWriter::close() {
+    if (done_) return;
+    end_entry();
+    done_ = true;
+    CollectionMetadata header {};
+    std::memcpy(header.magic, "PPEC", 4);
+    header.version = 1;
+    header.n_sequences = directory_.size();
+    const uint64_t pos = static_cast<uint64_t>(out_.tellp());
+    const std::vector<char> zeros(V2_ALIGN, 0);
+    out_.write(zeros.data(), static_cast<std::streamsize>(round_up(pos, V2_ALIGN) - pos));
+    header.directory_offset = round_up(pos, V2_ALIGN);
+    out_.write(
+        reinterpret_cast<const char*>(directory_.data()),
+        static_cast<std::streamsize>(directory_.size() * sizeof(CollectionEntry))
+    );
+    out_.seekp(0);
+    out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out_.close();
+    if (!out_) file_error("write", path_, "failure to write directory and header");
+}
+
 } // end namespace pef
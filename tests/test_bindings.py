@@ -1,5 +1,7 @@
 import pef
 import pickle
+import pytest
+import struct
 import numpy as np
 import multiprocessing as mp
 from tempfile import NamedTemporaryFile
@@ -35,6 +37,297 @@ def test_pef():
     assert (np.array(recon) == values).all()
 
 
+def test_builder():
+    values = np.random.randint(0, 1 << 16, size=1 << 12)
+    values.sort()
+    expected = pef.Sequence(values, block_size=64).serialize()
+    builder = pef.SequenceBuilder(block_size=64)
+    for v in values[:100]:
+        builder.push(int(v))
+    builder.push_many(values[100:])
+    assert builder.n_elem == len(values)
+    assert builder.finish().serialize() == expected
+
+    tmp = NamedTemporaryFile(suffix=".pef")
+    builder = pef.SequenceBuilder(tmp.name, max_elem=len(values), block_size=64)
+    builder.push_many(values)
+    builder.close()
+    assert pef.Sequence(tmp.name).serialize() == expected
+    with pytest.raises(RuntimeError):
+        builder = pef.SequenceBuilder()
+        builder.push(2)
+        builder.push(1)
+
+
+def test_optimal():
+    clusters = [
+        np.random.randint(0, 1 << 10, size=500) + (i << 24) for i in range(100)
+    ]
+    values = np.sort(np.concatenate(clusters))
+    seq = pef.Sequence.optimal(values)
+    assert seq.variable_blocks
+    assert (seq.decode() == values).all()
+    assert seq[1234] == values[1234]
+    assert seq.lower_bound(int(values[777])) == np.searchsorted(values, values[777])
+    assert len(seq.serialize()) < len(pef.Sequence(values).serialize())
+    assert (pef.deserialize(seq.serialize()).decode() == values).all()
+
+
+def test_cache():
+    values = np.random.randint(0, 1 << 20, size=1 << 14)
+    values.sort()
+    seq = pef.Sequence(values, block_size=128)
+    seq.enable_cache(capacity_bytes=1 << 16)
+    for i in range(0, 1024):
+        assert seq[i] == values[i]
+    stats = seq.cache_stats()
+    assert stats.misses == 8
+    assert stats.hits == 1024 - 8
+    assert stats.bytes <= stats.capacity_bytes
+    assert values[5000] in seq
+    seq.disable_cache()
+    assert seq.cache_stats().capacity_bytes == 0
+
+
+def test_batched_lookups():
+    values = np.random.randint(0, 1 << 20, size=1 << 14)
+    values.sort()
+    seq = pef.Sequence(values, block_size=128)
+    indices = np.random.randint(0, len(values), size=4096)
+    queries = np.random.randint(0, (1 << 20) + 100, size=4096).astype(np.uint64)
+    for n_threads in (1, 4):
+        assert (seq.get_many(indices, n_threads=n_threads) == values[indices]).all()
+        found = seq.contains_many(queries, n_threads=n_threads)
+        assert found.dtype == np.bool_
+        assert (found == np.isin(queries, values)).all()
+        ranks = seq.rank_many(queries, n_threads=n_threads)
+        assert (ranks == np.searchsorted(values, queries)).all()
+
+
+def test_slice():
+    values = np.random.randint(0, 1 << 16, size=2000)
+    values.sort()
+    seq = pef.Sequence(values, block_size=100)
+    for sl in (slice(None), slice(37, 1234), slice(150, 160), slice(-50, None),
+               slice(10, 1500, 7), slice(None, None, -3), slice(500, 400),
+               slice(3, None, 250), slice(1900, 5, -101)):
+        assert (seq[sl] == values[sl]).all()
+    sub = seq.slice(37, 1234)
+    assert isinstance(sub, pef.Sequence)
+    assert (sub.decode() == values[37:1234]).all()
+    lo, hi = 1000, 30000
+    expected = values[(values >= lo) & (values < hi)]
+    assert (seq.decode_range(lo, hi) == expected).all()
+    assert (seq.range(lo, hi).decode() == expected).all()
+
+
+def test_append_insert():
+    values = np.random.randint(0, 1 << 30, size=5000)
+    values.sort()
+    seq = pef.Sequence(values[:1000], block_size=64)
+    seq.append(values[1000:3000])
+    seq.append(values[3000:])
+    assert seq.serialize() == pef.Sequence(values, block_size=64).serialize()
+    with pytest.raises(RuntimeError):
+        seq.append(np.array([0], dtype=np.uint64))
+
+    extra = np.random.randint(0, 1 << 30, size=300)
+    extra.sort()
+    seq.insert(extra)
+    expected = np.sort(np.concatenate([values, extra]))
+    assert (seq.decode() == expected).all()
+
+    # Changing the Sequence invalidates its Cursors.
+    it = pef.Cursor(seq)
+    seq.append(np.array([1 << 31], dtype=np.uint64))
+    with pytest.raises(RuntimeError):
+        it.next()
+    with pytest.raises(RuntimeError):
+        it.skip_to(1 << 20)
+    assert pef.Cursor(seq).value == expected[0]
+
+    buffered = pef.Sequence(np.array([], dtype=np.uint64), block_size=64)
+    buf = pef.InsertBuffer(buffered, capacity=100)
+    for v in np.random.permutation(values[:250]):
+        buf.insert(int(v))
+    assert len(buf) == 50 and buffered.n_elem == 200
+    buf.flush()
+    assert (buffered.decode() == values[:250]).all()
+
+
+def test_collection():
+    tmp = NamedTemporaryFile(suffix=".pec")
+    lists = {}
+    writer = pef.SequenceCollectionWriter(tmp.name)
+    for term in (2, 7, 100):
+        values = np.random.randint(0, 1 << 20, size=100 * term)
+        values.sort()
+        lists[term] = values
+        if term == 7:
+            builder = writer.build(term, max_elem=len(values), block_size=64)
+            builder.push_many(values)
+        else:
+            writer.add(term, pef.Sequence(values, block_size=128))
+    writer.close()
+    # The builder is finished, but still safe to hold.
+    with pytest.raises(RuntimeError):
+        builder.push(1 << 21)
+    assert builder.n_elem == len(lists[7])
+
+    collection = pef.SequenceCollection(tmp.name)
+    assert len(collection) == 3
+    assert list(collection.terms()) == [2, 7, 100]
+    assert 7 in collection and 8 not in collection
+    for term, values in lists.items():
+        seq = collection[term]
+        assert seq.is_view
+        assert (seq.decode() == values).all()
+    assert collection.entry(1).block_size == 64
+    with pytest.raises(RuntimeError):
+        collection[8]
+
+
+def test_stats():
+    values = np.random.randint(0, 1 << 20, size=1 << 12)
+    values.sort()
+    pef.reset_stats()
+    seq = pef.Sequence(values, block_size=128)
+    for i in range(10):
+        seq[i]
+    seq.decode()
+    stats = pef.stats()
+    if pef.stats_enabled():
+        assert stats.get_calls == 10
+        assert stats.blocks_decoded == seq.n_blocks
+        assert stats.elements_decoded == len(values)
+        assert stats.bytes_encoded > 0
+        # Blocks visited by the Cursors of a set operation count as decoded
+        pef.reset_stats()
+        seq & pef.Sequence(values[::100])
+        assert pef.stats().blocks_decoded > 0
+    else:
+        assert stats.get_calls == 0
+        assert stats.blocks_decoded == 0
+    pef.reset_stats()
+    assert pef.stats().get_calls == 0
+
+
+def test_v2_format():
+    values = np.random.randint(0, 1 << 20, size=1 << 14)
+    values.sort()
+    seq = pef.Sequence(values, block_size=128)
+    tmp = NamedTemporaryFile(suffix=".pef")
+    seq.save(tmp.name, version=2)
+    for seq2 in (pef.Sequence(tmp.name), pef.Sequence.mmap(tmp.name)):
+        assert (seq2.decode() == values).all()
+        assert seq2.serialize() == seq.serialize()
+    assert pef.deserialize(seq.serialize(version=2)).serialize(version=2) == seq.serialize(version=2)
+
+
+def test_mmap():
+    values = np.random.randint(0, 1 << 16, size=1 << 12)
+    values.sort()
+    seq = pef.Sequence(values, block_size=1 << 7)
+    tmp = NamedTemporaryFile(suffix=".pef")
+    seq.save(tmp.name)
+    seq2 = pef.Sequence.mmap(tmp.name)
+    assert seq2.is_view
+    assert not seq.is_view
+    assert seq2.n_elem == seq.n_elem
+    assert (np.array(seq2.decode()) == values).all()
+    assert seq2[100] == values[100]
+    assert values[100] in seq2
+    assert set((seq2 & seq).decode()) == set(values)
+
+
+def test_lower_bound():
+    values = np.random.randint(0, 1 << 12, size=1 << 12)
+    values.sort()
+    seq = pef.Sequence(values, block_size=1 << 7)
+    for q in range(0, (1 << 12) + 2, 7):
+        i = int(np.searchsorted(values, q, side="left"))
+        assert seq.lower_bound(q) == i
+        if i == len(values):
+            assert seq.next_geq(q) is None
+        else:
+            assert seq.next_geq(q) == values[i]
+
+
+def test_rank_prev_leq():
+    values = np.random.randint(5, 1 << 12, size=1 << 12)
+    values.sort()
+    seq = pef.Sequence(values, block_size=1 << 7)
+    for q in range(0, (1 << 12) + 2, 7):
+        assert seq.rank(q) == np.searchsorted(values, q, side="left")
+        i = int(np.searchsorted(values, q, side="right"))
+        if i == 0:
+            assert seq.prev_leq(q) is None
+        else:
+            assert seq.prev_leq(q) == values[i - 1]
+
+
+def test_cursor():
+    values = np.random.randint(0, 1 << 12, size=1 << 10)
+    values.sort()
+    seq = pef.Sequence(values, block_size=1 << 5)
+    it = pef.Cursor(seq)
+    recon = []
+    while not it.at_end:
+        recon.append(it.value)
+        it.next()
+    assert (np.array(recon) == values).all()
+
+    it = pef.Cursor(seq)
+    it.skip_to(1 << 11)
+    i = int(np.searchsorted(values, 1 << 11, side="left"))
+    assert it.index == i
+    assert it.value == values[i]
+
+
+def test_decode_numpy():
+    values = np.random.randint(0, 1 << 16, size=1000)
+    values.sort()
+    seq = pef.Sequence(values, block_size=1 << 7)
+    recon = seq.decode()
+    assert isinstance(recon, np.ndarray)
+    assert recon.dtype == np.uint64
+    assert (recon == values).all()
+    block = seq.decode_block(seq.n_blocks - 1)
+    assert isinstance(block, np.ndarray)
+    assert block.dtype == np.uint64
+    assert (block == values[(seq.n_blocks - 1) * (1 << 7) :]).all()
+    assert len(pef.Sequence([]).decode()) == 0
+
+
+def test_construct_from_numpy():
+    values = np.random.randint(0, 1 << 16, size=1 << 12)
+    values.sort()
+    expected = pef.Sequence(values.tolist(), block_size=64).serialize()
+    for dtype in [np.uint64, np.int64, np.uint32, np.int32]:
+        seq = pef.Sequence(values.astype(dtype), block_size=64)
+        assert seq.serialize() == expected
+    # non-contiguous views are copied into a contiguous buffer first
+    seq = pef.Sequence(np.repeat(values, 2)[::2], block_size=64)
+    assert seq.serialize() == expected
+    seq = pef.Sequence(values, block_size=64, check_sorted=False)
+    assert seq.serialize() == expected
+    with pytest.raises(ValueError):
+        pef.Sequence(np.array([-1, 2, 3], dtype=np.int64))
+    with pytest.raises(RuntimeError):
+        pef.Sequence(np.array([3, 2, 1], dtype=np.uint64))
+
+
+def test_construct_parallel():
+    values = np.random.randint(0, 1 << 24, size=1 << 16)
+    values.sort()
+    expected = pef.Sequence(values, block_size=128).serialize()
+    for n_threads in [2, 4, 1000]:
+        seq = pef.Sequence(values, block_size=128, n_threads=n_threads)
+        assert seq.serialize() == expected
+    seq = pef.Sequence(values.tolist(), block_size=128, n_threads=4)
+    assert seq.serialize() == expected
+
+
 def test_serialization():
     max_value = 1 << 18
     n_elem = 1 << 16
@@ -60,6 +353,74 @@ def test_pickling():
     assert (np.array(seq2.decode()) == values).all()
 
 
+def test_zero_copy_pickling():
+    values = np.unique(np.random.randint(0, 1 << 20, size=1 << 14))
+    seq = pef.Sequence(values, block_size=128)
+    for protocol in range(2, pickle.HIGHEST_PROTOCOL + 1):
+        assert (pickle.loads(pickle.dumps(seq, protocol=protocol)).decode() == values).all()
+
+    # Protocol 5 passes the serialized Sequence out of band, and loads
+    # views it in place.
+    buffers = []
+    data = pickle.dumps(seq, protocol=5, buffer_callback=buffers.append)
+    assert len(buffers) == 1
+    seq2 = pickle.loads(data, buffers=buffers)
+    assert seq2.is_view
+    assert (seq2.decode() == values).all()
+
+    # The buffer protocol exposes the serialized Sequence; a view exposes
+    # the buffer it views.
+    assert bytes(memoryview(seq)) == seq.serialize()
+    assert memoryview(seq).readonly
+    serialized = seq.serialize()
+    view = pef.from_buffer(serialized)
+    assert view.is_view
+    assert (view.decode() == values).all()
+    assert bytes(memoryview(view)) == serialized
+    with pytest.raises(TypeError):
+        memoryview(view)[0] = 0
+    view2 = pef.from_buffer(np.frombuffer(seq.serialize(version=2), dtype=np.uint8))
+    assert view2.is_view and (view2.decode() == values).all()
+    with pytest.raises(ValueError):
+        pef.from_buffer(np.frombuffer(serialized * 2, dtype=np.uint8)[::2])
+
+    # Writable buffers are copied, so changing them later is harmless.
+    writable = bytearray(serialized)
+    copy = pef.from_buffer(writable)
+    assert not copy.is_view
+    writable[:] = bytes(len(writable))
+    assert (copy.decode() == values).all()
+
+    # An exported buffer outlives the view's switch to owned storage.
+    exported = memoryview(view)
+    view.append(np.array([values[-1] + 1], dtype=np.uint64))
+    assert not view.is_view
+    assert bytes(exported) == serialized
+
+
+def test_unpickle_corrupt_header():
+    values = np.unique(np.random.randint(0, 1 << 20, size=1 << 12))
+    seq = pef.Sequence(values, block_size=128)
+    serialized = seq.serialize()
+    n_blocks = seq.n_blocks
+    # n_blocks sits 24 bytes into the header, and the version 1 block
+    # offsets follow the block maxima.
+    huge = bytearray(serialized)
+    struct.pack_into("<Q", huge, 24, 1 << 61)
+    swapped = bytearray(serialized)
+    offs = 40 + 8 * n_blocks
+    swapped[offs:offs + 16] = serialized[offs + 8:offs + 16] + serialized[offs:offs + 8]
+    in_band = pickle.dumps(seq, protocol=4)
+    assert serialized in in_band
+    for corrupt in (bytes(huge), bytes(swapped)):
+        with pytest.raises(RuntimeError):
+            pickle.loads(in_band.replace(serialized, corrupt))
+        buffers = []
+        data = pickle.dumps(seq, protocol=5, buffer_callback=buffers.append)
+        with pytest.raises(RuntimeError):
+            pickle.loads(data, buffers=[corrupt])
+
+
 def test_empty():
     """Stability test."""
     seq = pef.Sequence([])
@@ -93,6 +454,166 @@ def test_union():
     assert set(seq2.decode()) == expected
 
 
+def test_set_operations_parallel():
+    values_0 = np.random.randint(0, 1 << 16, size=(1 << 16))
+    values_1 = np.random.randint(0, 1 << 16, size=(1 << 14))
+    values_0.sort()
+    values_1.sort()
+    seq0 = pef.Sequence(values_0)
+    seq1 = pef.Sequence(values_1)
+    for n_threads in [1, 2, 7]:
+        assert seq0.intersect(seq1, n_threads=n_threads).serialize() == (seq0 & seq1).serialize()
+        # union and difference hold the same values, but may be blocked differently
+        assert (seq0.union(seq1, n_threads=n_threads).decode() == (seq0 | seq1).decode()).all()
+        assert (seq0.difference(seq1, n_threads=n_threads).decode() == (seq0 - seq1).decode()).all()
+
+
+def test_concurrent_reads():
+    from concurrent.futures import ThreadPoolExecutor
+    values = np.random.randint(0, 1 << 30, size=1 << 18)
+    values.sort()
+    other_values = np.random.randint(0, 1 << 30, size=1 << 14)
+    other_values.sort()
+    seq = pef.Sequence(values, block_size=128)
+    other = pef.Sequence(other_values)
+    expected = (seq.serialize(), (seq & other).serialize(), (seq | other).decode(),
+                (seq - other).decode(), seq.unique().serialize())
+
+    def read(_):
+        return (seq.serialize(), (seq & other).serialize(), (seq | other).decode(),
+                (seq - other).decode(), seq.unique().serialize(), seq.decode())
+
+    with ThreadPoolExecutor(max_workers=8) as pool:
+        for result in pool.map(read, range(16)):
+            assert result[0] == expected[0] and result[1] == expected[1]
+            assert (result[2] == expected[2]).all() and (result[3] == expected[3]).all()
+            assert result[4] == expected[4]
+            assert (result[5] == values).all()
+
+
+def test_concurrent_reads_and_writes():
+    from concurrent.futures import ThreadPoolExecutor
+    values = np.unique(np.random.randint(0, 1 << 30, size=1 << 17)).astype(np.uint64)
+    chunks = np.array_split(values, 64)
+    seq = pef.Sequence(chunks[0], block_size=64)
+    other = pef.Sequence(values[::3])
+    # Every read sees the Sequence between two appends.
+    sizes = set(np.cumsum([len(c) for c in chunks]).tolist())
+
+    def write():
+        for k, chunk in enumerate(chunks[1:]):
+            seq.append(chunk)
+            if k % 8 == 0:
+                seq.enable_cache(1 << 16)
+            elif k % 8 == 4:
+                seq.disable_cache()
+
+    def read(_):
+        for _ in range(20):
+            decoded = seq.decode()
+            assert len(decoded) in sizes and (decoded == values[:len(decoded)]).all()
+            copy = pef.deserialize(seq.serialize()).decode()
+            assert len(copy) in sizes and (copy == values[:len(copy)]).all()
+            both = (seq & other).decode()
+            assert (both == values[::3][:len(both)]).all()
+
+    with ThreadPoolExecutor(max_workers=5) as pool:
+        writer = pool.submit(write)
+        list(pool.map(read, range(4)))
+        writer.result()
+    assert (seq.decode() == values).all()
+
+
+def test_concurrent_decode_and_append():
+    from concurrent.futures import ThreadPoolExecutor
+    values = np.unique(np.random.randint(0, 1 << 30, size=1 << 15)).astype(np.uint64)
+    # Small appends keep changing the size of the last block.
+    chunks = np.array_split(values, 1000)
+    seq = pef.Sequence(chunks[0], block_size=128)
+
+    def write():
+        for chunk in chunks[1:]:
+            seq.append(chunk)
+
+    def read(_):
+        for _ in range(200):
+            decoded = seq.decode()
+            assert (decoded == values[:len(decoded)]).all()
+            last = seq.decode_block(seq.n_blocks - 1)
+            assert len(last) > 0 and last[-1] in values
+            tail = seq[-300:]
+            assert (np.diff(tail.astype(np.int64)) > 0).all()
+            strided = seq[::200]
+            assert (strided == values[::200][:len(strided)]).all()
+
+    with ThreadPoolExecutor(max_workers=5) as pool:
+        writer = pool.submit(write)
+        list(pool.map(read, range(4)))
+        writer.result()
+    assert (seq.decode() == values).all()
+
+
+def test_file_operations():
+    values_0 = np.random.randint(0, 1 << 12, size=(1 << 14))
+    values_1 = np.random.randint(0, 1 << 12, size=(1 << 10))
+    values_0.sort()
+    values_1.sort()
+    seq0 = pef.Sequence(values_0)
+    seq1 = pef.Sequence(values_1)
+    tmp0 = NamedTemporaryFile(suffix=".pef")
+    tmp1 = NamedTemporaryFile(suffix=".pef")
+    out = NamedTemporaryFile(suffix=".pef")
+    seq0.save(tmp0.name)
+    seq1.save(tmp1.name)
+    pef.intersect_files(tmp0.name, tmp1.name, out.name)
+    assert pef.Sequence(out.name).serialize() == (seq0 & seq1).serialize()
+    pef.union_files(tmp0.name, tmp1.name, out.name)
+    assert pef.Sequence(out.name).serialize() == (seq0 | seq1).serialize()
+    pef.difference_files(tmp0.name, tmp1.name, out.name)
+    assert pef.Sequence(out.name).serialize() == (seq0 - seq1).serialize()
+    pef.unique_file(tmp0.name, out.name)
+    assert pef.Sequence(out.name).serialize() == seq0.unique().serialize()
+    pef.filter_by_count_file(tmp0.name, out.name, min_count=3)
+    assert pef.Sequence(out.name).serialize() == seq0.filter_by_count(min_count=3).serialize()
+
+    # Writing over an input is refused, and leaves the input intact
+    with pytest.raises(RuntimeError):
+        pef.intersect_files(tmp0.name, tmp1.name, tmp1.name)
+    with pytest.raises(RuntimeError):
+        pef.unique_file(tmp0.name, tmp0.name)
+    assert pef.Sequence(tmp0.name).serialize() == seq0.serialize()
+    assert pef.Sequence(tmp1.name).serialize() == seq1.serialize()
+
+
+def test_counts():
+    values_0 = np.random.randint(0, 1 << 16, size=(1 << 14))
+    values_1 = np.random.randint(0, 1 << 16, size=(1 << 10))
+    values_0.sort()
+    values_1.sort()
+    seq0 = pef.Sequence(values_0).unique()
+    seq1 = pef.Sequence(values_1).unique()
+    set0, set1 = set(seq0.decode()), set(seq1.decode())
+    assert seq0.intersect_count(seq1) == len(set0 & set1)
+    assert seq0.union_count(seq1) == len(set0 | set1)
+    assert seq0.difference_count(seq1) == len(set0 - set1)
+    assert seq0.intersects(seq1) == (len(set0 & set1) > 0)
+
+
+def test_intersect_and_union_many():
+    seqs = []
+    for size in [1 << 14, 1 << 10, 1 << 12]:
+        values = np.random.randint(0, 1 << 14, size=size)
+        values.sort()
+        seqs.append(pef.Sequence(values))
+    expected_and = set(seqs[0].decode())
+    expected_or = set(seqs[0].decode())
+    for seq in seqs[1:]:
+        expected_and &= set(seq.decode())
+        expected_or |= set(seq.decode())
+    assert set(pef.intersect_many(seqs).decode()) == expected_and
+    assert set(pef.union_many(seqs).decode()) == expected_or
+
+
 def test_difference():
     values_0 = np.random.randint(0, 1 << 16, size=(1 << 16))
     values_1 = np.random.randint(0, 1 << 16, size=(1 << 16))
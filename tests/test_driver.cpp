@@ -1,5 +1,6 @@
 #include <filesystem>
 #include <iostream>
+#include <iterator>
 #include <random>
 #include <cassert>
 #include <cstdio>
@@ -28,6 +29,37 @@ std::vector<uint64_t> random_sorted_integers(
     return o;
 }
 
+// Generate *n_clusters* runs of *cluster_size* sorted integers, each run
+// dense within its own short range, with large random gaps between them.
+std::vector<uint64_t> clustered_integers(
+    size_t n_clusters,
+    size_t cluster_size
+) {
+    std::mt19937 gen(rd());
+    std::uniform_int_distribution<uint64_t> gap(1, 1<<20),
+                                            span(cluster_size, 4 * cluster_size);
+    std::vector<uint64_t> o;
+    uint64_t floor = 0;
+    for (size_t c = 0; c < n_clusters; ++c) {
+        floor += gap(gen);
+        const uint64_t width = span(gen);
+        for (const uint64_t v: random_sorted_integers(cluster_size, width)) {
+            o.push_back(floor + v);
+        }
+        floor += width;
+    }
+    return o;
+}
+
+// Words in an Elias-Fano encoding of *values* (see EFBlock::EFBlock).
+uint64_t ef_words_for_test(const std::vector<uint64_t>& values) {
+    const uint64_t n = values.size(),
+                   range = values.back() - values.front() + 1;
+    uint64_t l = 0;
+    while ((range / n) >> (l + 1)) ++l;
+    return (n * l + 63) / 64 + (n + ((range + (1ULL << l) - 1) >> l) + 63) / 64;
+}
+
 // Deleted at end of scope.
 struct NamedTemporaryFile {
     const std::string path;
@@ -144,6 +176,18 @@ void test_efblock() {
     }
 }
 
+// Decode blocks spanning every low bit width that the encoder picks.
+void test_efblock_decode_all_widths() {
+    const size_t n = 200;
+    for (unsigned shift = 0; shift < 56; ++shift) {
+        const std::vector<uint64_t> values = random_sorted_integers(n, (uint64_t)n << shift);
+        EFBlock blk(values.data(), values.size());
+        assert (blk.decode() == values);
+        const Sequence seq(values, 64);
+        assert (seq.decode() == values);
+    }
+}
+
 // Edge case: a single integer.
 void test_efblock_size_one() {
     const size_t n = 1;
@@ -174,6 +218,325 @@ void test_efblock_size_one() {
     }
 }
 
+// EFBlockView::get reads single elements out of a serialized EFBlock.
+void test_efblock_view_get() {
+    // dense with duplicates (l = 0), moderate, and very sparse (large l)
+    const uint64_t max_values[] = {1ULL<<4, 1ULL<<12, 1ULL<<40};
+    for (const uint64_t max_value: max_values) {
+        const std::vector<uint64_t> values = random_sorted_integers(300, max_value);
+        EFBlock blk(values.data(), values.size());
+        const std::string serialized = blk.serialize();
+        std::vector<uint64_t> buf((serialized.size() + 7) / 8);
+        std::memcpy(buf.data(), serialized.data(), serialized.size());
+        EFBlockView view(reinterpret_cast<const uint8_t*>(buf.data()));
+        assert (view.meta.n_elem == blk.meta.n_elem);
+        assert (view.meta.l == blk.meta.l);
+        for (uint32_t i = 0; i < values.size(); ++i) {
+            assert (view.get(i) == values.at(i));
+        }
+    }
+}
+
+// Dense blocks of distinct values should switch to bitmaps, and runs of
+// consecutive values to run blocks, and read back the same either way.
+void test_efblock_encodings() {
+    std::mt19937 gen(rd());
+    std::vector<uint64_t> run(200), bitmap, ef = random_sorted_integers(200, 1<<20);
+    for (size_t i = 0; i < run.size(); ++i) run[i] = 1000 + i;
+    for (uint64_t v = 5000; bitmap.size() < 200; ++v) {
+        if (gen() % 4 != 0) bitmap.push_back(v);
+    }
+    std::vector<uint64_t> dense_repeats = random_sorted_integers(200, 64);
+    const std::vector<uint64_t>* inputs[] = {&run, &bitmap, &ef, &dense_repeats};
+    const BlockEncoding expected[] = {BLOCK_RUN, BLOCK_BITMAP, BLOCK_EF, BLOCK_EF};
+    for (size_t k = 0; k < 4; ++k) {
+        const std::vector<uint64_t>& values = *inputs[k];
+        EFBlock blk(values.data(), values.size());
+        assert (blk.meta.encoding == expected[k]);
+        assert (blk.decode() == values);
+        assert (EFBlock::encoded_size(values.data(), values.size()) == blk.serialize().size());
+
+        const std::string serialized = blk.serialize();
+        std::vector<uint64_t> buf((serialized.size() + 7) / 8);
+        std::memcpy(buf.data(), serialized.data(), serialized.size());
+        EFBlockView view(reinterpret_cast<const uint8_t*>(buf.data()));
+        std::vector<uint64_t> recon(values.size());
+        view.decode(recon.data());
+        assert (recon == values);
+        for (uint32_t i = 0; i < values.size(); ++i) {
+            assert (view.get(i) == values.at(i));
+        }
+        const uint64_t q_min = (values.front() < 3) ? 0 : values.front() - 3;
+        for (uint64_t q = q_min; q <= values.back() + 3; q += 1 + q % 5) {
+            uint64_t value = 0;
+            const uint32_t i = view.lower_bound(q, value);
+            const uint64_t expected_i = std::lower_bound(values.begin(), values.end(), q) - values.begin();
+            assert (i == expected_i);
+            if (i < values.size()) assert (value == values.at(i));
+        }
+    }
+    assert (EFBlock(run.data(), run.size()).serialize().size() == sizeof(EFBlockMetadata));
+    assert (EFBlock(bitmap.data(), bitmap.size()).serialize().size()
+        < sizeof(EFBlockMetadata) + 8 * ef_words_for_test(bitmap));
+
+    // A Sequence mixing all three encodings
+    std::vector<uint64_t> values;
+    uint64_t floor = 0;
+    for (size_t c = 0; c < 40; ++c) {
+        const std::vector<uint64_t>* part = inputs[c % 3];
+        for (const uint64_t v: *part) values.push_back(floor + v - part->front());
+        floor = values.back() + 1 + gen() % 1000;
+    }
+    const Sequence seq(values, 200);
+    assert (seq.decode() == values);
+    for (size_t i = 0; i < values.size(); i += 7) {
+        assert (seq.get(i) == values.at(i));
+        assert (seq.contains(values.at(i)));
+        assert (seq.lower_bound(values.at(i)) == (uint64_t)(
+            std::lower_bound(values.begin(), values.end(), values.at(i)) - values.begin()
+        ));
+    }
+    Sequence::Cursor it(seq);
+    for (uint64_t x = 0; !it.at_end(); x += 1 + gen() % 300) {
+        it.skip_to(x);
+        const uint64_t expected_i = std::lower_bound(values.begin(), values.end(), x) - values.begin();
+        assert (it.index() == expected_i);
+        if (!it.at_end()) assert (it.value() == values.at(expected_i));
+    }
+    const std::vector<uint64_t> other = random_sorted_integers(5000, values.back());
+    const Sequence other_seq(other, 64);
+    std::vector<uint64_t> expected_and, expected_or, expected_sub;
+    std::set_intersection(values.begin(), values.end(), other.begin(), other.end(), std::back_inserter(expected_and));
+    std::set_union(values.begin(), values.end(), other.begin(), other.end(), std::back_inserter(expected_or));
+    std::set_difference(values.begin(), values.end(), other.begin(), other.end(), std::back_inserter(expected_sub));
+    assert (seq.intersect(other_seq).decode() == expected_and);
+    assert (other_seq.intersect(seq).decode() == expected_and);
+    assert ((seq | other_seq).decode() == expected_or);
+    assert ((seq - other_seq).decode() == expected_sub);
+
+    // Blocks spanning almost the whole 64-bit range, and dense blocks next
+    // to it.
+    std::vector<uint64_t> spread(100), top;
+    for (size_t i = 0; i < spread.size(); ++i) spread[i] = i * (UINT64_MAX / 100);
+    spread.back() = UINT64_MAX - 1;
+    for (uint64_t v = UINT64_MAX - 1000; v < UINT64_MAX; ++v) {
+        if (gen() % 4 != 0) top.push_back(v);
+    }
+    const std::vector<uint64_t> extremes[] = {{0, UINT64_MAX - 1}, spread, top};
+    for (const std::vector<uint64_t>& values: extremes) {
+        EFBlock blk(values.data(), values.size());
+        assert (blk.decode() == values);
+        assert (EFBlock::encoded_size(values.data(), values.size()) == blk.serialize().size());
+        for (const uint32_t block_size: {2u, 64u, 256u}) {
+            const Sequence seq(values, block_size);
+            assert (seq.decode() == values);
+            for (size_t i = 0; i < values.size(); ++i) {
+                assert (seq.get(i) == values.at(i));
+                assert (seq.contains(values.at(i)));
+            }
+        }
+    }
+}
+
+void test_sequence_cache() {
+    const std::vector<uint64_t> values = random_sorted_integers(20000, 1<<20);
+    Sequence seq(values, 100);
+    assert (seq.cache_stats().hits == 0 && seq.cache_stats().capacity_bytes == 0);
+
+    // Room for about 10 blocks over 2 shards
+    seq.enable_cache(10 * 100 * sizeof(uint64_t), 2);
+    for (size_t i = 0; i < 1000; ++i) {
+        assert (seq.get(i) == values.at(i));
+    }
+    BlockCacheStats stats = seq.cache_stats();
+    assert (stats.misses == 10);
+    assert (stats.hits == 990);
+    assert (stats.bytes <= stats.capacity_bytes);
+
+    // Searches and block decoding go through the cache, too
+    for (size_t i = 0; i < values.size(); i += 13) {
+        assert (seq.contains(values.at(i)));
+        assert (seq.lower_bound(values.at(i)) == (uint64_t)(
+            std::lower_bound(values.begin(), values.end(), values.at(i)) - values.begin()
+        ));
+        assert (seq.next_geq(values.at(i) + 1) == *std::upper_bound(values.begin(), values.end(), values.at(i)));
+    }
+    assert (seq.decode_block(7) == std::vector<uint64_t>(values.begin() + 700, values.begin() + 800));
+    assert (seq.decode() == values);
+    stats = seq.cache_stats();
+    assert (stats.hits > 990 && stats.misses > 10);
+    assert (stats.bytes <= stats.capacity_bytes);
+
+    // Concurrent readers share the cache
+    std::vector<std::thread> readers;
+    std::atomic<bool> ok(true);
+    for (unsigned t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t]() {
+            std::mt19937 gen(t);
+            for (size_t k = 0; k < 20000; ++k) {
+                const size_t i = gen() % values.size();
+                if (seq.get(i) != values.at(i)) ok = false;
+            }
+        });
+    }
+    for (auto& r: readers) r.join();
+    assert (ok);
+
+    // Copies don't share the cache
+    const Sequence copy(seq);
+    assert (copy.cache_stats().capacity_bytes == 0);
+    assert (copy.get(123) == values.at(123));
+    seq.disable_cache();
+    assert (seq.cache_stats().capacity_bytes == 0);
+    assert (seq.get(456) == values.at(456));
+}
+
+void test_sequence_batched_lookups() {
+    const std::vector<uint64_t> values = random_sorted_integers(50000, 1<<20);
+    std::mt19937 gen(7);
+    for (const bool optimal: {false, true}) {
+        const Sequence seq = optimal ? Sequence::optimal(values, 512) : Sequence(values, 100);
+        std::vector<uint64_t> indices(20000), queries(20000);
+        for (uint64_t& i: indices) i = gen() % values.size();
+        for (uint64_t& q: queries) q = gen() % ((1<<20) + 100);
+        std::vector<uint64_t> sorted_queries(queries);
+        std::sort(sorted_queries.begin(), sorted_queries.end());
+        for (const unsigned n_threads: {1u, 4u}) {
+            std::vector<uint64_t> got(indices.size());
+            seq.get_many(indices.data(), indices.size(), got.data(), n_threads);
+            for (size_t k = 0; k < indices.size(); ++k) {
+                assert (got.at(k) == values.at(indices.at(k)));
+            }
+            for (const std::vector<uint64_t>* qs: {&queries, &sorted_queries}) {
+                std::unique_ptr<bool[]> found(new bool[qs->size()]);
+                std::vector<uint64_t> ranks(qs->size());
+                seq.contains_many(qs->data(), qs->size(), found.get(), n_threads);
+                seq.rank_many(qs->data(), qs->size(), ranks.data(), n_threads);
+                for (size_t k = 0; k < qs->size(); ++k) {
+                    assert (found[k] == seq.contains(qs->at(k)));
+                    assert (ranks.at(k) == seq.lower_bound(qs->at(k)));
+                }
+            }
+        }
+    }
+
+    // Out-of-bounds indices throw before anything is written
+    const Sequence seq(values, 100);
+    const uint64_t bad[2] = {0, values.size()};
+    uint64_t out[2] = {0, 0};
+    bool threw = false;
+    try {
+        seq.get_many(bad, 2, out, 1);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw && out[0] == 0);
+
+    // Empty sequences
+    const Sequence empty(std::vector<uint64_t>{});
+    const uint64_t q[2] = {0, 5};
+    bool found[2] = {true, true};
+    uint64_t ranks[2] = {1, 1};
+    empty.contains_many(q, 2, found, 1);
+    empty.rank_many(q, 2, ranks, 1);
+    assert (!found[0] && !found[1] && ranks[0] == 0 && ranks[1] == 0);
+}
+
+void test_sequence_skip_index() {
+    // Enough blocks for the two-level index, with its last group partial
+    const std::vector<uint64_t> values = random_sorted_integers(16 * (SKIP_MIN_BLOCKS + 100), 1ULL<<30);
+    const Sequence seq(values, 16);
+    assert (seq.n_blocks() >= SKIP_MIN_BLOCKS);
+
+    // The upper level finds the first group whose highest element is >= q
+    std::vector<uint64_t> block_last(seq.n_blocks());
+    for (uint64_t bi = 0; bi < seq.n_blocks(); ++bi) block_last[bi] = seq.decode_block(bi).back();
+    const BlockSkipIndex skip(block_last.data(), block_last.size());
+    assert (skip.n_groups() == (block_last.size() + SKIP_SAMPLE - 1) / SKIP_SAMPLE);
+    for (uint64_t g = 0; g < skip.n_groups(); ++g) {
+        const uint64_t key = block_last.at(std::min<uint64_t>((g + 1) * SKIP_SAMPLE, block_last.size()) - 1);
+        assert (skip.lower_bound(key) == g);
+        assert (skip.lower_bound(key + 1) == g + 1);
+    }
+    assert (skip.lower_bound(0) == 0);
+
+    // Searches through it agree with the plain ones, from several threads
+    // racing to build it
+    std::vector<std::thread> readers;
+    std::atomic<bool> ok(true);
+    for (unsigned t = 0; t < 4; ++t) {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 gen(t);
+            for (size_t k = 0; k < 5000; ++k) {
+                const uint64_t q = gen() % (1ULL<<30);
+                const auto it = std::lower_bound(values.begin(), values.end(), q);
+                if (seq.lower_bound(q) != (uint64_t)(it - values.begin())) ok = false;
+                if (seq.contains(q) != (it != values.end() && *it == q)) ok = false;
+                if (it != values.end() && seq.next_geq(q) != *it) ok = false;
+                const uint64_t v = values.at(gen() % values.size());
+                if (!seq.contains(v) || seq.prev_leq(v) != v) ok = false;
+            }
+        });
+    }
+    for (auto& r: readers) r.join();
+    assert (ok);
+
+    // Cursors take long jumps through it too
+    std::vector<uint64_t> sparse;
+    for (size_t i = 0; i < values.size(); i += 9973) sparse.push_back(values.at(i) + (i % 2));
+    const Sequence sparse_seq(sparse, 16);
+    std::vector<uint64_t> expected;
+    std::set_intersection(
+        values.begin(), values.end(), sparse.begin(), sparse.end(), std::back_inserter(expected)
+    );
+    assert (seq.intersect(sparse_seq).decode() == expected);
+    assert (sparse_seq.intersect(seq).decode() == expected);
+
+    // Copies and moves of an indexed Sequence search correctly
+    const Sequence copy(seq);
+    assert (copy.lower_bound(values.at(12345)) == seq.lower_bound(values.at(12345)));
+    Sequence src(values, 16);
+    src.contains(values.at(99));
+    const Sequence moved(std::move(src));
+    assert (moved.contains(values.at(54321)));
+}
+
+void test_stats() {
+    const std::vector<uint64_t> values = random_sorted_integers(10000, 1<<24);
+    reset_stats();
+    const Sequence seq(values, 100);
+    const Sequence sparse(std::vector<uint64_t>{values.at(5), values.at(5000), values.at(9999)}, 100);
+    for (uint64_t i = 0; i < 10; ++i) seq.get(i);
+    seq.contains(values.at(77));
+    seq.contains(3);
+    assert (seq.decode() == values);
+    const Stats before = stats();
+    seq.intersect(sparse);
+    const Stats after = stats();
+    if (!stats_enabled()) {
+        assert (after.blocks_decoded == 0 && after.elements_decoded == 0);
+        assert (after.blocks_skipped == 0 && after.bytes_encoded == 0);
+        assert (after.get_calls == 0 && after.contains_calls == 0);
+        return;
+    }
+    assert (before.get_calls == 10);
+    assert (before.contains_calls == 2);
+    assert (before.blocks_decoded == seq.n_blocks());
+    assert (before.elements_decoded == values.size());
+    // every byte of both payloads
+    const size_t payload_bytes = seq.serialize().size() - seq.get_meta().payload_offset
+        + sparse.serialize().size() - sparse.get_meta().payload_offset;
+    assert (before.bytes_encoded == payload_bytes);
+    // The intersection skips straight past all but 3 of the blocks
+    assert (after.blocks_skipped >= seq.n_blocks() - 3);
+    assert (before.blocks_skipped == 0);
+    // The blocks it did stop at count as decoded
+    assert (after.blocks_decoded > before.blocks_decoded);
+    assert (after.elements_decoded > before.elements_decoded);
+    reset_stats();
+    assert (stats().get_calls == 0 && stats().blocks_decoded == 0);
+}
+
 void test_sequence_get() {
     // 1024 integers from 0 to 4096: can be represented in 7 bits
     const size_t n = 1<<10;
@@ -210,6 +573,138 @@ void test_sequence_contains() {
     }
 }
 
+void test_sequence_lower_bound() {
+    // sparse, and dense with many duplicates spanning block boundaries
+    const uint64_t max_values[] = {1ULL<<20, 1ULL<<6};
+    for (const uint64_t max_value: max_values) {
+        const std::vector<uint64_t> values = random_sorted_integers(1000, max_value);
+        const Sequence seq(values, 64);
+        for (uint64_t q = 0; q < max_value + 2; q += 1 + max_value / 5000) {
+            const uint64_t expected = std::lower_bound(
+                values.begin(), values.end(), q
+            ) - values.begin();
+            assert (seq.lower_bound(q) == expected);
+            if (expected == values.size()) {
+                assert (seq.next_geq(q) == UINT64_MAX);
+            } else {
+                assert (seq.next_geq(q) == values.at(expected));
+            }
+        }
+        // every element is found at its first occurrence
+        for (const uint64_t v: values) {
+            const uint64_t i = seq.lower_bound(v);
+            assert (seq.get(i) == v);
+            assert (i == 0 || seq.get(i - 1) < v);
+        }
+    }
+    const Sequence empty(std::vector<uint64_t>{});
+    assert (empty.lower_bound(5) == 0);
+    assert (empty.next_geq(5) == UINT64_MAX);
+}
+
+void test_sequence_rank_prev_leq() {
+    // sparse and dense, over the EF, bitmap and run encodings, with and
+    // without a cache
+    const uint64_t max_values[] = {1ULL<<20, 1ULL<<6, 1ULL<<10};
+    for (const uint64_t max_value: max_values) {
+        std::vector<uint64_t> values = random_sorted_integers(1000, max_value);
+        if (max_value == 1ULL<<10) {
+            values.erase(std::unique(values.begin(), values.end()), values.end());
+        }
+        values.push_back(2 * max_value); // gap before the last block
+        for (const bool cached: {false, true}) {
+            Sequence seq(values, 64);
+            if (cached) seq.enable_cache(1<<16);
+            for (uint64_t q = 0; q < 2 * max_value + 2; q += 1 + max_value / 3000) {
+                const auto it = std::upper_bound(values.begin(), values.end(), q);
+                const uint64_t expected = it == values.begin() ? UINT64_MAX : *(it - 1);
+                assert (seq.prev_leq(q) == expected);
+                assert (seq.rank(q) == (uint64_t)(
+                    std::lower_bound(values.begin(), values.end(), q) - values.begin()
+                ));
+            }
+            assert (seq.prev_leq(UINT64_MAX) == values.back());
+            assert (seq.rank(UINT64_MAX) == values.size());
+        }
+    }
+    const Sequence empty(std::vector<uint64_t>{});
+    assert (empty.rank(5) == 0);
+    assert (empty.prev_leq(5) == UINT64_MAX);
+}
+
+void test_sequence_cursor() {
+    const std::vector<uint64_t> values = random_sorted_integers(1333, 1<<11);
+    const Sequence seq(values, 100);
+
+    // Walk the whole Sequence
+    std::vector<uint64_t> recon;
+    for (Sequence::Cursor it(seq); !it.at_end(); it.next()) {
+        assert (it.index() == recon.size());
+        recon.push_back(it.value());
+    }
+    assert (recon == values);
+
+    // skip_to lands on the first element >= x, and never moves backward
+    Sequence::Cursor it(seq);
+    for (uint64_t x = 0; x < (1<<11) + 10; x += 37) {
+        it.skip_to(x);
+        const uint64_t expected = std::lower_bound(
+            values.begin(), values.end(), x
+        ) - values.begin();
+        assert (it.index() == expected);
+        if (it.at_end()) {
+            assert (expected == values.size());
+            break;
+        }
+        assert (it.value() == values.at(expected));
+        it.skip_to(0);
+        assert (it.index() == expected);
+    }
+
+    // Sparse values, so that skip_to jumps between high-bit buckets
+    const std::vector<uint64_t> sparse = random_sorted_integers(5000, 1ULL<<30);
+    const Sequence sparse_seq(sparse, 128);
+    Sequence::Cursor it_sparse(sparse_seq);
+    uint64_t prev = 0;
+    for (size_t i = 0; i < sparse.size(); i += 1 + i % 97) {
+        const uint64_t x = sparse.at(i) - (i % 3);
+        it_sparse.skip_to(x);
+        const uint64_t expected = std::max<uint64_t>(prev, std::lower_bound(
+            sparse.begin(), sparse.end(), x
+        ) - sparse.begin());
+        assert (it_sparse.index() == expected);
+        assert (it_sparse.value() == sparse.at(expected));
+        prev = expected;
+    }
+
+    // Empty Sequence
+    const Sequence empty(std::vector<uint64_t>{});
+    Sequence::Cursor it_empty(empty);
+    assert (it_empty.at_end());
+    it_empty.skip_to(10);
+    assert (it_empty.at_end());
+
+    // Cursors over a range of indices stop at the end of the range
+    for (uint64_t begin: {0, 1, 99, 100, 101, 700, 1333}) {
+        for (uint64_t end: {begin, begin + 1, begin + 250, (uint64_t)2000}) {
+            recon.clear();
+            Sequence::Cursor it_range(seq, begin, end);
+            for (; !it_range.at_end(); it_range.next()) {
+                assert (it_range.index() == begin + recon.size());
+                recon.push_back(it_range.value());
+            }
+            const uint64_t stop = std::min<uint64_t>(end, values.size());
+            assert (recon == std::vector<uint64_t>(
+                values.begin() + std::min<uint64_t>(begin, stop),
+                values.begin() + stop
+            ));
+        }
+    }
+    Sequence::Cursor it_range(seq, 200, 300);
+    it_range.skip_to(values.at(299) + 1);
+    assert (it_range.at_end());
+}
+
 void test_pef_construct_from_sequence() {
     const size_t n = 1<<10;
     const uint64_t max_value = 1<<12;
@@ -297,6 +792,162 @@ void test_pef_construct_from_sequence_ragged() {
     }
 }
 
+void test_sequence_decode_into() {
+    const std::vector<uint64_t> values = random_sorted_integers(1333, 1<<20);
+    const Sequence seq(values, 256);
+
+    std::vector<uint64_t> out(values.size() + 5, UINT64_MAX);
+    assert (seq.decode_into(out.data(), out.size()) == values.size());
+    assert (std::equal(values.begin(), values.end(), out.begin()));
+    assert (out.back() == UINT64_MAX);
+
+    // the last block is short
+    assert (seq.block_n_elem(0) == 256);
+    assert (seq.block_n_elem(5) == 1333 - 1280);
+    uint64_t block[256];
+    assert (seq.decode_block_into(5, block, 256) == 53);
+    assert (std::equal(block, block + 53, values.begin() + 1280));
+
+    // buffers that are too small are rejected
+    bool threw = false;
+    try {
+        seq.decode_into(out.data(), values.size() - 1);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+    threw = false;
+    try {
+        seq.decode_block_into(0, block, 255);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+}
+
+void test_sequence_slice() {
+    const std::vector<uint64_t> values = random_sorted_integers(2000, 1<<16);
+    const Sequence fixed(values, 100);
+    const Sequence variable = Sequence::optimal(values, 256);
+    const std::pair<uint64_t, uint64_t> cuts[] = {
+        {0, 2000}, {0, 0}, {500, 500}, {100, 700}, {0, 1950}, {37, 1999},
+        {150, 160}, {1999, 2000}, {1, 2000}
+    };
+    for (const Sequence* seq: {&fixed, &variable}) {
+        for (const auto& cut: cuts) {
+            const std::vector<uint64_t> expected(
+                values.begin() + cut.first, values.begin() + cut.second
+            );
+            assert (seq->decode_slice(cut.first, cut.second) == expected);
+            const Sequence sub = seq->slice(cut.first, cut.second);
+            assert (sub.n_elem() == expected.size());
+            assert (sub.decode() == expected);
+            for (size_t k = 0; k < expected.size(); k += 7) {
+                assert (sub.get(k) == expected.at(k));
+                assert (sub.contains(expected.at(k)));
+            }
+            // and survives a round trip
+            std::istringstream in(sub.serialize());
+            assert (Sequence(in).decode() == expected);
+        }
+    }
+    // Slices on block boundaries of fixed-size Sequences keep fixed-size
+    // blocks, and copy their interior blocks verbatim
+    const Sequence aligned = fixed.slice(300, 777);
+    assert (!aligned.variable_blocks());
+    assert (aligned.n_blocks() == 5);
+    assert (aligned.serialize() == Sequence(
+        std::vector<uint64_t>(values.begin() + 300, values.begin() + 777), 100
+    ).serialize());
+    assert (fixed.slice(301, 777).variable_blocks());
+
+    // Value ranges
+    const std::pair<uint64_t, uint64_t> ranges[] = {
+        {0, 1<<17}, {1000, 30000}, {values.at(10), values.at(10)}, {50000, 10}
+    };
+    for (const auto& r: ranges) {
+        std::vector<uint64_t> expected;
+        for (const uint64_t v: values) {
+            if (v >= r.first && v < r.second) expected.push_back(v);
+        }
+        assert (fixed.decode_range(r.first, r.second) == expected);
+        assert (variable.range(r.first, r.second).decode() == expected);
+    }
+
+    bool threw = false;
+    try {
+        fixed.slice(10, 2001);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+}
+
+void test_pef_construct_from_pointer() {
+    const std::vector<uint64_t> values = random_sorted_integers(1000, 1<<16);
+    const Sequence seq(values.data(), values.size(), 128);
+    assert (seq.n_elem() == values.size());
+    assert (seq.block_size() == 128);
+    assert (seq.decode() == values);
+    assert (seq.serialize() == Sequence(values, 128).serialize());
+
+    // the sortedness check can be skipped for inputs known to be sorted
+    const Sequence unchecked(values.data(), values.size(), 128, false);
+    assert (unchecked.serialize() == seq.serialize());
+
+    // ...but is on by default
+    const uint64_t unsorted[] = {3, 1, 2};
+    bool threw = false;
+    try {
+        Sequence bad(unsorted, 3);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+}
+
+void test_efblock_encoded_size() {
+    for (uint64_t max_value: {1ULL, 1ULL << 6, 1ULL << 16, 1ULL << 40}) {
+        for (uint32_t n: {1u, 2u, 63u, 64u, 65u, 256u}) {
+            const std::vector<uint64_t> values = random_sorted_integers(n, max_value);
+            const EFBlock blk(values.data(), n);
+            assert (EFBlock::encoded_size(values.data(), n) == blk.serialize().size());
+
+            // Encoding in place gives the same bytes, and decodes back
+            std::vector<uint64_t> buf(blk.serialize().size() / sizeof(uint64_t) + 1, ~0ULL);
+            uint8_t* dst = reinterpret_cast<uint8_t*>(buf.data());
+            assert (EFBlock::encode_into(values.data(), n, dst) == blk.serialize().size());
+            assert (std::string(reinterpret_cast<const char*>(dst), blk.serialize().size()) == blk.serialize());
+            assert (buf.back() == ~0ULL);
+            std::vector<uint64_t> decoded(n);
+            EFBlockView(dst).decode(decoded.data());
+            assert (decoded == values);
+
+            // The low bits are packed like BitWriter packs them
+            BitWriter bw;
+            for (const uint64_t v: values) {
+                bw.put((v - values.front()) & ((1ULL << blk.meta.l) - 1ULL), blk.meta.l);
+            }
+            if (blk.meta.l > 0) bw.flush();
+            assert (blk.low == bw.words);
+        }
+    }
+}
+
+void test_pef_construct_parallel() {
+    const std::vector<uint64_t> values = random_sorted_integers(100000, 1<<24);
+    const std::string expected = Sequence(values, 128).serialize();
+    for (unsigned n_threads: {0u, 2u, 3u, 8u, 1000u}) {
+        const Sequence seq(values.data(), values.size(), 128, true, n_threads);
+        assert (seq.serialize() == expected);
+        assert (Sequence(values, 128, n_threads).serialize() == expected);
+    }
+    // more threads than blocks, and no blocks at all
+    const std::vector<uint64_t> few(values.begin(), values.begin() + 10);
+    assert (Sequence(few, 128, 4).decode() == few);
+    assert (Sequence(std::vector<uint64_t>(), 128, 4).n_elem() == 0);
+}
+
 void test_pef_construct_from_sequence_empty() {
     const size_t n = 0;
     const uint32_t block_size = 1<<8;
@@ -354,6 +1005,451 @@ void test_pef_construct_from_file() {
     }
 }
 
+void test_sequence_mmap() {
+    const size_t n = 1333;
+    const uint64_t max_value = 1<<12;
+    const uint32_t block_size = 1<<8;
+
+    const std::vector<uint64_t> values = random_sorted_integers(n, max_value);
+    NamedTemporaryFile file("_test_file_mmap.pef");
+    Sequence pef(values, block_size);
+    pef.save(file.path);
+
+    Sequence mapped = Sequence::mmap(file.path);
+    assert (mapped.is_view());
+    assert (!pef.is_view());
+    assert (mapped.n_elem() == pef.n_elem());
+    assert (mapped.n_blocks() == pef.n_blocks());
+    assert (mapped.block_size() == pef.block_size());
+
+    // Check random access, membership and full decoding against the input
+    for (size_t i = 0; i < n; ++i) {
+        assert (mapped.get(i) == values.at(i));
+        assert (mapped.contains(values.at(i)));
+    }
+    const std::vector<uint64_t> recon = mapped.decode();
+    assert (recon == values);
+
+    // Copies share the mapping and outlive the original view
+    Sequence* copy = nullptr;
+    {
+        Sequence tmp = Sequence::mmap(file.path);
+        copy = new Sequence(tmp);
+    }
+    assert (copy->is_view());
+    assert (copy->decode() == values);
+
+    // Set operations work between views and in-memory Sequences
+    Sequence out = mapped.intersect(pef);
+    assert (out.decode() == values);
+    assert (!out.is_view());
+
+    // Serializing a view gives back the original bytes
+    assert (copy->serialize() == pef.serialize());
+    delete copy;
+}
+
+void test_sequence_from_buffer() {
+    const std::vector<uint64_t> values = random_sorted_integers(777, 1<<16);
+    const Sequence seq(values, 64);
+    const std::string serialized = seq.serialize();
+
+    // Aligned buffer: zero-copy view
+    std::vector<uint64_t> aligned((serialized.size() + 7) / 8);
+    std::memcpy(aligned.data(), serialized.data(), serialized.size());
+    const Sequence view = Sequence::from_buffer(aligned.data(), serialized.size());
+    assert (view.is_view());
+    assert (view.decode() == values);
+    // ... which hands back the buffer it views, as do its copies
+    size_t size = 0;
+    assert (view.view_buffer(size).get() == aligned.data() && size == serialized.size());
+    assert (Sequence(view).view_buffer(size).get() == aligned.data());
+
+    // Misaligned buffer: falls back to a copy
+    std::vector<uint8_t> misaligned(serialized.size() + 1);
+    std::memcpy(misaligned.data() + 1, serialized.data(), serialized.size());
+    const Sequence copy = Sequence::from_buffer(misaligned.data() + 1, serialized.size());
+    assert (!copy.is_view());
+    assert (copy.decode() == values);
+    assert (copy.view_buffer(size) == nullptr && size == 0);
+
+    // The buffer handed back outlives the view's switch to owned storage.
+    {
+        std::shared_ptr<std::vector<uint64_t> > owned(new std::vector<uint64_t>(aligned));
+        Sequence grown = Sequence::from_buffer(owned->data(), serialized.size(), owned);
+        const std::shared_ptr<const void> buffer = grown.view_buffer(size);
+        owned.reset();
+        grown.append(std::vector<uint64_t>{values.back() + 1});
+        assert (!grown.is_view() && grown.view_buffer(size) == nullptr);
+        assert (std::memcmp(buffer.get(), serialized.data(), serialized.size()) == 0);
+    }
+
+    // Serializing straight into a buffer
+    for (const uint32_t version: {1u, 2u}) {
+        const std::string expected = seq.serialize(version);
+        assert (seq.serialized_size(version) == expected.size());
+        std::vector<uint64_t> out((expected.size() + 7) / 8);
+        seq.serialize_into(out.data(), expected.size(), version);
+        assert (std::memcmp(out.data(), expected.data(), expected.size()) == 0);
+        assert (Sequence::from_buffer(out.data(), expected.size()).decode() == values);
+        bool threw = false;
+        try {
+            seq.serialize_into(out.data(), expected.size() - 1, version);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert (threw);
+    }
+
+    // Empty Sequence
+    const std::string empty = Sequence(std::vector<uint64_t>()).serialize();
+    std::vector<uint64_t> empty_buf((empty.size() + 7) / 8);
+    std::memcpy(empty_buf.data(), empty.data(), empty.size());
+    const Sequence empty_view = Sequence::from_buffer(empty_buf.data(), empty.size());
+    assert (empty_view.n_elem() == 0);
+    assert (!empty_view.contains(0));
+
+    // Corrupt block indices are rejected by every reader, aligned or not
+    auto rejects = [](const std::string& bytes) {
+        std::vector<uint64_t> buf((bytes.size() + 7) / 8);
+        std::memcpy(buf.data(), bytes.data(), bytes.size());
+        std::vector<uint8_t> shifted(bytes.size() + 1);
+        std::memcpy(shifted.data() + 1, bytes.data(), bytes.size());
+        int n_threw = 0;
+        for (int reader = 0; reader < 3; ++reader) {
+            try {
+                if (reader == 0) {
+                    Sequence::from_buffer(buf.data(), bytes.size());
+                } else if (reader == 1) {
+                    Sequence::from_buffer(shifted.data() + 1, bytes.size());
+                } else {
+                    std::istringstream in(bytes);
+                    Sequence copy(in);
+                }
+            } catch (const std::runtime_error&) {
+                ++n_threw;
+            }
+        }
+        return n_threw == 3;
+    };
+    auto poke = [](std::string bytes, size_t at, uint64_t v) {
+        std::memcpy(&bytes[at], &v, sizeof(v));
+        return bytes;
+    };
+    const Sequence variable = Sequence::optimal(values, 64);
+    assert (variable.variable_blocks() && variable.n_blocks() >= 3);
+    for (const Sequence* s: {&seq, &variable}) {
+        const uint64_t nb = s->n_blocks();
+        for (const uint32_t version: {1u, 2u}) {
+            const std::string bytes = s->serialize(version);
+            assert (!rejects(bytes));
+            // Where field *f* (0 = last, 1 = offset, 2 = begin) of block *bi* is
+            auto at = [&](uint64_t bi, int f) -> size_t {
+                if (version == 2) return V2_ALIGN + bi * sizeof(BlockEntry) + f * sizeof(uint64_t);
+                return sizeof(SequenceMetadata) + (f * nb + bi) * sizeof(uint64_t);
+            };
+            uint64_t off1, off2, payload_offset;
+            std::memcpy(&off1, &bytes[at(1, 1)], sizeof(off1));
+            std::memcpy(&off2, &bytes[at(2, 1)], sizeof(off2));
+            std::memcpy(&payload_offset, &bytes[offsetof(SequenceMetadata, payload_offset)], sizeof(payload_offset));
+            // n_blocks so large that the size of the index overflows
+            assert (rejects(poke(bytes, offsetof(SequenceMetadata, n_blocks), 1ULL << 61)));
+            // One block too few. (A variable-length Sequence's element
+            // counts are in its block headers, which aren't checked.)
+            if (!s->variable_blocks()) {
+                assert (rejects(poke(bytes, offsetof(SequenceMetadata, n_blocks), nb - 1)));
+            }
+            // Offsets out of order, or past the end of the payload
+            assert (rejects(poke(poke(bytes, at(1, 1), off2), at(2, 1), off1)));
+            assert (rejects(poke(bytes, at(nb - 1, 1), bytes.size() - payload_offset)));
+            assert (rejects(poke(bytes, at(0, 1), ~0ULL)));
+            // Block maxima out of order
+            assert (rejects(poke(bytes, at(0, 0), ~0ULL)));
+            if (s->variable_blocks()) {
+                assert (rejects(poke(bytes, at(1, 2), s->n_elem())));
+                assert (rejects(poke(bytes, at(0, 2), 1)));
+            }
+        }
+    }
+}
+
+void test_sequence_v2_format() {
+    // Fixed and variable-length blocks, sparse and dense (bitmap and run
+    // blocks), and empty
+    std::vector<uint64_t> dense;
+    for (uint64_t v = 0; dense.size() < 3000; v += 1 + (v % 97 == 0)) dense.push_back(v);
+    const std::vector<uint64_t> sparse = random_sorted_integers(5000, 1<<24);
+    const Sequence seqs[] = {
+        Sequence(sparse, 100), Sequence::optimal(sparse, 256), Sequence(dense, 64),
+        Sequence(std::vector<uint64_t>{}), Sequence(random_sorted_integers(16 * SKIP_MIN_BLOCKS + 5, 1ULL<<32), 16)
+    };
+    for (const Sequence& seq: seqs) {
+        const std::vector<uint64_t> values = seq.decode();
+        const std::string v1 = seq.serialize(), v2 = seq.serialize(2);
+        SequenceMetadata meta;
+        std::memcpy(&meta, v2.data(), sizeof(meta));
+        assert (meta.version == 2);
+        assert (meta.payload_offset % V2_ALIGN == 0);
+        assert (meta.payload_offset == V2_ALIGN + ((seq.n_blocks() * sizeof(BlockEntry) + V2_ALIGN - 1) / V2_ALIGN) * V2_ALIGN);
+
+        // Every block starts on a cache line, and the table describes it
+        for (uint64_t bi = 0; bi < seq.n_blocks(); ++bi) {
+            BlockEntry e;
+            std::memcpy(&e, v2.data() + V2_ALIGN + bi * sizeof(BlockEntry), sizeof(e));
+            assert (e.offset % V2_ALIGN == 0);
+            assert (e.begin == seq.block_begin(bi));
+            const std::vector<uint64_t> block = seq.decode_block(bi);
+            assert (e.floor == block.front() && e.last == block.back());
+        }
+
+        // Read into memory, and as a view
+        std::istringstream in(v2);
+        const Sequence read(in);
+        std::vector<uint64_t> buf(v2.size() / 8 + 1);
+        std::memcpy(buf.data(), v2.data(), v2.size());
+        const Sequence view = Sequence::from_buffer(buf.data(), v2.size());
+        std::vector<uint8_t> misaligned(v2.size() + 1);
+        std::memcpy(misaligned.data() + 1, v2.data(), v2.size());
+        const Sequence copied = Sequence::from_buffer(misaligned.data() + 1, v2.size());
+        for (const Sequence* s: {&read, &view, &copied}) {
+            assert (s->n_elem() == seq.n_elem() && s->n_blocks() == seq.n_blocks());
+            assert (s->variable_blocks() == seq.variable_blocks());
+            assert (s->decode() == values);
+            for (size_t i = 0; i < values.size(); i += 1 + values.size() / 500) {
+                assert (s->get(i) == values.at(i));
+                assert (s->contains(values.at(i)));
+                assert (s->lower_bound(values.at(i)) == seq.lower_bound(values.at(i)));
+                assert (s->lower_bound(values.at(i) + 1) == seq.lower_bound(values.at(i) + 1));
+                assert (s->next_geq(values.at(i) + 1) == seq.next_geq(values.at(i) + 1));
+                assert (s->prev_leq(values.at(i) + 1) == seq.prev_leq(values.at(i) + 1));
+            }
+            // Both formats can be written back from either
+            assert (s->serialize() == v1);
+            assert (s->serialize(2) == v2);
+            assert (s->intersect(seq).decode() == values);
+            Sequence::Cursor it(*s);
+            if (!values.empty()) {
+                it.skip_to(values.back());
+                assert (it.value() == values.back());
+            }
+        }
+        assert (view.is_view());
+    }
+
+    // mmap, and unknown versions
+    NamedTemporaryFile file("_test_file_v2.pef");
+    seqs[0].save(file.path, 2);
+    assert (Sequence::mmap(file.path).decode() == sparse);
+    assert (Sequence(file.path).decode() == sparse);
+    bool threw = false;
+    try {
+        seqs[0].serialize(3);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+}
+
+void test_sequence_builder() {
+    const std::vector<uint64_t> values = random_sorted_integers(5000, 1<<16);
+    const std::string expected = Sequence(values, 64).serialize();
+
+    // In memory, pushing one at a time or in runs
+    SequenceBuilder builder(64);
+    for (size_t i = 0; i < 1000; ++i) builder.push(values.at(i));
+    builder.push_many(values.data() + 1000, values.size() - 1000);
+    assert (builder.n_elem() == values.size());
+    assert (builder.finish().serialize() == expected);
+    assert (SequenceBuilder(64).finish().n_elem() == 0);
+
+    // Values must be nondecreasing
+    SequenceBuilder bad(4);
+    bad.push(5);
+    bad.push(5);
+    bool threw = false;
+    try {
+        bad.push(4);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+
+    // Streamed to a file, with room reserved for more elements than we push.
+    // The payload doesn't directly follow the block index here, but all of
+    // the readers should find it.
+    NamedTemporaryFile file("_test_file_builder.pef");
+    SequenceBuilder file_builder(file.path, values.size() + 1000, 64);
+    file_builder.push_many(values.data(), values.size());
+    file_builder.close();
+    assert (Sequence(file.path).decode() == values);
+    assert (Sequence(file.path).serialize() == expected);
+    const Sequence mapped = Sequence::mmap(file.path);
+    assert (mapped.decode() == values);
+    assert (mapped.serialize() == expected);
+
+    // Streamed after existing content in a stream
+    std::stringstream stream;
+    stream << "prefix..";
+    SequenceBuilder stream_builder(stream, values.size(), 64);
+    stream_builder.push_many(values.data(), values.size());
+    stream_builder.close();
+    std::istringstream in(stream.str().substr(8));
+    assert (Sequence(in).serialize() == expected);
+
+    // ...but no more than max_elem elements
+    std::stringstream small;
+    SequenceBuilder small_builder(small, 2, 64);
+    small_builder.push(1);
+    small_builder.push(2);
+    threw = false;
+    try {
+        small_builder.push(3);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+}
+
+void test_sequence_file_operations() {
+    const std::vector<uint64_t> a = random_sorted_integers(3000, 1<<10),
+                                b = random_sorted_integers(500, 1<<10);
+    const Sequence seq_a(a, 64),
+                   seq_b(b, 32);
+    NamedTemporaryFile file_a("_test_file_ops_a.pef"),
+                       file_b("_test_file_ops_b.pef"),
+                       file_out("_test_file_ops_out.pef");
+    seq_a.save(file_a.path);
+    seq_b.save(file_b.path);
+
+    intersect_files(file_a.path, file_b.path, file_out.path);
+    assert (Sequence(file_out.path).serialize() == seq_a.intersect(seq_b).serialize());
+    intersect_files(file_b.path, file_a.path, file_out.path);
+    assert (Sequence(file_out.path).serialize() == seq_b.intersect(seq_a).serialize());
+    difference_files(file_a.path, file_b.path, file_out.path);
+    assert (Sequence(file_out.path).serialize() == (seq_a - seq_b).serialize());
+    union_files(file_a.path, file_b.path, file_out.path);
+    assert (Sequence(file_out.path).serialize() == (seq_a | seq_b).serialize());
+    unique_file(file_a.path, file_out.path);
+    assert (Sequence(file_out.path).serialize() == seq_a.unique().serialize());
+    filter_by_count_file(file_a.path, file_out.path, 2, 4, false);
+    assert (Sequence(file_out.path).serialize() == seq_a.filter_by_count(2, 4, false).serialize());
+
+    // Outputs of the file operations are valid inputs, too
+    NamedTemporaryFile file_out2("_test_file_ops_out2.pef");
+    intersect_files(file_out.path, file_b.path, file_out2.path);
+    assert (Sequence::mmap(file_out2.path).serialize()
+        == seq_a.filter_by_count(2, 4, false).intersect(seq_b).serialize());
+
+    // Writing over an input is refused, and leaves the input intact
+    const std::string saved_a = Sequence(file_a.path).serialize();
+    std::vector<std::function<void()>> aliased = {
+        [&]() { intersect_files(file_a.path, file_b.path, file_a.path); },
+        [&]() { intersect_files(file_b.path, file_a.path, file_a.path); },
+        [&]() { difference_files(file_a.path, file_b.path, file_a.path); },
+        [&]() { union_files(file_b.path, file_a.path, file_a.path); },
+        [&]() { unique_file(file_a.path, file_a.path); },
+        [&]() { filter_by_count_file(file_a.path, file_a.path, 2, 4, false); },
+    };
+    for (const std::function<void()>& op: aliased) {
+        bool threw = false;
+        try {
+            op();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert (threw);
+        assert (Sequence(file_a.path).serialize() == saved_a);
+    }
+}
+
+void test_optimal_partition() {
+    const std::vector<uint64_t> values = clustered_integers(50, 300);
+    for (const uint32_t max_block_size: {1u, 7u, 256u, 100000u}) {
+        const std::vector<uint64_t> begins = optimal_partition(
+            values.data(), values.size(), max_block_size
+        );
+        assert (!begins.empty() && begins.front() == 0);
+        for (size_t bi = 0; bi < begins.size(); ++bi) {
+            const uint64_t end = (bi + 1 < begins.size()) ? begins.at(bi + 1) : values.size();
+            assert (begins.at(bi) < end);
+            assert (end - begins.at(bi) <= max_block_size);
+        }
+    }
+    assert (optimal_partition(values.data(), 0, 256).empty());
+}
+
+void test_sequence_optimal() {
+    const std::vector<uint64_t> values = clustered_integers(200, 500);
+    const Sequence seq = Sequence::optimal(values, 1024);
+    assert (seq.variable_blocks());
+    assert (seq.n_elem() == values.size());
+    assert (seq.decode() == values);
+
+    // Smaller than fixed-size blocks on clustered values
+    const Sequence fixed(values, 256);
+    assert (!fixed.variable_blocks());
+    assert (seq.serialize().size() < fixed.serialize().size());
+
+    // Random access and search
+    for (size_t i = 0; i < values.size(); i += 37) {
+        assert (seq.get(i) == values.at(i));
+        assert (seq.contains(values.at(i)));
+        assert (seq.lower_bound(values.at(i)) == fixed.lower_bound(values.at(i)));
+        assert (seq.lower_bound(values.at(i) + 1) == fixed.lower_bound(values.at(i) + 1));
+    }
+    uint64_t begin = 0;
+    for (uint64_t bi = 0; bi < seq.n_blocks(); ++bi) {
+        assert (seq.block_begin(bi) == begin);
+        assert (seq.decode_block(bi) == std::vector<uint64_t>(
+            values.begin() + begin, values.begin() + begin + seq.block_n_elem(bi)
+        ));
+        begin += seq.block_n_elem(bi);
+    }
+    assert (begin == values.size());
+
+    // Cursors, including ones over a range
+    Sequence::Cursor it(seq);
+    for (uint64_t x = 0; !it.at_end(); x += 1 << 16) {
+        it.skip_to(x);
+        assert (it.index() == fixed.lower_bound(x));
+    }
+    std::vector<uint64_t> recon;
+    for (Sequence::Cursor it_range(seq, 1234, 5678); !it_range.at_end(); it_range.next()) {
+        recon.push_back(it_range.value());
+    }
+    assert (recon == std::vector<uint64_t>(values.begin() + 1234, values.begin() + 5678));
+
+    // Set operations give the same results as with fixed-size blocks
+    const Sequence other(random_sorted_integers(10000, values.back()), 64);
+    assert (seq.intersect(other).decode() == fixed.intersect(other).decode());
+    assert ((seq | other).decode() == (fixed | other).decode());
+    assert ((seq - other).decode() == (fixed - other).decode());
+    assert (seq.intersect(other, 4).decode() == fixed.intersect(other).decode());
+    assert (other.union_with(seq, 4).decode() == (other | fixed).decode());
+
+    // Serialization round trips
+    const std::string serialized = seq.serialize();
+    std::istringstream in(serialized);
+    const Sequence deserialized(in);
+    assert (deserialized.variable_blocks());
+    assert (deserialized.serialize() == serialized);
+    std::vector<uint64_t> aligned((serialized.size() + 7) / 8);
+    std::memcpy(aligned.data(), serialized.data(), serialized.size());
+    const Sequence view = Sequence::from_buffer(aligned.data(), serialized.size());
+    assert (view.is_view());
+    assert (view.get(4321) == values.at(4321));
+    assert (view.decode() == values);
+    std::vector<uint8_t> misaligned(serialized.size() + 1);
+    std::memcpy(misaligned.data() + 1, serialized.data(), serialized.size());
+    assert (Sequence::from_buffer(misaligned.data() + 1, serialized.size()).serialize() == serialized);
+    const Sequence copy(view);
+    assert (copy.decode() == values);
+
+    // Same result with several threads; and an empty Sequence
+    assert (Sequence::optimal(values, 1024, 4).serialize() == serialized);
+    assert (Sequence::optimal(std::vector<uint64_t>()).n_elem() == 0);
+}
+
 void test_sequence_intersect() {
     const uint32_t block_size_0 = 2,
                    block_size_1 = 3;
@@ -401,6 +1497,28 @@ void test_sequence_intersect_with_gap() {
     assert (out.contains(145));
 }
 
+// Highly asymmetric sizes: a short list against a long one.
+void test_sequence_intersect_asymmetric() {
+    const std::vector<uint64_t> big = random_sorted_integers(200000, 1ULL<<24);
+    std::vector<uint64_t> small = random_sorted_integers(100, 1ULL<<24);
+    // make sure some of the small list's values hit
+    for (size_t i = 0; i < small.size(); i += 3) small[i] = big.at(i * 1999);
+    std::sort(small.begin(), small.end());
+    const Sequence seq_big(big), seq_small(small, 16);
+    std::vector<uint64_t> expected;
+    std::set_intersection(
+        small.begin(), small.end(), big.begin(), big.end(),
+        std::back_inserter(expected)
+    );
+    const Sequence out_0 = seq_small.intersect(seq_big),
+                   out_1 = seq_big.intersect(seq_small);
+    assert (out_0.decode() == expected);
+    assert (out_1.decode() == expected);
+    // the output keeps the block size of the left-hand side
+    assert (out_0.block_size() == 16);
+    assert (out_1.block_size() == 256);
+}
+
 void test_sequence_intersect_left_side_empty() {
     std::vector<uint64_t> values_0 {};
     std::vector<uint64_t> values_1 {2, 4, 5, 9, 11, 15};
@@ -757,6 +1875,465 @@ void test_sequence_difference_case1() {
     }
 }
 
+// Compare the set operations against the std:: multiset algorithms for a
+// range of sizes, densities and block sizes.
+void test_sequence_set_operations_random() {
+    const size_t sizes[][2] = {{0, 50}, {1, 1}, {300, 7}, {1000, 1000}, {5000, 40}};
+    const uint64_t max_values[] = {1<<6, 1<<16};
+    const uint32_t block_sizes[][2] = {{256, 256}, {7, 64}, {64, 3}};
+    for (const auto& sz: sizes) {
+        for (const uint64_t max_value: max_values) {
+            for (const auto& bs: block_sizes) {
+                const std::vector<uint64_t> a = random_sorted_integers(sz[0], max_value),
+                                            b = random_sorted_integers(sz[1], max_value);
+                const Sequence seq_a(a, bs[0]),
+                               seq_b(b, bs[1]);
+                std::vector<uint64_t> expected;
+                std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+                assert (seq_a.intersect(seq_b).decode() == expected);
+                assert (seq_b.intersect(seq_a).decode() == expected);
+                expected.clear();
+                std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+                assert ((seq_a | seq_b).decode() == expected);
+                expected.clear();
+                std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+                assert ((seq_a - seq_b).decode() == expected);
+                assert (seq_a.difference_count(seq_b) == expected.size());
+                assert (seq_a.intersect_count(seq_b) == seq_a.intersect(seq_b).n_elem());
+                assert (seq_a.union_count(seq_b) == (seq_a | seq_b).n_elem());
+                assert (seq_a.intersects(seq_b) == (seq_a.intersect_count(seq_b) > 0));
+                assert (seq_b.intersects(seq_a) == seq_a.intersects(seq_b));
+                expected.clear();
+                std::unique_copy(a.begin(), a.end(), std::back_inserter(expected));
+                assert (seq_a.unique().decode() == expected);
+            }
+        }
+    }
+}
+
+// Blocks of one input that don't overlap the other are copied into the
+// output of operator| and operator- without being decoded.
+void test_sequence_splice_blocks() {
+    // Two time-partitioned segments that overlap only near the boundary.
+    const std::vector<uint64_t> a = random_sorted_integers(5000, 1<<20);
+    std::vector<uint64_t> b = random_sorted_integers(5000, 1<<20);
+    for (uint64_t& v: b) v += (1<<20) - (1<<14);
+    const Sequence seq_a(a, 64), seq_b(b, 64);
+    std::vector<uint64_t> expected;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+    reset_stats();
+    const Sequence u = seq_a | seq_b;
+    const uint64_t copied = stats().blocks_copied;
+    assert (u.decode() == expected);
+    for (uint64_t i = 0; i < expected.size(); i += 97) assert (u.get(i) == expected[i]);
+    assert (u.contains(b.back()) && u.next_geq(a.back() + 1) > a.back());
+    std::istringstream in(u.serialize());
+    assert (Sequence(in).decode() == expected);
+    // Only the few blocks near the boundary are merged.
+    if (stats_enabled()) assert (copied >= seq_a.n_blocks() + seq_b.n_blocks() - 8);
+
+    // Remove a handful of values from the middle.
+    const std::vector<uint64_t> removed = {a.at(10), a.at(2500), a.at(2501)};
+    expected.clear();
+    std::set_difference(a.begin(), a.end(), removed.begin(), removed.end(), std::back_inserter(expected));
+    reset_stats();
+    const Sequence d = seq_a - Sequence(removed, 64);
+    if (stats_enabled()) assert (stats().blocks_copied >= seq_a.n_blocks() - 2);
+    assert (d.decode() == expected);
+    for (uint64_t i = 0; i < expected.size(); i += 31) assert (d.get(i) == expected[i]);
+    assert (d.variable_blocks());
+
+    // A full block copied onto a block boundary keeps fixed-size blocks,
+    // and gives exactly what encoding the values would.
+    std::vector<uint64_t> c(a.begin(), a.begin() + 640), e(b.begin(), b.begin() + 640);
+    const Sequence aligned = Sequence(c, 64) | Sequence(e, 64);
+    assert (!aligned.variable_blocks());
+    c.insert(c.end(), e.begin(), e.end());
+    std::sort(c.begin(), c.end());
+    assert (aligned.serialize() == Sequence(c, 64).serialize());
+
+    // Blocks larger than the output's block size are merged as usual, and
+    // equal values on either side of a block boundary are not duplicated.
+    const Sequence big(b, 256);
+    assert ((seq_a | big).decode() == (seq_a | seq_b).decode());
+    const std::vector<uint64_t> f = {1, 2, 3, 3}, g = {3, 3, 4, 5};
+    assert ((Sequence(f, 2) | Sequence(g, 2)).decode() == std::vector<uint64_t>({1, 2, 3, 3, 4, 5}));
+    assert ((Sequence(f, 2) - Sequence(g, 2)).decode() == std::vector<uint64_t>({1, 2}));
+}
+
+// Appending batches re-encodes only the last block, and gives the same
+// Sequence as encoding all the values at once.
+void test_sequence_append() {
+    std::mt19937 gen(rd());
+    const std::vector<uint64_t> values = random_sorted_integers(20000, 1ULL<<30);
+    Sequence seq(64);
+    for (size_t i = 0; i < values.size(); ) {
+        const size_t n = std::min<size_t>(1 + gen() % 300, values.size() - i);
+        seq.append(values.data() + i, n);
+        i += n;
+        assert (seq.n_elem() == i);
+    }
+    assert (seq.serialize() == Sequence(values, 64).serialize());
+    seq.append(std::vector<uint64_t>());
+    seq.append(std::vector<uint64_t>{values.back(), values.back() + 1});
+    assert (seq.n_elem() == values.size() + 2 && seq.get(values.size()) == values.back());
+
+    // Values must be sorted, and not less than the last element.
+    bool threw = false;
+    try {
+        seq.append(std::vector<uint64_t>{values.back() + 5, values.back() + 3});
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+    threw = false;
+    try {
+        seq.append(std::vector<uint64_t>{values.back()});
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+    assert (seq.n_elem() == values.size() + 2);
+
+    // A failed append leaves Cursors usable; a successful one invalidates
+    // them, however little it moved. (next checks only between blocks.)
+    Sequence::Cursor it(seq);
+    it.next();
+    assert (it.value() == values.at(1));
+    seq.append(std::vector<uint64_t>{values.back() + 2});
+    for (int op = 0; op < 3; ++op) {
+        threw = false;
+        try {
+            if (op == 0) it.check_valid();
+            else if (op == 1) it.skip_to(values.back());
+            else it.next_block();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert (threw);
+    }
+    Sequence::Cursor fresh(seq);
+    fresh.skip_to(values.back() + 2);
+    assert (fresh.index() == values.size() + 2);
+
+    // Appending to a view copies it first; the file is untouched.
+    const std::vector<uint64_t> head(values.begin(), values.begin() + 1000),
+                                rest(values.begin() + 1000, values.end());
+    for (const uint32_t version: {1u, 2u}) {
+        NamedTemporaryFile file("_test_append.pef");
+        Sequence(head, 64).save(file.path, version);
+        Sequence view = Sequence::mmap(file.path);
+        view.append(rest);
+        assert (!view.is_view());
+        assert (view.decode() == values);
+        assert (Sequence(file.path).decode() == head);
+    }
+
+    // Variable-length blocks keep their boundaries up to the last block.
+    Sequence optimal = Sequence::optimal(head, 256);
+    optimal.append(rest);
+    assert (optimal.variable_blocks() && optimal.decode() == values);
+    for (uint64_t i = 0; i < values.size(); i += 101) assert (optimal.get(i) == values[i]);
+
+    // The skip index and the block cache are rebuilt for the new blocks.
+    std::vector<uint64_t> big = random_sorted_integers(70000, 1ULL<<40);
+    Sequence large(big, 16);
+    large.enable_cache(1<<16);
+    assert (large.contains(big[12345]) && large.get(500) == big[500]);
+    const std::vector<uint64_t> more = {big.back() + 1, big.back() + 10, big.back() + 10};
+    large.append(more);
+    big.insert(big.end(), more.begin(), more.end());
+    assert (large.contains(big.back()) && large.lower_bound(big.back()) == big.size() - 2);
+    assert (large.get(big.size() - 3) == big[big.size() - 3]);
+    assert (large.decode() == big);
+}
+
+// Out-of-order values go through Sequence::insert, directly or batched by
+// an InsertBuffer.
+void test_sequence_insert() {
+    std::mt19937 gen(rd());
+    std::vector<uint64_t> expected = random_sorted_integers(5000, 1<<20);
+    Sequence seq(expected, 64);
+    for (int batch = 0; batch < 20; ++batch) {
+        // Mostly near the end, sometimes anywhere, with repeats.
+        const uint64_t lo = batch % 4 ? expected.back() - (1<<12) : 0;
+        std::vector<uint64_t> values = random_sorted_integers(1 + gen() % 200, (1<<20) - lo);
+        for (uint64_t& v: values) v += lo;
+        values.push_back(values.back());
+        seq.insert(values);
+        std::vector<uint64_t> merged;
+        std::merge(expected.begin(), expected.end(), values.begin(), values.end(), std::back_inserter(merged));
+        expected.swap(merged);
+        assert (seq.decode() == expected);
+    }
+    assert (!seq.variable_blocks());
+    assert (seq.serialize() == Sequence(expected, 64).serialize());
+    Sequence empty(32);
+    empty.insert(std::vector<uint64_t>{3, 3, 7});
+    assert (empty.decode() == std::vector<uint64_t>({3, 3, 7}));
+    bool threw = false;
+    try {
+        empty.insert(std::vector<uint64_t>{2, 1});
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+
+    std::vector<uint64_t> values = random_sorted_integers(3000, 1<<16);
+    std::vector<uint64_t> shuffled = values;
+    std::shuffle(shuffled.begin(), shuffled.end(), gen);
+    Sequence buffered(64);
+    InsertBuffer buffer(buffered, 500);
+    for (size_t i = 0; i < shuffled.size(); ++i) {
+        buffer.insert(shuffled[i]);
+        assert (buffer.size() == (i + 1) % 500);
+        assert (buffered.n_elem() == (i + 1) / 500 * 500);
+    }
+    buffer.flush();
+    assert (buffer.size() == 0);
+    assert (buffered.decode() == values);
+}
+
+// Many Sequences in one file, each opened as a view of the mapping.
+void test_sequence_collection() {
+    NamedTemporaryFile file("_test_collection.pec");
+    std::vector<std::vector<uint64_t> > lists;
+    const uint64_t terms[] = {3, 4, 10, 1000, 1ULL << 40};
+    for (const uint32_t version: {1u, 2u}) {
+        lists.clear();
+        SequenceCollectionWriter writer(file.path, version);
+        for (size_t k = 0; k < 5; ++k) {
+            lists.push_back(random_sorted_integers(k == 1 ? 0 : 100 + 700 * k, 1<<20));
+            if (k % 2) {
+                // Stream the odd ones through a builder.
+                const std::shared_ptr<SequenceBuilder> builder = writer.build(terms[k], lists[k].size(), 32);
+                for (const uint64_t v: lists[k]) builder->push(v);
+            } else {
+                writer.add(terms[k], Sequence(lists[k], 64));
+            }
+            assert (writer.size() == k + 1);
+        }
+        bool threw = false;
+        try {
+            writer.add(5, Sequence(lists[0], 64));
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert (threw);
+        writer.close();
+
+        const SequenceCollection collection(file.path);
+        assert (collection.size() == 5);
+        assert (collection.terms() == std::vector<uint64_t>(terms, terms + 5));
+        assert (!collection.contains(5) && collection.contains(1000));
+        for (size_t k = 0; k < 5; ++k) {
+            const CollectionEntry e = collection.entry(k);
+            assert (e.term == terms[k] && e.n_elem == lists[k].size());
+            assert (e.block_size == (k % 2 ? 32u : 64u) && e.offset % V2_ALIGN == 0);
+            const Sequence seq = collection.get(terms[k]);
+            assert (seq.is_view() && seq.decode() == lists[k]);
+            assert (seq.block_size() == e.block_size);
+            if (!lists[k].empty()) assert (seq.contains(lists[k][lists[k].size() / 2]));
+        }
+        threw = false;
+        try {
+            collection.get(5);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert (threw);
+        // Views outlive the collection they came from.
+        std::unique_ptr<Sequence> last;
+        {
+            const SequenceCollection tmp(file.path);
+            last.reset(new Sequence(tmp.get(terms[4])));
+        }
+        assert (last->decode() == lists[4]);
+    }
+
+    // Builders can be held past their turn, and past their writer, but
+    // refuse values from then on.
+    std::shared_ptr<SequenceBuilder> stale, orphan;
+    {
+        SequenceCollectionWriter writer(file.path);
+        stale = writer.build(1, 10);
+        stale->push(5);
+        writer.add(2, Sequence(lists[0], 64));
+        orphan = writer.build(3, 10);
+        orphan->push(7);
+    }
+    for (SequenceBuilder* builder: {stale.get(), orphan.get()}) {
+        bool threw = false;
+        try {
+            builder->push(100);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert (threw && builder->n_elem() == 1);
+        builder->close();
+    }
+
+    // An empty collection, and files that aren't collections.
+    {
+        SequenceCollectionWriter writer(file.path);
+        writer.close();
+    }
+    assert (SequenceCollection(file.path).size() == 0);
+    Sequence(lists[0]).save(file.path);
+    bool threw = false;
+    try {
+        SequenceCollection collection(file.path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert (threw);
+}
+
+// The const API is safe to call from many threads on one Sequence: here a
+// mapped view (so that copies share its buffer) with a block cache.
+void test_sequence_concurrent_reads() {
+    const std::vector<uint64_t> values = random_sorted_integers(300000, 1ULL<<32),
+                                other_values = random_sorted_integers(20000, 1ULL<<32);
+    NamedTemporaryFile file("_test_concurrent_reads.pef");
+    Sequence(values, 64).save(file.path, 2);
+    Sequence seq = Sequence::mmap(file.path);
+    seq.enable_cache(1<<20);
+    const Sequence other(other_values, 128);
+
+    // Answers from a single thread first.
+    const std::string serialized = seq.serialize(),
+                      expected_and = seq.intersect(other).serialize(),
+                      expected_unique = seq.unique().serialize(),
+                      expected_filter = seq.filter_by_count(2, 10, false).serialize();
+    const std::vector<uint64_t> expected_or = (seq | other).decode(),
+                                expected_sub = (seq - other).decode();
+    const uint64_t union_count = seq.union_count(other);
+
+    std::vector<std::thread> readers;
+    std::atomic<bool> ok(true);
+    for (unsigned t = 0; t < 8; ++t) {
+        readers.emplace_back([&, t]() {
+            std::mt19937_64 gen(t);
+            const Sequence copy(seq);
+            for (int round = 0; round < 3; ++round) {
+                if (copy.decode() != values || seq.serialize() != serialized) ok = false;
+                if (seq.intersect(other).serialize() != expected_and) ok = false;
+                if ((seq | other).decode() != expected_or) ok = false;
+                if ((seq - other).decode() != expected_sub) ok = false;
+                if (seq.unique().serialize() != expected_unique) ok = false;
+                if (seq.filter_by_count(2, 10, false).serialize() != expected_filter) ok = false;
+                if (seq.union_count(other) != union_count) ok = false;
+                std::vector<uint64_t> indices(1000), out(1000);
+                for (uint64_t& i: indices) i = gen() % values.size();
+                seq.get_many(indices.data(), indices.size(), out.data());
+                for (size_t k = 0; k < indices.size(); ++k) {
+                    if (out[k] != values[indices[k]] || seq.get(indices[k]) != values[indices[k]]) ok = false;
+                }
+                const uint64_t i = gen() % values.size(), j = std::min<uint64_t>(i + 5000, values.size());
+                if (seq.decode_slice(i, j) != std::vector<uint64_t>(values.begin() + i, values.begin() + j)) ok = false;
+                Sequence::Cursor it(seq);
+                it.skip_to(values[i]);
+                if (it.at_end() || it.value() != values[i]) ok = false;
+            }
+        });
+    }
+    for (auto& r: readers) r.join();
+    assert (ok);
+}
+
+// The multithreaded set operations should give the same Sequence as the
+// single-threaded ones (the same values, for union and difference, whose
+// single-threaded versions may copy blocks of the inputs as they are).
+void test_sequence_set_operations_parallel() {
+    const size_t sizes[][2] = {{0, 50}, {1, 1}, {3000, 70}, {20000, 20000}, {50, 30000}};
+    const uint64_t max_values[] = {1<<3, 1<<16, 1ULL<<40};
+    for (const auto& sz: sizes) {
+        for (const uint64_t max_value: max_values) {
+            const Sequence seq_a(random_sorted_integers(sz[0], max_value), 64),
+                           seq_b(random_sorted_integers(sz[1], max_value), 100);
+            const std::string expected_and = seq_a.intersect(seq_b).serialize();
+            const std::vector<uint64_t> expected_or = (seq_a | seq_b).decode(),
+                                        expected_sub = (seq_a - seq_b).decode();
+            for (unsigned n_threads: {2u, 3u, 16u, 10000u}) {
+                assert (seq_a.intersect(seq_b, n_threads).serialize() == expected_and);
+                assert (seq_a.union_with(seq_b, n_threads).decode() == expected_or);
+                assert (seq_a.difference(seq_b, n_threads).decode() == expected_sub);
+            }
+        }
+    }
+}
+
+// k-ary set operations should match chains of the binary ones.
+void test_sequence_intersect_and_union_many() {
+    const size_t sizes[] = {5000, 200, 3000, 40, 7000};
+    const uint64_t max_values[] = {1<<5, 1<<14};
+    for (const uint64_t max_value: max_values) {
+        std::vector<Sequence> seqs;
+        for (size_t i = 0; i < 5; ++i) {
+            seqs.emplace_back(random_sorted_integers(sizes[i], max_value), 32 + i);
+        }
+        std::vector<const Sequence*> ptrs;
+        for (const auto& seq: seqs) ptrs.push_back(&seq);
+        std::vector<uint64_t> expected_and = seqs[0].decode(),
+                              expected_or = seqs[0].decode();
+        for (size_t i = 1; i < seqs.size(); ++i) {
+            const std::vector<uint64_t> values = seqs[i].decode();
+            std::vector<uint64_t> tmp;
+            std::set_intersection(
+                expected_and.begin(), expected_and.end(), values.begin(), values.end(),
+                std::back_inserter(tmp)
+            );
+            expected_and.swap(tmp);
+            tmp.clear();
+            std::set_union(
+                expected_or.begin(), expected_or.end(), values.begin(), values.end(),
+                std::back_inserter(tmp)
+            );
+            expected_or.swap(tmp);
+        }
+        const Sequence out_and = intersect_many(ptrs),
+                       out_or = union_many(ptrs);
+        assert (out_and.decode() == expected_and);
+        assert (out_or.decode() == expected_or);
+        assert (out_and.block_size() == seqs[0].block_size());
+        assert (out_or.block_size() == seqs[0].block_size());
+    }
+
+    // Degenerate cases
+    const Sequence a(std::vector<uint64_t>{1, 2, 2, 5}),
+                   empty(std::vector<uint64_t>{});
+    assert (intersect_many({}).n_elem() == 0);
+    assert (union_many({}).n_elem() == 0);
+    assert (intersect_many({&a}).decode() == a.decode());
+    assert (union_many({&a}).decode() == a.decode());
+    assert (intersect_many({&a, &empty}).n_elem() == 0);
+    assert (union_many({&empty, &a}).decode() == a.decode());
+}
+
+void test_sequence_intersects() {
+    const Sequence a(std::vector<uint64_t>{1, 5, 9, 100}, 2),
+                   b(std::vector<uint64_t>{2, 6, 10, 101}, 3),
+                   c(std::vector<uint64_t>{0, 3, 100}),
+                   empty(std::vector<uint64_t>{});
+    assert (!a.intersects(b));
+    assert (a.intersects(c));
+    assert (c.intersects(a));
+    assert (!a.intersects(empty));
+    assert (a.intersect_count(c) == 1);
+    assert (a.union_count(b) == 8);
+    assert (a.difference_count(c) == 3);
+    assert (a.difference_count(empty) == 4);
+    assert (empty.union_count(a) == 4);
+}
+
+void test_sequence_difference_right_side_empty() {
+    std::vector<uint64_t> values0 {1, 3, 3, 4, 5, 11};
+    const Sequence seq0(values0, 4);
+    const Sequence seq1(std::vector<uint64_t>{});
+    assert ((seq0 - seq1).decode() == values0);
+    assert ((seq1 - seq0).n_elem() == 0);
+}
+
 void test_efblock_serialize_1elem() {
     const size_t n = 1ULL;
     std::vector<uint64_t> values = random_sorted_integers(n, 1<<16);
@@ -837,12 +2414,38 @@ void test_driver() {
     std::cout << "test_efblock\n";
     test_efblock();
 
+    std::cout << "test_efblock_decode_all_widths\n";
+    test_efblock_decode_all_widths();
+
+    std::cout << "test_efblock_view_get\n";
+    test_efblock_view_get();
+
+    std::cout << "test_efblock_encodings\n";
+    test_efblock_encodings();
+
+    std::cout << "test_sequence_cache\n";
+    test_sequence_cache();
+    std::cout << "test_sequence_skip_index\n";
+    test_sequence_skip_index();
+    std::cout << "test_stats\n";
+    test_stats();
+    std::cout << "test_sequence_batched_lookups\n";
+    test_sequence_batched_lookups();
+
     std::cout << "test_sequence_get\n";
     test_sequence_get();
 
     std::cout << "test_sequence_contains\n";
     test_sequence_contains();
 
+    std::cout << "test_sequence_lower_bound\n";
+    test_sequence_lower_bound();
+    std::cout << "test_sequence_rank_prev_leq\n";
+    test_sequence_rank_prev_leq();
+
+    std::cout << "test_sequence_cursor\n";
+    test_sequence_cursor();
+
     std::cout << "test_efblock_size_one\n";
     test_efblock_size_one();
 
@@ -852,18 +2455,51 @@ void test_driver() {
     std::cout << "test_pef_construct_from_sequence_ragged\n";
     test_pef_construct_from_sequence_ragged();
 
+    std::cout << "test_sequence_decode_into\n";
+    test_sequence_decode_into();
+    std::cout << "test_sequence_slice\n";
+    test_sequence_slice();
+
+    std::cout << "test_pef_construct_from_pointer\n";
+    test_pef_construct_from_pointer();
+    test_efblock_encoded_size();
+    test_pef_construct_parallel();
+
     std::cout << "test_pef_construct_from_sequence_empty\n";
     test_pef_construct_from_sequence_empty();
 
     std::cout << "test_pef_construct_from_file\n";
     test_pef_construct_from_file();
 
+    std::cout << "test_sequence_mmap\n";
+    test_sequence_mmap();
+
+    std::cout << "test_sequence_from_buffer\n";
+    test_sequence_from_buffer();
+    std::cout << "test_sequence_v2_format\n";
+    test_sequence_v2_format();
+
+    std::cout << "test_sequence_builder\n";
+    test_sequence_builder();
+
+    std::cout << "test_sequence_file_operations\n";
+    test_sequence_file_operations();
+
+    std::cout << "test_optimal_partition\n";
+    test_optimal_partition();
+
+    std::cout << "test_sequence_optimal\n";
+    test_sequence_optimal();
+
     std::cout << "test_sequence_intersect\n";
     test_sequence_intersect();
 
     std::cout << "test_sequence_intersect_with_gap\n";
     test_sequence_intersect_with_gap();
 
+    std::cout << "test_sequence_intersect_asymmetric\n";
+    test_sequence_intersect_asymmetric();
+
     std::cout << "test_sequence_intersect_left_side_empty\n";
     test_sequence_intersect_left_side_empty();
 
@@ -921,6 +2557,31 @@ void test_driver() {
     std::cout << "test_sequence_difference_case1\n";
     test_sequence_difference_case1();
 
+    std::cout << "test_sequence_set_operations_random\n";
+    test_sequence_set_operations_random();
+
+    std::cout << "test_sequence_splice_blocks\n";
+    test_sequence_splice_blocks();
+    std::cout << "test_sequence_append\n";
+    test_sequence_append();
+    std::cout << "test_sequence_insert\n";
+    test_sequence_insert();
+    std::cout << "test_sequence_collection\n";
+    test_sequence_collection();
+    std::cout << "test_sequence_concurrent_reads\n";
+    test_sequence_concurrent_reads();
+    std::cout << "test_sequence_set_operations_parallel\n";
+    test_sequence_set_operations_parallel();
+
+    std::cout << "test_sequence_intersect_and_union_many\n";
+    test_sequence_intersect_and_union_many();
+
+    std::cout << "test_sequence_intersects\n";
+    test_sequence_intersects();
+
+    std::cout << "test_sequence_difference_right_side_empty\n";
+    test_sequence_difference_right_side_empty();
+
     std::cout << "test_efblock_serialize_1elem\n";
     test_efblock_serialize_1elem();
 